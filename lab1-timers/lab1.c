@@ -144,7 +144,7 @@ update_lcd(void)
 {
     char buf[128];
     clear();
-    sprintf(buf, "ticks: %lu", g_timers_state.ms_ticks);
+    sprintf(buf, "ticks: %lu", timers_get_uptime_ms());
     print(buf);
 }
 
@@ -30,6 +30,7 @@ ISR(TIMER1_COMPA_vect) {
     // This the Interrupt Service Routine for tracking green toggles. The toggling is done in hardware.
     // Each time the TCNT count is equal to the OCRxx register, this interrupt is enabled.
     // This interrupts at the user-specified frequency for the green LED.
+    timers_compare_match(TIMER_COUNTER1);
 #ifdef ENABLE_INTERRUPTS
     sei();
 #endif
@@ -50,6 +51,7 @@ ISR(TIMER3_COMPA_vect) {
     // At creation of this file, it was initialized to interrupt every 100ms (10Hz).
     //
     // Increment ticks. If time, toggle YELLOW and increment toggle counter.
+    timers_compare_match(TIMER_COUNTER3);
 #ifdef ENABLE_INTERRUPTS
     sei();
 #endif
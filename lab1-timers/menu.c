@@ -35,7 +35,7 @@ static int leds_set_toggle(char color, const uint16_t ms) {
         } else {
             LED_ENABLE(RED);
         }
-        g_timers_state->red_period = ms;
+        timers_set_red_period(ms);
     }
 
     if ((color == 'Y') || (color == 'A')) {
@@ -43,7 +43,7 @@ static int leds_set_toggle(char color, const uint16_t ms) {
             LED_DISABLE(YELLOW);
         } else {
             LED_ENABLE(YELLOW);
-            timers_setup_timer(TIMER_COUNTER3, TIMER_MODE_CTC, us);
+            timers_set_period(TIMER_COUNTER3, TIMER_MODE_CTC, us, TIMER_UPDATE_AT_MATCH);
         }
         g_timers_state->yellow_period = ms;
     }
@@ -54,7 +54,7 @@ static int leds_set_toggle(char color, const uint16_t ms) {
             LED_DISABLE(GREEN);
         } else {
             LED_ENABLE(GREEN);
-            timers_setup_timer(TIMER_COUNTER1, TIMER_MODE_CTC, us);
+            timers_set_period(TIMER_COUNTER1, TIMER_MODE_CTC, us, TIMER_UPDATE_AT_MATCH);
         }
         g_timers_state->green_period = ms;
     }
@@ -7,6 +7,28 @@ static task_t * g_tasks = NULL;
 static uint8_t g_number_tasks = 0;
 static timers_state_t * g_timers_state;
 
+/*
+ * Timing wheel of pending releases
+ *
+ * Each task lives in the slot matching the low bits of its next release
+ * tick.  On every tick only the tasks in the current slot are looked at,
+ * so the ISR does not have to walk (or divide against) the whole task
+ * table.  Tasks with a period longer than the wheel are simply passed
+ * over until the wheel comes around to their release tick.
+ */
+static task_t * g_wheel[SCHEDULER_WHEEL_SLOTS];
+
+/*
+ * Add a task to the wheel slot for its next release
+ */
+static void
+scheduler_wheel_insert(task_t * task)
+{
+    task_t ** slot = &g_wheel[task->next_release_ms & SCHEDULER_WHEEL_MASK];
+    task->next = *slot;
+    *slot = task;
+}
+
 /*
  * Initialize the scheduler
  */
@@ -14,11 +36,21 @@ int
 scheduler_init(timers_state_t * timers_state, task_t * tasks, uint8_t number_tasks)
 {
     int i;
+    uint32_t now;
     g_timers_state = timers_state;
     g_tasks = tasks;
     g_number_tasks = number_tasks;
+    for (i = 0; i < SCHEDULER_WHEEL_SLOTS; i++) {
+        g_wheel[i] = NULL;
+    }
+
+    /* first release is on the next multiple of the period, which is
+     * when the old `ms_ticks % period_ms == 0` check would have fired */
+    now = g_timers_state->ms_ticks;
     for (i = 0; i < number_tasks; i++) {
         tasks[i].state = TASK_STATE_IDLE;
+        tasks[i].next_release_ms = (now / tasks[i].period_ms + 1) * tasks[i].period_ms;
+        scheduler_wheel_insert(&tasks[i]);
     }
     return 0;
 }
@@ -29,14 +61,29 @@ scheduler_init(timers_state_t * timers_state, task_t * tasks, uint8_t number_tas
 void
 scheduler_do_schedule(void)
 {
-    int i;
+    uint32_t now = g_timers_state->ms_ticks;
+    task_t ** link = &g_wheel[now & SCHEDULER_WHEEL_MASK];
+    task_t * released = NULL;
     task_t * task;
-    for (i = 0; i < g_number_tasks; i++) {
-        task = &g_tasks[i];
-        if (g_timers_state->ms_ticks % task->period_ms == 0) {
-            task->state = true;
+
+    /* pull the tasks that are due out of the current slot */
+    while ((task = *link) != NULL) {
+        if (task->next_release_ms == now) {
+            *link = task->next;
+            task->next = released;
+            released = task;
+        } else {
+            link = &task->next;
         }
     }
+
+    /* release them and file them under their next release */
+    while ((task = released) != NULL) {
+        released = task->next;
+        task->state = TASK_STATE_READY;
+        task->next_release_ms += task->period_ms;
+        scheduler_wheel_insert(task);
+    }
 }
 
 /*
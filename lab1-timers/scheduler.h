@@ -5,17 +5,25 @@
 #include <stdbool.h>
 #include "timers.h"
 
+/* Number of slots in the release timing wheel (must be a power of 2) */
+#define SCHEDULER_WHEEL_SLOTS (64)
+#define SCHEDULER_WHEEL_MASK  (SCHEDULER_WHEEL_SLOTS - 1)
+
 typedef enum {
     TASK_STATE_IDLE,
     TASK_STATE_READY,
     TASK_STATE_RUNNING
 } task_state_t;
 
-typedef struct {
+typedef struct _task_t {
     char * task_name;
     uint16_t period_ms;
     void (*run_task)(void);
     volatile task_state_t  state;
+    /* tick (ms) at which this task is next released */
+    uint32_t next_release_ms;
+    /* next task hashed to the same timing wheel slot */
+    struct _task_t * next;
 } task_t;
 
 int scheduler_init(timers_state_t * timers_state, task_t * tasks, uint8_t number_tasks);
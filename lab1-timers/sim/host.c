@@ -0,0 +1,85 @@
+/*
+ * Host side of the timer tests (see timers_sweep.c)
+ *
+ * The registers timers.c writes are plain variables, and the rest of
+ * lab1 it calls into (logging, the scheduler) does nothing.
+ */
+#include <stdint.h>
+#include <avr/io.h>
+#include "host.h"
+#include "log.h"
+#include "scheduler.h"
+
+volatile uint8_t TCCR0A;
+volatile uint8_t TCCR0B;
+volatile uint8_t OCR0A;
+volatile uint8_t TCNT0;
+volatile uint8_t TIMSK0;
+volatile uint8_t TCCR1A;
+volatile uint8_t TCCR1B;
+volatile uint16_t OCR1A;
+volatile uint16_t TCNT1;
+volatile uint8_t TIMSK1;
+volatile uint8_t TCCR3A;
+volatile uint8_t TCCR3B;
+volatile uint16_t OCR3A;
+volatile uint16_t TCNT3;
+volatile uint8_t TIMSK3;
+volatile uint8_t DDRA;
+volatile uint8_t DDRD;
+volatile uint8_t PORTA;
+volatile uint8_t PORTD;
+
+void log_message(log_level_e lvl, char * fmt, ...)
+{
+}
+
+void scheduler_do_schedule(void)
+{
+}
+
+/*
+ * Prescaler for CSn2:0 (the same on TC0, TC1 and TC3), 0 when stopped or
+ * clocked externally
+ */
+uint16_t host_timer_divisor(timer_counter_e timer_counter)
+{
+    static const uint16_t divisors[8] = {0, 1, 8, 64, 256, 1024, 0, 0};
+    switch (timer_counter) {
+    case TIMER_COUNTER0:
+        return divisors[TCCR0B & 7];
+    case TIMER_COUNTER1:
+        return divisors[TCCR1B & 7];
+    default:
+        return divisors[TCCR3B & 7];
+    }
+}
+
+uint16_t host_timer_top(timer_counter_e timer_counter)
+{
+    switch (timer_counter) {
+    case TIMER_COUNTER0:
+        return OCR0A;
+    case TIMER_COUNTER1:
+        return OCR1A;
+    default:
+        return OCR3A;
+    }
+}
+
+uint16_t host_timer_width(timer_counter_e timer_counter)
+{
+    return timer_counter == TIMER_COUNTER0 ? 0xFF : 0xFFFF;
+}
+
+char const * host_timer_name(timer_counter_e timer_counter)
+{
+    switch (timer_counter) {
+    case TIMER_COUNTER0:
+        return "TC0";
+    case TIMER_COUNTER1:
+        return "TC1";
+    default:
+        return "TC3";
+    }
+}
@@ -0,0 +1,16 @@
+/*
+ * host.h (see host.c)
+ */
+#ifndef SIM_HOST_H_
+#define SIM_HOST_H_
+
+#include <stdint.h>
+#include "timers.h"
+
+/* what a timer has been programmed with, read back from its registers */
+uint16_t host_timer_divisor(timer_counter_e timer_counter);
+uint16_t host_timer_top(timer_counter_e timer_counter);
+uint16_t host_timer_width(timer_counter_e timer_counter);
+char const * host_timer_name(timer_counter_e timer_counter);
+
+#endif /* SIM_HOST_H_ */
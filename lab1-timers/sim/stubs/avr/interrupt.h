@@ -0,0 +1,16 @@
+/*
+ * Host stand-in for <avr/interrupt.h> (see host.c)
+ *
+ * The tests call the compare match handling themselves, between calls
+ * into timers.c, so there is nothing for cli()/sei() to mask.
+ */
+#ifndef SIM_AVR_INTERRUPT_H_
+#define SIM_AVR_INTERRUPT_H_
+
+#define sei() ((void)0)
+#define cli() ((void)0)
+
+/* an ISR is a plain function, which nothing on the host calls */
+#define ISR(vector) void vector(void)
+
+#endif /* SIM_AVR_INTERRUPT_H_ */
@@ -0,0 +1,59 @@
+/*
+ * Host stand-in for <avr/io.h> (see host.c)
+ *
+ * Only the registers and bits timers.c and leds.h use.  They are plain
+ * variables, defined in host.c, which the tests read back (and, for the
+ * counters, drive).
+ */
+#ifndef SIM_AVR_IO_H_
+#define SIM_AVR_IO_H_
+
+#include <stdint.h>
+
+extern volatile uint8_t TCCR0A;
+extern volatile uint8_t TCCR0B;
+extern volatile uint8_t OCR0A;
+extern volatile uint8_t TCNT0;
+extern volatile uint8_t TIMSK0;
+extern volatile uint8_t TCCR1A;
+extern volatile uint8_t TCCR1B;
+extern volatile uint16_t OCR1A;
+extern volatile uint16_t TCNT1;
+extern volatile uint8_t TIMSK1;
+extern volatile uint8_t TCCR3A;
+extern volatile uint8_t TCCR3B;
+extern volatile uint16_t OCR3A;
+extern volatile uint16_t TCNT3;
+extern volatile uint8_t TIMSK3;
+extern volatile uint8_t DDRA;
+extern volatile uint8_t DDRD;
+extern volatile uint8_t PORTA;
+extern volatile uint8_t PORTD;
+
+#define WGM00   (0)
+#define WGM01   (1)
+#define WGM02   (3)
+#define CS00    (0)
+#define CS01    (1)
+#define CS02    (2)
+#define OCIE0A  (1)
+#define WGM10   (0)
+#define WGM11   (1)
+#define WGM12   (3)
+#define WGM13   (4)
+#define CS10    (0)
+#define CS11    (1)
+#define CS12    (2)
+#define COM1A0  (6)
+#define OCIE1A  (1)
+#define WGM30   (0)
+#define WGM31   (1)
+#define WGM32   (3)
+#define WGM33   (4)
+#define CS30    (0)
+#define CS31    (1)
+#define CS32    (2)
+#define OCIE3A  (1)
+#define DDD5    (5)
+
+#endif /* SIM_AVR_IO_H_ */
@@ -0,0 +1,11 @@
+/*
+ * Host stand-in for <util/atomic.h> (see host.c)
+ */
+#ifndef SIM_UTIL_ATOMIC_H_
+#define SIM_UTIL_ATOMIC_H_
+
+#define ATOMIC_RESTORESTATE (0)
+#define ATOMIC_FORCEON      (1)
+#define ATOMIC_BLOCK(type) for (int __todo = 1; __todo; __todo = 0)
+
+#endif /* SIM_UTIL_ATOMIC_H_ */
@@ -0,0 +1,364 @@
+/*
+ * Live period change test
+ *
+ * Changes the period of a running 16-bit timer (TC1 or TC3, in CTC mode)
+ * at random points with timers_set_period() from timers.c, and measures
+ * when the compare matches around the change come.  The timer itself is
+ * a model of the hardware, run a timer clock at a time:
+ *
+ *  - the prescaler runs free, so clk/N edges fall on multiples of N CPU
+ *    cycles whatever the timer was doing when its clock select changed
+ *  - on an edge with TCNT equal to OCRnA the counter is cleared and the
+ *    compare ISR runs (straight away), which calls timers_compare_match()
+ *  - otherwise TCNT counts up, wrapping past TOP through 0xFFFF
+ *  - a write to TCNT blocks the compare on the next timer clock (a write
+ *    is seen as a change in TCNT across the call into timers.c, so one
+ *    that writes the value already there is missed)
+ *
+ * Checked on each change, with lengths in CPU cycles and a count being
+ * one prescaler's worth of them:
+ *
+ *  - TIMER_UPDATE_AT_MATCH: the period in progress ends at exactly its
+ *    old length, the first new period is within one new count of the new
+ *    length (it starts on an edge of the old prescaler) and the one after
+ *    is exact
+ *  - TIMER_UPDATE_KEEP_PHASE: the period in progress ends where the same
+ *    fraction of the new period would, give or take one old count's worth
+ *    and KEEP_PHASE_SLACK_COUNTS new counts, and the next period is exact
+ *
+ * The same changes are also made with timers_setup_timer(), the old way,
+ * and how late that can end the period in progress is reported (it is
+ * not checked).
+ *
+ * Usage: timers_reconfig [-n changes] [-s seed]
+ */
+#include <stdbool.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <avr/io.h>
+#include "host.h"
+#include "timers.h"
+
+/*
+ * TIMER_UPDATE_KEEP_PHASE can only see how far into the period it is to
+ * the nearest old count, which is new counts / old counts new counts.
+ * On top of that: rounding the scaled count down, the first edge of the
+ * new prescaler, and the step back off TOP.
+ */
+#define KEEP_PHASE_SLACK_COUNTS (3)
+
+/* longest period a 16-bit timer can do at 20MHz (65536 * 1024 cycles) */
+#define MAX_PERIOD_US (3355443UL)
+
+typedef enum {
+    CHANGE_AT_MATCH,
+    CHANGE_KEEP_PHASE,
+    CHANGE_SETUP
+} change_e;
+
+static const char * const g_change_names[] = {
+    "at match", "keep phase", "setup_timer"
+};
+
+/* the modelled timer */
+static timer_counter_e g_timer_counter;
+static volatile uint16_t * g_tcnt;
+static uint64_t g_now;
+static bool g_blocked;
+static uint64_t g_matches[4];
+static int g_number_matches;
+
+/*
+ * Call into timers.c at the current time, noting any write to TCNT
+ */
+#define TIMERS_CALL(call) do { \
+    uint16_t tcnt = *g_tcnt; \
+    call; \
+    if (*g_tcnt != tcnt) { \
+        g_blocked = true; \
+    } \
+} while (0)
+
+static uint16_t timer_divisor(void)
+{
+    return host_timer_divisor(g_timer_counter);
+}
+
+/* the current period (CPU cycles) as the registers stand */
+static uint64_t timer_period(void)
+{
+    return ((uint64_t)host_timer_top(g_timer_counter) + 1) * timer_divisor();
+}
+
+/* CPU cycle of the first timer clock edge after now */
+static uint64_t timer_next_edge(void)
+{
+    return (g_now / timer_divisor() + 1) * timer_divisor();
+}
+
+/*
+ * Run the timer to the end of cycle `until', or to the first compare
+ * match before then (which has been taken when this returns)
+ */
+static void timer_run(uint64_t until)
+{
+    uint64_t edge;
+    uint64_t edges;
+    uint32_t to_top;
+
+    for (;;) {
+        edge = timer_next_edge();
+        if (edge > until) {
+            g_now = until;
+            return;
+        }
+        if (g_blocked) {
+            /* the one edge with the compare blocked */
+            g_blocked = false;
+            *g_tcnt = *g_tcnt + 1;
+            g_now = edge;
+            continue;
+        }
+        /* edges to reach TOP (through 0xFFFF if past it), then one more */
+        to_top = (uint16_t)(host_timer_top(g_timer_counter) - *g_tcnt);
+        edges = (until - edge) / timer_divisor() + 1;
+        if (edges <= to_top) {
+            *g_tcnt = *g_tcnt + edges;
+            g_now = until;
+            return;
+        }
+        g_now = edge + (uint64_t)to_top * timer_divisor();
+        *g_tcnt = 0;
+        if (g_number_matches < sizeof(g_matches) / sizeof(g_matches[0])) {
+            g_matches[g_number_matches] = g_now;
+        }
+        g_number_matches++;
+        TIMERS_CALL(timers_compare_match(g_timer_counter));
+        return;
+    }
+}
+
+/* run until there have been `number' more compare matches */
+static void timer_run_matches(int number)
+{
+    int target = g_number_matches + number;
+    while (g_number_matches < target) {
+        timer_run(UINT64_MAX);
+    }
+}
+
+/* a period from 1us to the longest, spread evenly in log(period) */
+static uint32_t random_period_us(void)
+{
+    double scale = (double)rand() / RAND_MAX;
+    uint32_t us = (uint32_t)(exp(scale * log((double)MAX_PERIOD_US)));
+    return us < 1 ? 1 : us;
+}
+
+typedef struct {
+    int changes;
+    int failures;
+    /* AT_MATCH: furthest the first new period was from the new length */
+    int64_t worst_first_cycles;
+    double worst_first_counts;
+    /* KEEP_PHASE: furthest the end of the changed period was from ideal,
+     * beyond one old count */
+    double worst_end_counts;
+    /* setup_timer: latest end of the changed period, in new periods */
+    double worst_late_periods;
+} results_t;
+
+/*
+ * Make one change of period.  Returns false if it fails a check.
+ */
+static bool run_change(change_e change, uint32_t old_us, uint32_t new_us,
+        double where, results_t * results)
+{
+    uint64_t old_period;
+    uint64_t new_period;
+    uint64_t last_match;
+    uint64_t change_at;
+    uint64_t ideal_end;
+    uint64_t first;
+    uint64_t second;
+    uint16_t old_divisor;
+    uint16_t new_divisor;
+    double counts;
+    bool ok = true;
+
+    *g_tcnt = 0;
+    g_blocked = false;
+    g_now = 0;
+    g_number_matches = 0;
+    if (timers_setup_timer(g_timer_counter, TIMER_MODE_CTC, old_us) < 0) {
+        return true;
+    }
+    timer_run_matches(2);
+    old_period = timer_period();
+    old_divisor = timer_divisor();
+    last_match = g_now;
+
+    /* somewhere in the period after the last match */
+    change_at = last_match + (uint64_t)(where * old_period);
+    while (g_now < change_at) {
+        timer_run(change_at);
+    }
+    if (g_number_matches != 2) {
+        printf("  match before the change\n");
+        return false;
+    }
+
+    g_number_matches = 0;
+    switch (change) {
+    case CHANGE_AT_MATCH:
+        TIMERS_CALL(timers_set_period(g_timer_counter, TIMER_MODE_CTC, new_us,
+                    TIMER_UPDATE_AT_MATCH));
+        break;
+    case CHANGE_KEEP_PHASE:
+        TIMERS_CALL(timers_set_period(g_timer_counter, TIMER_MODE_CTC, new_us,
+                    TIMER_UPDATE_KEEP_PHASE));
+        break;
+    case CHANGE_SETUP:
+        TIMERS_CALL(timers_setup_timer(g_timer_counter, TIMER_MODE_CTC, new_us));
+        break;
+    }
+
+    /* the change has gone in once the first match has run */
+    timer_run_matches(1);
+    new_period = timer_period();
+    new_divisor = timer_divisor();
+    timer_run_matches(2);
+    first = g_matches[1] - g_matches[0];
+    second = g_matches[2] - g_matches[1];
+
+    results->changes++;
+    switch (change) {
+    case CHANGE_AT_MATCH:
+        if (g_matches[0] - last_match != old_period) {
+            printf("  %s %luus -> %luus at %.3f: changed period ran %llu cycles, not %llu\n",
+                    host_timer_name(g_timer_counter), (unsigned long)old_us,
+                    (unsigned long)new_us, where,
+                    (unsigned long long)(g_matches[0] - last_match),
+                    (unsigned long long)old_period);
+            ok = false;
+        }
+        if (first > new_period || first + new_divisor <= new_period) {
+            printf("  %s %luus -> %luus at %.3f: first new period %llu cycles, not %llu\n",
+                    host_timer_name(g_timer_counter), (unsigned long)old_us,
+                    (unsigned long)new_us, where, (unsigned long long)first,
+                    (unsigned long long)new_period);
+            ok = false;
+        }
+        if ((int64_t)(new_period - first) > results->worst_first_cycles) {
+            results->worst_first_cycles = new_period - first;
+        }
+        counts = (double)(new_period - first) / new_divisor;
+        if (counts > results->worst_first_counts) {
+            results->worst_first_counts = counts;
+        }
+        break;
+    case CHANGE_KEEP_PHASE:
+        /* what is left of the old period, stretched to the new one */
+        ideal_end = change_at +
+            (old_period - (change_at - last_match)) * new_period / old_period;
+        counts = ((double)g_matches[0] - (double)ideal_end) / new_divisor;
+        if (counts < 0) {
+            counts = -counts;
+        }
+        counts -= (double)new_period / old_period * old_divisor / new_divisor;
+        if (counts > KEEP_PHASE_SLACK_COUNTS) {
+            printf("  %s %luus -> %luus at %.3f: changed period ended %.1f counts out\n",
+                    host_timer_name(g_timer_counter), (unsigned long)old_us,
+                    (unsigned long)new_us, where, counts);
+            ok = false;
+        }
+        if (counts > results->worst_end_counts) {
+            results->worst_end_counts = counts;
+        }
+        break;
+    case CHANGE_SETUP:
+        counts = (double)(g_matches[0] - change_at) / new_period;
+        if (counts > results->worst_late_periods) {
+            results->worst_late_periods = counts;
+        }
+        break;
+    }
+    if (change != CHANGE_SETUP && second != new_period) {
+        printf("  %s %luus -> %luus at %.3f: second new period %llu cycles, not %llu\n",
+                host_timer_name(g_timer_counter), (unsigned long)old_us,
+                (unsigned long)new_us, where, (unsigned long long)second,
+                (unsigned long long)new_period);
+        ok = false;
+    }
+    if (!ok) {
+        results->failures++;
+    }
+    return ok;
+}
+
+int main(int argc, char * argv[])
+{
+    int number_changes = 20000;
+    unsigned seed = 1;
+    results_t results[3] = {{0}};
+    uint32_t old_us;
+    uint32_t new_us;
+    double where;
+    int failures = 0;
+    int opt;
+    int i;
+    int c;
+
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+        case 'n':
+            number_changes = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n changes] [-s seed]\n", argv[0]);
+            return 2;
+        }
+    }
+    srand(seed);
+
+    for (i = 0; i < number_changes; i++) {
+        g_timer_counter = (i & 1) ? TIMER_COUNTER3 : TIMER_COUNTER1;
+        g_tcnt = (i & 1) ? &TCNT3 : &TCNT1;
+        old_us = random_period_us();
+        new_us = random_period_us();
+        where = (double)rand() / ((double)RAND_MAX + 1);
+        for (c = CHANGE_AT_MATCH; c <= CHANGE_SETUP; c++) {
+            run_change(c, old_us, new_us, where, &results[c]);
+        }
+    }
+
+    for (c = CHANGE_AT_MATCH; c <= CHANGE_SETUP; c++) {
+        printf("%-11s: %d changes, ", g_change_names[c], results[c].changes);
+        switch (c) {
+        case CHANGE_AT_MATCH:
+            printf("old period always ran out, first new period short by up to "
+                    "%.2f counts (%lld cycles)", results[c].worst_first_counts,
+                    (long long)results[c].worst_first_cycles);
+            break;
+        case CHANGE_KEEP_PHASE:
+            printf("changed period ended up to %.2f counts from ideal, "
+                    "beyond one old count",
+                    results[c].worst_end_counts);
+            break;
+        case CHANGE_SETUP:
+            printf("changed period ended up to %.1f new periods late (not checked)",
+                    results[c].worst_late_periods);
+            break;
+        }
+        printf(", %d failures\n", results[c].failures);
+        failures += results[c].failures;
+    }
+    printf("%s\n", failures == 0 ? "PASS" : "FAIL");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,157 @@
+/*
+ * Software timer test
+ *
+ * Runs the software timers from timers.c off a model tick, advancing
+ * them one tick at a time as the TC0 ISR does (and several at a time as
+ * a tickless driver would), and checks on which ticks the callbacks run:
+ *
+ *  - one-shot and periodic timers expire on the ticks they were started
+ *    for, and timers due on the same tick run in the order started
+ *  - an advance over several ticks runs a periodic timer once for each
+ *    period it covers
+ *  - a delay of 0 is rejected, and a callback that restarts its own
+ *    timer for the next tick runs once per tick, not again in the advance
+ *    that is running it
+ *
+ * Usage: timers_soft
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include "timers.h"
+
+#define MAX_FIRES (32)
+
+static uint32_t g_now;
+static uint32_t g_fires[MAX_FIRES];
+static int g_number_fires;
+static char g_order[MAX_FIRES + 1];
+static int g_restart_result;
+static soft_timer_t g_a, g_b, g_self;
+
+static void note_fire(char name)
+{
+    if (g_number_fires < MAX_FIRES) {
+        g_order[g_number_fires] = name;
+        g_fires[g_number_fires++] = g_now;
+    }
+}
+
+static void fire_a(void)
+{
+    note_fire('a');
+}
+
+static void fire_b(void)
+{
+    note_fire('b');
+}
+
+static void fire_self_0(void)
+{
+    note_fire('s');
+    g_restart_result = timers_soft_start(&g_self, fire_self_0, 0, 0);
+}
+
+static void fire_self_1(void)
+{
+    note_fire('s');
+    g_restart_result = timers_soft_start(&g_self, fire_self_1, 1, 0);
+}
+
+static void reset(void)
+{
+    static const soft_timer_t stopped;
+    timers_soft_init(NULL);
+    g_a = g_b = g_self = stopped;
+    g_now = 0;
+    g_number_fires = 0;
+    g_order[0] = '\0';
+    g_restart_result = 0;
+}
+
+static void run(uint32_t ticks, uint16_t step)
+{
+    while (ticks > 0) {
+        uint16_t elapsed = (ticks < step) ? ticks : step;
+        g_now += elapsed;
+        timers_soft_advance(elapsed);
+        ticks -= elapsed;
+    }
+    g_order[g_number_fires] = '\0';
+}
+
+static int check(char const * name, int ok)
+{
+    printf("%-40s %s\n", name, ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+static int test_expiry(void)
+{
+    int failures = 0;
+    reset();
+    timers_soft_start(&g_a, fire_a, 3, 0);
+    timers_soft_start(&g_b, fire_b, 2, 4);
+    run(12, 1);
+    failures += check("one-shot and periodic expiry",
+        g_number_fires == 4 && g_fires[0] == 2 && g_order[0] == 'b' &&
+        g_fires[1] == 3 && g_order[1] == 'a' && g_fires[2] == 6 &&
+        g_fires[3] == 10 && !g_a.active && g_b.active);
+
+    reset();
+    timers_soft_start(&g_b, fire_b, 5, 0);
+    timers_soft_start(&g_a, fire_a, 5, 0);
+    run(5, 1);
+    failures += check("same tick runs in start order",
+        g_number_fires == 2 && g_fires[0] == 5 && g_fires[1] == 5 &&
+        g_order[0] == 'b' && g_order[1] == 'a');
+    return failures;
+}
+
+static int test_tickless(void)
+{
+    reset();
+    timers_soft_start(&g_a, fire_a, 1, 3);
+    run(10, 10);
+    /* due at 1, 4, 7 and 10, all run by the one advance */
+    return check("advance over several periods",
+        g_number_fires == 4 && timers_soft_next_expiry() == 3);
+}
+
+static int test_restart(void)
+{
+    int failures = 0;
+    reset();
+    failures += check("delay 0 rejected",
+        timers_soft_start(&g_a, fire_a, 0, 5) == -1 && !g_a.active);
+    failures += check("delay 65535 rejected",
+        timers_soft_start(&g_a, fire_a, TIMERS_SOFT_NONE, 0) == -1 && !g_a.active);
+
+    reset();
+    timers_soft_start(&g_self, fire_self_0, 1, 0);
+    run(3, 1);
+    failures += check("restart with delay 0 from callback",
+        g_number_fires == 1 && g_fires[0] == 1 && g_restart_result == -1 &&
+        !g_self.active);
+
+    reset();
+    timers_soft_start(&g_self, fire_self_1, 1, 0);
+    timers_soft_start(&g_a, fire_a, 1, 0);
+    run(3, 1);
+    failures += check("restart with delay 1 from callback",
+        g_number_fires == 4 && g_fires[0] == 1 && g_fires[1] == 1 &&
+        g_fires[2] == 2 && g_fires[3] == 3 && g_restart_result == 0 &&
+        g_self.active);
+    timers_soft_stop(&g_self);
+    return failures;
+}
+
+int main(int argc, char * argv[])
+{
+    int failures = 0;
+    failures += test_expiry();
+    failures += test_tickless();
+    failures += test_restart();
+    printf("%s\n", failures == 0 ? "PASS" : "FAIL");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,250 @@
+/*
+ * Period search sweep
+ *
+ * Runs timers_setup_timer() from timers.c for every period from 1us to
+ * 4s on TC0, TC1 and TC3, reads the prescaler and TOP back out of the
+ * registers and checks them against a brute-force search: every
+ * prescaler, with the whole number of counts just below and just above
+ * the target.  The achieved period must be as close as the best of
+ * those, and a period must be turned down exactly when none of them
+ * fits.
+ *
+ * TIMER_MODE_CTC_PHASE_ACCUMULATE is checked on a sample of periods by
+ * running the compare matches: the running total may be off by less
+ * than one count, and any prescaler's worth of periods after the first
+ * must add up to the target exactly.
+ *
+ * Usage: timers_sweep [-s step_us]
+ *
+ *   -s  step between the phase accumulated periods checked (default 997)
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "host.h"
+#include "timers.h"
+
+#define SWEEP_MAX_US (4000000UL)
+
+static const uint16_t g_divisors[] = {1, 8, 64, 256, 1024};
+static const timer_counter_e g_timer_counters[] = {
+    TIMER_COUNTER0, TIMER_COUNTER1, TIMER_COUNTER3
+};
+
+/*
+ * Smallest error (in CPU cycles) any prescaler/TOP pair can get for a
+ * period, or -1 if there is none
+ */
+static int64_t best_error_cycles(uint64_t target_cycles, uint16_t width)
+{
+    int64_t best = -1;
+    int64_t error;
+    uint64_t counts;
+    int i;
+    int j;
+
+    for (i = 0; i < sizeof(g_divisors) / sizeof(g_divisors[0]); i++) {
+        for (j = 0; j < 2; j++) {
+            counts = target_cycles / g_divisors[i] + j;
+            if (counts < 1 || counts > (uint64_t)width + 1) {
+                continue;
+            }
+            error = (int64_t)(counts * g_divisors[i]) - (int64_t)target_cycles;
+            if (error < 0) {
+                error = -error;
+            }
+            if (best < 0 || error < best) {
+                best = error;
+            }
+        }
+    }
+    return best;
+}
+
+/*
+ * Check every period on one timer in CTC mode.  Returns the number of
+ * failures.
+ */
+static int sweep_ctc(timer_counter_e timer_counter)
+{
+    uint16_t width = host_timer_width(timer_counter);
+    uint32_t us;
+    uint64_t target_cycles;
+    uint64_t cycles;
+    int64_t best;
+    int64_t error;
+    int rc;
+    int failures = 0;
+    uint32_t first_us = 0;
+    uint32_t last_us = 0;
+    uint32_t worst_us = 0;
+    double worst_ppm = 0.0;
+    double ppm;
+
+    for (us = 1; us <= SWEEP_MAX_US; us++) {
+        target_cycles = (uint64_t)us * TIMERS_CYCLES_PER_US;
+        best = best_error_cycles(target_cycles, width);
+        rc = timers_setup_timer(timer_counter, TIMER_MODE_CTC, us);
+        if (best < 0) {
+            if (rc >= 0) {
+                if (failures++ < 10) {
+                    printf("  %s %luus: set up, but no setting fits\n",
+                            host_timer_name(timer_counter), (unsigned long)us);
+                }
+            }
+            continue;
+        }
+        if (rc < 0 || host_timer_divisor(timer_counter) == 0) {
+            if (failures++ < 10) {
+                printf("  %s %luus: turned down, best error %lld cycles\n",
+                        host_timer_name(timer_counter), (unsigned long)us,
+                        (long long)best);
+            }
+            continue;
+        }
+        cycles = ((uint64_t)host_timer_top(timer_counter) + 1) *
+            host_timer_divisor(timer_counter);
+        error = (int64_t)cycles - (int64_t)target_cycles;
+        if (error < 0) {
+            error = -error;
+        }
+        if (error != best) {
+            if (failures++ < 10) {
+                printf("  %s %luus: /%u TOP %u is %lld cycles out, best is %lld\n",
+                        host_timer_name(timer_counter), (unsigned long)us,
+                        host_timer_divisor(timer_counter),
+                        host_timer_top(timer_counter),
+                        (long long)error, (long long)best);
+            }
+        }
+        if (first_us == 0) {
+            first_us = us;
+        }
+        last_us = us;
+        ppm = error * 1e6 / target_cycles;
+        if (ppm > worst_ppm) {
+            worst_ppm = ppm;
+            worst_us = us;
+        }
+    }
+    printf("%s CTC: %luus..%luus, worst %.0fppm (at %luus), %d failures\n",
+            host_timer_name(timer_counter), (unsigned long)first_us,
+            (unsigned long)last_us, worst_ppm, (unsigned long)worst_us, failures);
+    return failures;
+}
+
+/*
+ * Check a sample of periods on one timer in phase accumulate mode.
+ * Returns the number of failures.
+ */
+static int sweep_phase_accumulate(timer_counter_e timer_counter, uint32_t step_us)
+{
+    uint32_t us;
+    uint64_t target_cycles;
+    uint64_t total;
+    uint64_t window;
+    int64_t drift;
+    int64_t worst_drift = 0;
+    uint16_t divisor;
+    uint32_t period;
+    int rc;
+    int checked = 0;
+    int failures = 0;
+    bool fits;
+    int i;
+
+    for (us = 1; us <= SWEEP_MAX_US; us += step_us) {
+        target_cycles = (uint64_t)us * TIMERS_CYCLES_PER_US;
+        fits = false;
+        for (i = 0; i < sizeof(g_divisors) / sizeof(g_divisors[0]); i++) {
+            if (target_cycles >= g_divisors[i] &&
+                    target_cycles / g_divisors[i] <= host_timer_width(timer_counter)) {
+                fits = true;
+            }
+        }
+        rc = timers_setup_timer(timer_counter, TIMER_MODE_CTC_PHASE_ACCUMULATE, us);
+        if ((rc >= 0) != fits) {
+            if (failures++ < 10) {
+                printf("  %s %luus: phase accumulate %s\n",
+                        host_timer_name(timer_counter), (unsigned long)us,
+                        fits ? "turned down" : "set up, but does not fit");
+            }
+            continue;
+        }
+        if (rc < 0) {
+            continue;
+        }
+
+        /* each period is TOP + 1 counts as the match that ends it sees */
+        divisor = host_timer_divisor(timer_counter);
+        total = 0;
+        window = 0;
+        for (period = 1; period <= 2 * (uint32_t)divisor + 1; period++) {
+            total += ((uint64_t)host_timer_top(timer_counter) + 1) * divisor;
+            if (period >= 2 && period <= (uint32_t)divisor + 1) {
+                window += ((uint64_t)host_timer_top(timer_counter) + 1) * divisor;
+            }
+            timers_compare_match(timer_counter);
+
+            drift = (int64_t)total - (int64_t)(period * target_cycles);
+            if (drift < 0) {
+                drift = -drift;
+            }
+            if (drift > worst_drift) {
+                worst_drift = drift;
+            }
+            if (drift >= divisor) {
+                if (failures++ < 10) {
+                    printf("  %s %luus: %lld cycles out after %lu periods\n",
+                            host_timer_name(timer_counter), (unsigned long)us,
+                            (long long)drift, (unsigned long)period);
+                }
+                break;
+            }
+        }
+        if (window != (uint64_t)divisor * target_cycles) {
+            if (failures++ < 10) {
+                printf("  %s %luus: %u periods took %llu cycles, not %llu\n",
+                        host_timer_name(timer_counter), (unsigned long)us, divisor,
+                        (unsigned long long)window,
+                        (unsigned long long)divisor * target_cycles);
+            }
+        }
+        checked++;
+    }
+    printf("%s phase accumulate: %d periods sampled, worst running error %lld cycles, "
+            "%d failures\n", host_timer_name(timer_counter), checked,
+            (long long)worst_drift, failures);
+    return failures;
+}
+
+int main(int argc, char * argv[])
+{
+    uint32_t step_us = 997;
+    int failures = 0;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        switch (opt) {
+        case 's':
+            step_us = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s step_us]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (step_us == 0) {
+        step_us = 1;
+    }
+
+    for (i = 0; i < sizeof(g_timer_counters) / sizeof(g_timer_counters[0]); i++) {
+        failures += sweep_ctc(g_timer_counters[i]);
+        failures += sweep_phase_accumulate(g_timer_counters[i], step_us);
+    }
+    printf("%s\n", failures == 0 ? "PASS" : "FAIL");
+    return failures == 0 ? 0 : 1;
+}
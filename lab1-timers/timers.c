@@ -3,6 +3,7 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 #include "leds.h"
 #include "log.h"
 #include "timers.h"
@@ -20,6 +21,8 @@
 typedef void (*set_mode_t)(timer_counter_mode_e mode);
 typedef void (*set_divider_t)(uint8_t divider);
 typedef void (*set_top_t)(uint16_t top);
+typedef uint16_t (*get_count_t)(void);
+typedef void (*set_count_t)(uint16_t count);
 
 /*
  * TC0 Setters
@@ -38,6 +41,12 @@ static void tc0_set_divider(uint8_t divider) {
 static void tc0_set_top(uint16_t top) {
     OCR0A = (uint8_t)top;
 }
+static uint16_t tc0_get_count(void) {
+    return TCNT0;
+}
+static void tc0_set_count(uint16_t count) {
+    TCNT0 = (uint8_t)count;
+}
 
 /*
  * TC1 Setters
@@ -55,6 +64,12 @@ static void tc1_set_divider(uint8_t divider) {
 static void tc1_set_top(uint16_t top) {
     OCR1A = top;
 }
+static uint16_t tc1_get_count(void) {
+    return TCNT1;
+}
+static void tc1_set_count(uint16_t count) {
+    TCNT1 = count;
+}
 
 /*
  * TC3 Setters
@@ -72,12 +87,22 @@ static void tc3_set_divider(uint8_t divider) {
 static void tc3_set_top(uint16_t top) {
     OCR3A = top;
 }
+static uint16_t tc3_get_count(void) {
+    return TCNT3;
+}
+static void tc3_set_count(uint16_t count) {
+    TCNT3 = count;
+}
 
 
 typedef struct {
     bool match_found;
     uint32_t top_value;
-    uint32_t delta_us;
+    /* how far the achieved period is from the target */
+    uint32_t error_ppm;
+    /* TIMER_MODE_CTC_PHASE_ACCUMULATE: cycles per period beyond TOP + 1
+     * counts, made up by running some periods one count long */
+    uint16_t phase_step;
 } timer_counter_search_result_t;
 
 typedef struct {
@@ -95,6 +120,11 @@ typedef struct {
     uint16_t width;
 } top_info_t;
 
+typedef struct {
+    get_count_t get_count;
+    set_count_t set_count;
+} count_info_t;
+
 typedef struct {
     timer_counter_e id;
     char * name;
@@ -102,6 +132,18 @@ typedef struct {
     clock_divider_value_t divisors[5];
     set_mode_t set_mode;
     top_info_t top_info;
+    count_info_t count_info;
+    /* phase accumulator state (TIMER_MODE_CTC_PHASE_ACCUMULATE) */
+    volatile bool phase_accumulate;
+    uint16_t phase_top;
+    uint16_t phase_divisor;
+    uint16_t phase_step;
+    uint16_t phase;
+    /* setting staged by timers_set_period() for the next compare match */
+    volatile bool pending;
+    bool pending_phase_accumulate;
+    clock_divider_value_t * pending_divisor;
+    timer_counter_search_result_t pending_result;
 } timer_counter_t;
 
 /* 8-bit Timer/Counter0 */
@@ -120,6 +162,10 @@ static timer_counter_t tc0 = {
     .top_info = {
         .set_top = tc0_set_top,
         .width = WIDTH_8_BITS
+    },
+    .count_info = {
+        .get_count = tc0_get_count,
+        .set_count = tc0_set_count
     }
 };
 
@@ -139,6 +185,10 @@ static timer_counter_t tc1 = {
     .top_info = {
         .set_top = tc1_set_top,
         .width = WIDTH_16_BITS
+    },
+    .count_info = {
+        .get_count = tc1_get_count,
+        .set_count = tc1_set_count
     }
 };
 
@@ -158,37 +208,106 @@ static timer_counter_t tc3 = {
     .top_info = {
         .set_top = tc3_set_top,
         .width = WIDTH_16_BITS
+    },
+    .count_info = {
+        .get_count = tc3_get_count,
+        .set_count = tc3_set_count
     }
 };
 
 static timers_state_t *g_timers_state;
 static timer_counter_t * timer_counters[] = {&tc0, &tc1, &tc3};
 
+/* software timers: pending timers sorted by expiry (see timers.h) */
+static soft_timer_t * g_soft_timers = NULL;
+static void (*g_soft_set_next_compare)(uint16_t ticks) = NULL;
+static soft_timer_t g_red_timer;
+
 /*
- * Give a target period, divisor and width try to find optimal value
+ * Look up a timer/counter.  Since we should have full coverage of
+ * timer/counters in timer_counter_e, we do not handle an error case.
+ */
+static timer_counter_t * timers_find_timer_counter(timer_counter_e timer_counter)
+{
+    int i;
+    for (i = 0; i < COUNT_OF(timer_counters) - 1; i++) {
+        if (timer_counters[i]->id == timer_counter) {
+            break;
+        }
+    }
+    return timer_counters[i];
+}
+
+/*
+ * Given a target period (in CPU cycles), divisor and width find the TOP
+ * value that gets closest to it.
+ *
+ * In CTC mode a period is TOP + 1 counts of the divided clock, so the
+ * best TOP is one less than either the whole number of counts just
+ * below the target or the one just above.  Both are tried, since the
+ * one below may fit when the one above does not.  With phase_accumulate
+ * the lower one is always used, and the rest of the target is left to
+ * timers_compare_match() (which needs room for TOP + 1 as well).
  */
 static timer_counter_search_result_t find_top_value(
-        uint32_t target_period_us,
+        uint32_t target_cycles,
         uint16_t clock_divisor,
-        uint16_t width)
+        uint16_t width,
+        bool phase_accumulate)
 {
-    timer_counter_search_result_t result;
-    uint32_t top;
-    top = (uint64_t)((20 * target_period_us) / clock_divisor);
-    if (top > width) {
-        result.match_found = false;
-        result.top_value = 0;
-        result.delta_us = 0;
+    timer_counter_search_result_t result = { .match_found = false };
+    uint32_t counts = target_cycles / clock_divisor;
+    uint32_t remainder = target_cycles % clock_divisor;
+    uint32_t error_cycles;
+
+    if (phase_accumulate) {
+        if (counts >= 1 && counts <= width) {
+            result.match_found = true;
+            result.top_value = counts - 1;
+            result.error_ppm = 0;
+            result.phase_step = remainder;
+        }
+        return result;
+    }
+
+    if (remainder * 2 >= clock_divisor && counts <= width) {
+        /* rounding up is closer, and fits */
+        counts++;
+        error_cycles = clock_divisor - remainder;
     } else {
-        uint32_t achieved_period_us;
-        achieved_period_us = (clock_divisor * top) / 20;
+        error_cycles = remainder;
+    }
+    if (counts >= 1 && counts - 1 <= width) {
         result.match_found = true;
-        result.top_value = (uint32_t)top;
-        result.delta_us = (uint32_t)abs(achieved_period_us - target_period_us);
+        result.top_value = counts - 1;
+        result.error_ppm = (uint32_t)((uint64_t)error_cycles * 1000000UL / target_cycles);
     }
     return result;
 }
 
+/*
+ * Private Method
+ *
+ * Load a prescaler/TOP pair, and the phase accumulator state that goes
+ * with it, into a timer.  Called with interrupts off.
+ */
+static void timers_load_timer(
+        timer_counter_t * timer_counter,
+        clock_divider_value_t * divisor,
+        timer_counter_search_result_t * search_result,
+        bool phase_accumulate)
+{
+    uint16_t top = (uint16_t)search_result->top_value;
+    timer_counter->phase_accumulate = phase_accumulate;
+    timer_counter->phase_top = top;
+    timer_counter->phase_divisor = divisor->denominator;
+    timer_counter->phase_step = search_result->phase_step;
+    /* the first period runs at TOP + 1 counts, so it is already short */
+    timer_counter->phase = search_result->phase_step;
+    timer_counter->set_divider(divisor->clock_select_flags);
+    timer_counter->top_info.set_top(top);
+}
+
 /*
  * Private Method
  *
@@ -197,16 +316,67 @@ static timer_counter_search_result_t find_top_value(
 static int timers_program_timer(
         timer_counter_t * timer_counter,
         clock_divider_value_t * divisor,
-        uint16_t top,
+        timer_counter_search_result_t * search_result,
         timer_counter_mode_e mode)
 {
-    LOG("Setting divider: %u, top: %u\r\n", divisor->denominator, top);
-    timer_counter->set_mode(mode);
-    timer_counter->set_divider(divisor->clock_select_flags);
-    timer_counter->top_info.set_top(top);
+    LOG("Setting divider: %u, top: %lu, error: %lu ppm\r\n",
+            divisor->denominator, search_result->top_value, search_result->error_ppm);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        timer_counter->pending = false;
+        timer_counter->set_mode(TIMER_MODE_CTC);
+        timers_load_timer(timer_counter, divisor, search_result,
+                mode == TIMER_MODE_CTC_PHASE_ACCUMULATE);
+    }
     return 0;
 }
 
+/*
+ * Private Method
+ *
+ * Find the prescaler/TOP pair with the smallest error for a period (the
+ * smallest prescaler on a tie).  Returns NULL if there is none.
+ */
+static clock_divider_value_t * timers_search(
+        timer_counter_t * tc,
+        timer_counter_mode_e mode,
+        uint32_t target_period_microseconds,
+        timer_counter_search_result_t * best_search_result)
+{
+    int i;
+    uint32_t target_cycles;
+    clock_divider_value_t * divisor;
+    clock_divider_value_t * best_divisor = NULL;
+    timer_counter_search_result_t search_result;
+
+    if (target_period_microseconds == 0 ||
+            target_period_microseconds > UINT32_MAX / TIMERS_CYCLES_PER_US) {
+        LOG("Period out of range\r\n");
+        return NULL;
+    }
+    target_cycles = target_period_microseconds * TIMERS_CYCLES_PER_US;
+
+    best_search_result->error_ppm = UINT32_MAX;
+    for (i = 0; i < COUNT_OF(tc->divisors); i++) {
+        divisor = &tc->divisors[i];
+        search_result = find_top_value(
+                target_cycles,
+                divisor->denominator,
+                tc->top_info.width,
+                mode == TIMER_MODE_CTC_PHASE_ACCUMULATE);
+        if (search_result.match_found) {
+            if (search_result.error_ppm < best_search_result->error_ppm) {
+                *best_search_result = search_result;
+                best_divisor = divisor;
+            }
+        }
+    }
+
+    if (best_divisor == NULL) {
+        LOG("Search found no workable divisor/top value pair\r\n");
+    }
+    return best_divisor;
+}
+
 /*
  * Get the number of milliseconds the system has been alive
  *
@@ -216,13 +386,27 @@ static int timers_program_timer(
  */
 uint32_t timers_get_uptime_ms()
 {
-    return g_timers_state->ms_ticks;
+    uint32_t ms;
+    /* a 32-bit read is not atomic on the AVR; keep the tick out of it */
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ms = g_timers_state->ms_ticks;
+    }
+    return ms;
 }
 
 /*
  * Setup (or change the setup for) a timer.  An attempt will
  * be made to setup the timer to match the target period as
- * closely as possible.
+ * closely as possible, using the prescaler/TOP pair with the
+ * smallest error (the smallest prescaler on a tie).
+ *
+ * With TIMER_MODE_CTC_PHASE_ACCUMULATE the average period is exact
+ * (to the CPU clock), as long as the timer's compare ISR calls
+ * timers_compare_match() each period; single periods are then
+ * off by up to one count.
+ *
+ * The new setting is written straight away.  Use timers_set_period()
+ * to change a timer that is already running.
  *
  * If a timer cannot be setup that is close (e.g. in the
  * feasible range) a negative value will be returned.
@@ -232,52 +416,129 @@ int timers_setup_timer(
         timer_counter_mode_e mode,
         uint32_t target_period_microseconds)
 {
-    int i;
-    int result;
     timer_counter_t * tc;
     clock_divider_value_t * divisor;
     timer_counter_search_result_t search_result;
 
-    /* get a reference to our timer/counter.  Since we should have
-     * full coverage of timer/counters in timer_counter_e, we do not
-     * handle an error case.
-     */
-    for (i = 0; i < COUNT_OF(timer_counters); i++) {
-        tc = timer_counters[i];
-        if (tc->id == timer_counter) {
-            break;
-        }
-    }
+    tc = timers_find_timer_counter(timer_counter);
 
     LOG("Setting up timer %s (period_ms: %lu)\r\n",
             tc->name, target_period_microseconds / 1000);
 
-    /* find the most appropriate pre-scaler/top value */
-    clock_divider_value_t * best_divisor = NULL;
-    timer_counter_search_result_t best_search_result = { .delta_us = UINT32_MAX };
-    for (i = 0; i < COUNT_OF(tc->divisors); i++) {
-        divisor = &tc->divisors[i];
-        search_result = find_top_value(
-                target_period_microseconds,
-                divisor->denominator,
-                tc->top_info.width);
-        if (search_result.match_found) {
-            if (search_result.delta_us < best_search_result.delta_us) {
-                best_search_result = search_result;
-                best_divisor = divisor;
+    divisor = timers_search(tc, mode, target_period_microseconds, &search_result);
+    if (divisor == NULL) {
+        return -1;
+    }
+    return timers_program_timer(tc, divisor, &search_result, mode);
+}
+
+/*
+ * Change the period of a running timer without a glitch.
+ *
+ * Writing a new TOP while the timer runs (as timers_setup_timer() does)
+ * goes wrong when the count is already past it: there is no match until
+ * the counter has wrapped all the way round, which is over 3s for TC1
+ * at clk/1024.  Even when it is not past, the period running at the time
+ * is neither the old length nor the new one.  Here the new setting goes
+ * in as `update' says instead (see timer_update_e).  The timer's compare
+ * ISR must call timers_compare_match().
+ *
+ * A timer that has not been set up yet is set up straight away.  If the
+ * period cannot be met a negative value is returned and the timer is
+ * left as it was.
+ */
+int timers_set_period(
+        timer_counter_e timer_counter,
+        timer_counter_mode_e mode,
+        uint32_t target_period_microseconds,
+        timer_update_e update)
+{
+    timer_counter_t * tc;
+    clock_divider_value_t * divisor;
+    timer_counter_search_result_t search_result;
+    uint32_t old_counts;
+    uint32_t new_counts;
+    uint32_t count;
+
+    tc = timers_find_timer_counter(timer_counter);
+
+    LOG("Changing timer %s (period_ms: %lu)\r\n",
+            tc->name, target_period_microseconds / 1000);
+
+    divisor = timers_search(tc, mode, target_period_microseconds, &search_result);
+    if (divisor == NULL) {
+        return -1;
+    }
+    if (tc->phase_divisor == 0) {
+        return timers_program_timer(tc, divisor, &search_result, mode);
+    }
+
+    LOG("Staging divider: %u, top: %lu, error: %lu ppm\r\n",
+            divisor->denominator, search_result.top_value, search_result.error_ppm);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (update == TIMER_UPDATE_AT_MATCH) {
+            tc->pending_divisor = divisor;
+            tc->pending_result = search_result;
+            tc->pending_phase_accumulate = (mode == TIMER_MODE_CTC_PHASE_ACCUMULATE);
+            tc->pending = true;
+        } else {
+            /* scale the count from the old period onto the new one */
+            old_counts = (uint32_t)tc->phase_top + 1;
+            new_counts = search_result.top_value + 1;
+            count = tc->count_info.get_count();
+            if (count >= old_counts) {
+                count = old_counts - 1;
+            }
+            count = count * new_counts / old_counts;
+            /* writing TCNT blocks a match on the next timer clock, so
+             * do not land on TOP itself */
+            if (count == new_counts - 1 && count > 0) {
+                count--;
             }
+            tc->pending = false;
+            timers_load_timer(tc, divisor, &search_result,
+                    mode == TIMER_MODE_CTC_PHASE_ACCUMULATE);
+            tc->count_info.set_count((uint16_t)count);
         }
     }
+    return 0;
+}
 
-    if (best_divisor == NULL) {
-        LOG("Search found no workable divisor/top value pair\r\n");
-        result = -1;
+/*
+ * Called first thing from each timer's compare match ISR.
+ *
+ * The counter has only just been cleared, so this is where a setting
+ * staged by timers_set_period() goes in: the period that has just ended
+ * ran at the old length and the one just started runs at the new one.
+ *
+ * Otherwise, for TIMER_MODE_CTC_PHASE_ACCUMULATE, sets the length of
+ * the period that has just started: TOP + 1 counts, or one count more
+ * whenever the accumulated remainder adds up to a whole count.  The new
+ * compare value is still ahead of the counter.
+ */
+void timers_compare_match(timer_counter_e timer_counter)
+{
+    timer_counter_t * tc = timers_find_timer_counter(timer_counter);
+    if (tc->pending) {
+        tc->pending = false;
+        timers_load_timer(tc, tc->pending_divisor, &tc->pending_result,
+                tc->pending_phase_accumulate);
+        /* a new period of only a few counts may already be over */
+        if (tc->count_info.get_count() >= tc->phase_top) {
+            tc->count_info.set_count(0);
+        }
+        return;
+    }
+    if (!tc->phase_accumulate) {
+        return;
+    }
+    tc->phase += tc->phase_step;
+    if (tc->phase >= tc->phase_divisor) {
+        tc->phase -= tc->phase_divisor;
+        tc->top_info.set_top(tc->phase_top + 1);
     } else {
-        result = timers_program_timer(
-            tc, best_divisor, (uint16_t)best_search_result.top_value, mode);
+        tc->top_info.set_top(tc->phase_top);
     }
-
-    return result;
 }
 
 /*
@@ -287,11 +548,15 @@ void timers_init(timers_state_t * timers_state)
 {
     /* store timers state and initialize defaults */
     g_timers_state = timers_state;
+    timers_soft_init(NULL);
 
     // -------------------------  RED --------------------------------------//
-    // Timer Interrupt Using TC0
-    timers_setup_timer(TIMER_COUNTER0, TIMER_MODE_CTC, MS_TO_uS(1));
+    // Timer Interrupt Using TC0.  1ms is not a whole number of TC0
+    // counts at 20MHz, so the period is phase accumulated to keep the
+    // ms ticks (and the red LED) in step with the yellow and green LEDs.
+    timers_setup_timer(TIMER_COUNTER0, TIMER_MODE_CTC_PHASE_ACCUMULATE, MS_TO_uS(1));
     TIMSK0 |= (1 << OCIE0A); // Unmask interrupt for output compare match A on TC0
+    timers_set_red_period(g_timers_state->red_period);
 
     //--------------------------- YELLOW ----------------------------------
     // Timer Interrupt Using TC3
@@ -311,14 +576,186 @@ void timers_init(timers_state_t * timers_state)
  */
 ISR(TIMER0_COMPA_vect)
 {
+    timers_compare_match(TIMER_COUNTER0);
+
     // Increment ticks
     g_timers_state->ms_ticks++;
 
-    // if time to toggle the RED LED, set flag to release
-    if ((g_timers_state->ms_ticks % g_timers_state->red_period) == 0) {
-        g_timers_state->release_red = true;
-    }
+    // release the RED LED (and anything else on a software timer)
+    timers_soft_advance(1);
 
     // service the scheduler
     scheduler_do_schedule();
 }
+
+/*
+ * Put a timer in the list delay_ms ticks after the last advance.  Call
+ * with interrupts disabled.
+ */
+static void timers_soft_insert(soft_timer_t * timer, uint16_t delay_ms)
+{
+    soft_timer_t ** link = &g_soft_timers;
+    /* walk past the timers that expire first (or at the same time, so
+     * timers due on the same tick fire in the order they were started) */
+    while (*link != NULL && (*link)->delta <= delay_ms) {
+        delay_ms -= (*link)->delta;
+        link = &(*link)->next;
+    }
+    if (*link != NULL) {
+        (*link)->delta -= delay_ms;
+    }
+    timer->delta = delay_ms;
+    timer->next = *link;
+    timer->active = true;
+    *link = timer;
+}
+
+/*
+ * Take a timer out of the list, handing its delta to the next one.  Call
+ * with interrupts disabled.
+ */
+static void timers_soft_remove(soft_timer_t * timer)
+{
+    soft_timer_t ** link = &g_soft_timers;
+    while (*link != NULL) {
+        if (*link == timer) {
+            *link = timer->next;
+            if (timer->next != NULL) {
+                timer->next->delta += timer->delta;
+            }
+            timer->next = NULL;
+            timer->active = false;
+            return;
+        }
+        link = &(*link)->next;
+    }
+}
+
+/*
+ * Tell a tickless driver about a change to the next expiry
+ */
+static void timers_soft_update_compare(uint16_t old_expiry)
+{
+    uint16_t expiry = timers_soft_next_expiry();
+    if (g_soft_set_next_compare != NULL && expiry != old_expiry) {
+        g_soft_set_next_compare(expiry);
+    }
+}
+
+/*
+ * Set up the software timers
+ *
+ * set_next_compare is only needed when the timers are not advanced on
+ * every tick; pass NULL otherwise.
+ */
+void timers_soft_init(void (*set_next_compare)(uint16_t ticks))
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        g_soft_timers = NULL;
+        g_soft_set_next_compare = set_next_compare;
+    }
+}
+
+/*
+ * (Re)start a software timer
+ *
+ * callback runs delay_ms ticks from now, then every period_ms ticks if
+ * period_ms is not 0.  A timer that is already running is restarted.
+ * The shortest delay is 1, the next tick.  A delay of 0 is rejected:
+ * started from a callback it would expire inside the advance that is
+ * running, and a callback restarting its own timer would never return.
+ * Returns -1 (and leaves the timer as it was) if delay_ms is out of range.
+ */
+int timers_soft_start(soft_timer_t * timer, void (*callback)(void),
+        uint16_t delay_ms, uint16_t period_ms)
+{
+    if (delay_ms == 0 || delay_ms == TIMERS_SOFT_NONE) {
+        return -1;
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        uint16_t old_expiry = timers_soft_next_expiry();
+        if (timer->active) {
+            timers_soft_remove(timer);
+        }
+        timer->callback = callback;
+        timer->period_ms = period_ms;
+        timers_soft_insert(timer, delay_ms);
+        timers_soft_update_compare(old_expiry);
+    }
+    return 0;
+}
+
+/*
+ * Stop a software timer (does nothing if it is not running)
+ */
+void timers_soft_stop(soft_timer_t * timer)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        uint16_t old_expiry = timers_soft_next_expiry();
+        if (timer->active) {
+            timers_soft_remove(timer);
+            timers_soft_update_compare(old_expiry);
+        }
+    }
+}
+
+/*
+ * Move the software timers on by elapsed_ms ticks and run the callbacks
+ * of any that expire, in expiry order.  Called from the tick ISR with 1,
+ * or from a tickless driver's compare ISR with the ticks since the last
+ * call.  A periodic timer is re-armed before its callback runs, so the
+ * callback may stop or restart it.  If more than a period has gone by, a
+ * periodic timer's callback runs once for each period missed.
+ */
+void timers_soft_advance(uint16_t elapsed_ms)
+{
+    soft_timer_t * timer;
+    while ((timer = g_soft_timers) != NULL) {
+        if (timer->delta > elapsed_ms) {
+            timer->delta -= elapsed_ms;
+            break;
+        }
+        elapsed_ms -= timer->delta;
+        g_soft_timers = timer->next;
+        timer->next = NULL;
+        timer->active = false;
+        if (timer->period_ms != 0) {
+            timers_soft_insert(timer, timer->period_ms);
+        }
+        timer->callback();
+    }
+    if (g_soft_set_next_compare != NULL) {
+        g_soft_set_next_compare(timers_soft_next_expiry());
+    }
+}
+
+/*
+ * Ticks from the last advance until the next timer expires, or
+ * TIMERS_SOFT_NONE if no timer is running
+ */
+uint16_t timers_soft_next_expiry(void)
+{
+    uint16_t ticks;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ticks = (g_soft_timers == NULL) ? TIMERS_SOFT_NONE : g_soft_timers->delta;
+    }
+    return ticks;
+}
+
+static void timers_release_red(void)
+{
+    g_timers_state->release_red = true;
+}
+
+/*
+ * Change how often the RED LED is released (0 stops it)
+ */
+void timers_set_red_period(uint16_t period_ms)
+{
+    g_timers_state->red_period = period_ms;
+    if (period_ms == 0) {
+        timers_soft_stop(&g_red_timer);
+    } else {
+        timers_soft_start(&g_red_timer, timers_release_red, period_ms, period_ms);
+    }
+}
@@ -17,9 +17,33 @@ typedef enum {
 } timer_counter_e;
 
 typedef enum {
-    TIMER_MODE_CTC
+    TIMER_MODE_CTC,
+    /* CTC, with the period corrected on average (see timers_setup_timer) */
+    TIMER_MODE_CTC_PHASE_ACCUMULATE
 } timer_counter_mode_e;
 
+/*
+ * When timers_set_period() changes a running timer
+ *
+ *  - TIMER_UPDATE_AT_MATCH: the current period runs out at its old length
+ *    and the new prescaler and TOP are loaded at the compare match that
+ *    ends it (by timers_compare_match())
+ *  - TIMER_UPDATE_KEEP_PHASE: switch now, moving the count so that the
+ *    same fraction of the period has gone by
+ */
+typedef enum {
+    TIMER_UPDATE_AT_MATCH,
+    TIMER_UPDATE_KEEP_PHASE
+} timer_update_e;
+
+#ifndef F_CPU
+#error "F_CPU must be set to the CPU clock (see Makefile)"
+#endif
+#if F_CPU % 1000000UL != 0
+#error "timers expect a whole number of CPU cycles per us"
+#endif
+#define TIMERS_CYCLES_PER_US (F_CPU / 1000000UL)
+
 typedef struct {
   /* ticks */
   volatile uint32_t ms_ticks;
@@ -47,11 +71,141 @@ uint32_t __ii;
 #define Y_TIMER_RESOLUTION 100
 #define TICKS_PER_SECOND   1000
 
+/*
+ * Compile-time timer setup
+ *
+ * For a period known at build time, TIMERS_SETUP_CTC_TCn(period_us)
+ * picks the prescaler and TOP as constant expressions and compiles down
+ * to the register writes, with none of the search (or logging) that
+ * timers_setup_timer() does at run time.  The smallest prescaler whose
+ * TOP fits is used, as it gives the finest step.  The build fails if the
+ * period does not fit the timer at all, or if the closest setting is
+ * further than TIMERS_MAX_ERROR_PPM from the period asked for.
+ *
+ * In CTC mode the period is (TOP + 1) * prescaler / clock.
+ */
+#define TIMERS_CLOCK_HZ ((unsigned long long)F_CPU)
+
+/* 0.2%: 1ms on the 8-bit TC0 can only be met to 0.16% at 20MHz */
+#ifndef TIMERS_MAX_ERROR_PPM
+#define TIMERS_MAX_ERROR_PPM (2000)
+#endif
+
+#define TIMERS_WIDTH_TC0 (0xFFULL)
+#define TIMERS_WIDTH_TC1 (0xFFFFULL)
+#define TIMERS_WIDTH_TC3 (0xFFFFULL)
+
+/* timer counts in period_us at a prescaler, rounded to nearest (a 0
+ * prescaler only shows up in branches that are not taken) */
+#define TIMERS_CT_COUNTS(period_us, div) \
+    (((unsigned long long)(period_us) * TIMERS_CLOCK_HZ + 500000ULL * (div)) / \
+     (1000000ULL * ((div) ? (div) : 1)))
+#define TIMERS_CT_FITS(period_us, div, width) \
+    (TIMERS_CT_COUNTS(period_us, div) >= 1 && \
+     TIMERS_CT_COUNTS(period_us, div) - 1 <= (width))
+/* prescaler to use (0 if the period is out of range) */
+#define TIMERS_CT_DIVISOR(period_us, width) \
+    (TIMERS_CT_FITS(period_us, 1, width) ? 1 : \
+     TIMERS_CT_FITS(period_us, 8, width) ? 8 : \
+     TIMERS_CT_FITS(period_us, 64, width) ? 64 : \
+     TIMERS_CT_FITS(period_us, 256, width) ? 256 : \
+     TIMERS_CT_FITS(period_us, 1024, width) ? 1024 : 0)
+#define TIMERS_CT_TOP(period_us, width) \
+    (TIMERS_CT_COUNTS(period_us, TIMERS_CT_DIVISOR(period_us, width)) - 1)
+/* achieved period, in clock cycles (vs period_us * clock / 1e6 wanted) */
+#define TIMERS_CT_CYCLES(period_us, width) \
+    ((TIMERS_CT_TOP(period_us, width) + 1) * TIMERS_CT_DIVISOR(period_us, width))
+#define TIMERS_CT_ERROR_PPM(period_us, width) \
+    (((TIMERS_CT_CYCLES(period_us, width) * 1000000ULL > (period_us) * TIMERS_CLOCK_HZ) ? \
+      (TIMERS_CT_CYCLES(period_us, width) * 1000000ULL - (period_us) * TIMERS_CLOCK_HZ) : \
+      ((period_us) * TIMERS_CLOCK_HZ - TIMERS_CT_CYCLES(period_us, width) * 1000000ULL)) / \
+     ((period_us) * TIMERS_CLOCK_HZ / 1000000ULL))
+/* CSn2:0 for a prescaler (the same on TC0, TC1 and TC3) */
+#define TIMERS_CT_CLOCK_SELECT(div) \
+    ((div) == 1 ? 1 : (div) == 8 ? 2 : (div) == 64 ? 3 : (div) == 256 ? 4 : 5)
+
+#define TIMERS_CT_CHECK(period_us, width, name) \
+    _Static_assert(TIMERS_CT_DIVISOR(period_us, width) != 0, \
+                   "period out of range for " name); \
+    _Static_assert(TIMERS_CT_DIVISOR(period_us, width) == 0 || \
+                   TIMERS_CT_ERROR_PPM(period_us, width) <= TIMERS_MAX_ERROR_PPM, \
+                   "no exact enough prescaler/TOP for this period on " name)
+
+#define TIMERS_SETUP_CTC_TC0(period_us) do { \
+    TIMERS_CT_CHECK(period_us, TIMERS_WIDTH_TC0, "TC0"); \
+    TCCR0A = (TCCR0A & ~(1 << WGM00)) | (1 << WGM01); \
+    TCCR0B = (TCCR0B & ~(1 << WGM02 | 1 << CS02 | 1 << CS01 | 1 << CS00)) | \
+        TIMERS_CT_CLOCK_SELECT(TIMERS_CT_DIVISOR(period_us, TIMERS_WIDTH_TC0)); \
+    OCR0A = TIMERS_CT_TOP(period_us, TIMERS_WIDTH_TC0); \
+} while (0)
+
+#define TIMERS_SETUP_CTC_TC1(period_us) do { \
+    TIMERS_CT_CHECK(period_us, TIMERS_WIDTH_TC1, "TC1"); \
+    TCCR1A &= ~(1 << WGM11 | 1 << WGM10); \
+    TCCR1B = (TCCR1B & ~(1 << WGM13 | 1 << CS12 | 1 << CS11 | 1 << CS10)) | (1 << WGM12) | \
+        TIMERS_CT_CLOCK_SELECT(TIMERS_CT_DIVISOR(period_us, TIMERS_WIDTH_TC1)); \
+    OCR1A = TIMERS_CT_TOP(period_us, TIMERS_WIDTH_TC1); \
+} while (0)
+
+#define TIMERS_SETUP_CTC_TC3(period_us) do { \
+    TIMERS_CT_CHECK(period_us, TIMERS_WIDTH_TC3, "TC3"); \
+    TCCR3A &= ~(1 << WGM31 | 1 << WGM30); \
+    TCCR3B = (TCCR3B & ~(1 << WGM33 | 1 << CS32 | 1 << CS31 | 1 << CS30)) | (1 << WGM32) | \
+        TIMERS_CT_CLOCK_SELECT(TIMERS_CT_DIVISOR(period_us, TIMERS_WIDTH_TC3)); \
+    OCR3A = TIMERS_CT_TOP(period_us, TIMERS_WIDTH_TC3); \
+} while (0)
+
+/*
+ * Software timers
+ *
+ * Any number of one-shot and periodic timers run off one hardware
+ * compare (the 1ms TC0 tick).  Pending timers are kept in a delta list,
+ * sorted by expiry, where each timer holds the ticks between its expiry
+ * and the one before it.  A tick only ever looks at the head of the
+ * list, so expiry is O(1) per tick and per timer; starting a timer is
+ * O(n) in the number of pending timers.
+ *
+ * The list does not need a tick every ms.  timers_soft_next_expiry()
+ * says how far away the next expiry is, and timers_soft_advance() can
+ * move time on by any number of ticks at once, so a tickless driver can
+ * program its compare for the next expiry only.  The optional
+ * set_next_compare hook is called whenever the next expiry changes,
+ * with the number of ticks from the last advance to it.
+ *
+ * Callbacks run from the ISR that advances the timers.  The soft_timer_t
+ * is owned by the caller and must stay valid while the timer is active.
+ * Delays are 1 to 65534 ticks and periods at most 65534 ticks.
+ */
+#define TIMERS_SOFT_NONE (0xFFFF)
+
+typedef struct _soft_timer_t {
+    void (*callback)(void);
+    /* reload for periodic timers (ms), 0 for one-shot */
+    uint16_t period_ms;
+    /* ticks between the previous timer in the list expiring and this one */
+    uint16_t delta;
+    volatile bool active;
+    struct _soft_timer_t * next;
+} soft_timer_t;
+
 void timers_init(timers_state_t * timers_state);
 int timers_setup_timer(
         timer_counter_e timer_counter,
         timer_counter_mode_e mode,
         uint32_t target_period_microseconds);
+int timers_set_period(
+        timer_counter_e timer_counter,
+        timer_counter_mode_e mode,
+        uint32_t target_period_microseconds,
+        timer_update_e update);
 uint32_t timers_get_uptime_ms();
+void timers_compare_match(timer_counter_e timer_counter);
+void timers_set_red_period(uint16_t period_ms);
+void timers_soft_init(void (*set_next_compare)(uint16_t ticks));
+int timers_soft_start(soft_timer_t * timer, void (*callback)(void),
+        uint16_t delay_ms, uint16_t period_ms);
+void timers_soft_stop(soft_timer_t * timer);
+void timers_soft_advance(uint16_t elapsed_ms);
+uint16_t timers_soft_next_expiry(void);
 
 #endif //__TIMER_H
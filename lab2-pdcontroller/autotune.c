@@ -0,0 +1,198 @@
+/*
+ * Relay feedback auto-tuning (see autotune.h)
+ *
+ * The experiment is run one sample at a time from the PD controller's
+ * slot, so it sees exactly the sample rate and delays that the tuned
+ * controller will.  The result is worked out once, at the end, in
+ * floating point; nothing on the control path uses it.
+ */
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "autotune.h"
+#include "timers.h"
+
+typedef struct {
+    autotune_status_e status;
+    autotune_rule_e rule;
+    int16_t relay_torque;
+    int16_t output;
+    /* the position the relay switches about, degrees */
+    int32_t setpoint;
+    uint32_t elapsed_ticks;
+    /* switches from -relay to +relay seen, one per cycle */
+    uint8_t switches;
+    /* the cycle in progress */
+    uint32_t cycle_start_ticks;
+    int32_t cycle_min;
+    int32_t cycle_max;
+    /* totals over the measured cycles */
+    uint32_t measured_ticks;
+    int32_t measured_peak_to_peak;
+    autotune_result_t result;
+} autotune_state_t;
+
+static autotune_state_t g_autotune = { .status = AUTOTUNE_IDLE };
+
+/* Kp / Ku, and Tu / Td, for each rule */
+static const float g_rule_kp[] = {
+    [AUTOTUNE_RULE_ZIEGLER_NICHOLS] = 0.6f,
+    [AUTOTUNE_RULE_TYREUS_LUYBEN] = 1.0f / 2.2f
+};
+static const float g_rule_td[] = {
+    [AUTOTUNE_RULE_ZIEGLER_NICHOLS] = 8.0f,
+    [AUTOTUNE_RULE_TYREUS_LUYBEN] = 6.3f
+};
+
+/*
+ * The rule's name, as taken by the autotune command
+ */
+char const *
+autotune_rule_name(autotune_rule_e rule)
+{
+    return (rule == AUTOTUNE_RULE_TYREUS_LUYBEN) ? "tl" : "zn";
+}
+
+/*
+ * Start an experiment about position (degrees), with a relay of
+ * +/-relay_torque.  Any previous result is dropped.
+ */
+void
+autotune_start(autotune_rule_e rule, int16_t relay_torque, int32_t position)
+{
+    g_autotune.status = AUTOTUNE_RUNNING;
+    g_autotune.rule = rule;
+    g_autotune.relay_torque = abs(relay_torque);
+    g_autotune.output = g_autotune.relay_torque;
+    g_autotune.setpoint = position;
+    g_autotune.elapsed_ticks = 0;
+    g_autotune.switches = 0;
+    g_autotune.cycle_start_ticks = 0;
+    g_autotune.cycle_min = 0;
+    g_autotune.cycle_max = 0;
+    g_autotune.measured_ticks = 0;
+    g_autotune.measured_peak_to_peak = 0;
+}
+
+/*
+ * Abandon the experiment (the result is marked as failed)
+ */
+void
+autotune_stop(void)
+{
+    if (g_autotune.status == AUTOTUNE_RUNNING) {
+        g_autotune.status = AUTOTUNE_FAILED;
+    }
+}
+
+autotune_status_e
+autotune_get_status(void)
+{
+    return g_autotune.status;
+}
+
+/*
+ * Copy out the result; false unless the experiment is done
+ */
+bool
+autotune_get_result(autotune_result_t * result)
+{
+    if (g_autotune.status != AUTOTUNE_DONE) {
+        return false;
+    }
+    *result = g_autotune.result;
+    return true;
+}
+
+/*
+ * Work out Ku and Tu, the gains and the expected overshoot
+ */
+static void
+autotune_finish(void)
+{
+    autotune_result_t * result = &g_autotune.result;
+    float amplitude = (float)g_autotune.measured_peak_to_peak / (2.0f * AUTOTUNE_MEASURE_CYCLES);
+    float period = (float)g_autotune.measured_ticks / ((float)AUTOTUNE_MEASURE_CYCLES * PROFILE_TICKS_PER_S);
+    float omega, phase, tau, gain, zeta;
+
+    if (amplitude <= AUTOTUNE_HYSTERESIS_DEG || period <= 0.0f) {
+        g_autotune.status = AUTOTUNE_FAILED;
+        return;
+    }
+    result->rule = g_autotune.rule;
+    result->amplitude = amplitude;
+    result->ultimate_period = period;
+    result->ultimate_gain = 4.0f * g_autotune.relay_torque / ((float)M_PI * amplitude);
+    result->kp = g_rule_kp[g_autotune.rule] * result->ultimate_gain;
+    result->kd = result->kp * period / g_rule_td[g_autotune.rule];
+
+    /*
+     * Fit Km / (s * (tau * s + 1)): the cycle sits where its phase is
+     * -180 degrees plus asin(h / a), and its gain is 1 / Ku.  With the
+     * derivative on the measurement, a step then sees
+     *   Km Kp / (tau s^2 + (1 + Km Kd) s + Km Kp)
+     */
+    omega = 2.0f * (float)M_PI / period;
+    phase = asinf(AUTOTUNE_HYSTERESIS_DEG / amplitude);
+    tau = 1.0f / (omega * tanf(phase));
+    gain = omega * sqrtf(1.0f + omega * omega * tau * tau) / result->ultimate_gain;
+    zeta = (1.0f + gain * result->kd) / (2.0f * sqrtf(tau * gain * result->kp));
+    if (!(zeta > 0.0f)) {
+        result->overshoot_percent = -1.0f;
+    } else if (zeta >= 1.0f) {
+        result->overshoot_percent = 0.0f;
+    } else {
+        result->overshoot_percent = 100.0f * expf(-(float)M_PI * zeta / sqrtf(1.0f - zeta * zeta));
+    }
+    g_autotune.status = AUTOTUNE_DONE;
+}
+
+/*
+ * Take one sample (position in degrees, dt_ticks profile clock ticks
+ * since the last) and return the torque to drive the motor with; 0 once
+ * the experiment is over, however it ended.
+ */
+int16_t
+autotune_step(int32_t position, uint32_t dt_ticks)
+{
+    int32_t error;
+
+    if (g_autotune.status != AUTOTUNE_RUNNING) {
+        return 0;
+    }
+    g_autotune.elapsed_ticks += dt_ticks;
+    error = position - g_autotune.setpoint;
+    if (labs(error) > AUTOTUNE_MAX_ERROR_DEG ||
+            g_autotune.elapsed_ticks > PROFILE_MS_TO_TICKS(AUTOTUNE_TIMEOUT_MS)) {
+        g_autotune.status = AUTOTUNE_FAILED;
+        return 0;
+    }
+
+    if (error > g_autotune.cycle_max) {
+        g_autotune.cycle_max = error;
+    }
+    if (error < g_autotune.cycle_min) {
+        g_autotune.cycle_min = error;
+    }
+
+    if (g_autotune.output > 0 && error > AUTOTUNE_HYSTERESIS_DEG) {
+        g_autotune.output = -g_autotune.relay_torque;
+    } else if (g_autotune.output < 0 && error < -AUTOTUNE_HYSTERESIS_DEG) {
+        g_autotune.output = g_autotune.relay_torque;
+        /* a cycle ends at each switch up */
+        if (g_autotune.switches > AUTOTUNE_SETTLE_CYCLES) {
+            g_autotune.measured_ticks += g_autotune.elapsed_ticks - g_autotune.cycle_start_ticks;
+            g_autotune.measured_peak_to_peak += g_autotune.cycle_max - g_autotune.cycle_min;
+        }
+        g_autotune.switches++;
+        g_autotune.cycle_start_ticks = g_autotune.elapsed_ticks;
+        g_autotune.cycle_min = error;
+        g_autotune.cycle_max = error;
+        if (g_autotune.switches > AUTOTUNE_SETTLE_CYCLES + AUTOTUNE_MEASURE_CYCLES) {
+            autotune_finish();
+            return 0;
+        }
+    }
+    return g_autotune.output;
+}
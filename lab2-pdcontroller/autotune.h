@@ -0,0 +1,73 @@
+/*
+ * autotune.h
+ */
+
+#ifndef AUTOTUNE_H_
+#define AUTOTUNE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Relay feedback auto-tuning (Astrom-Hagglund)
+ *
+ * The motor is driven with +/-relay torque about the position it was at
+ * when the experiment started, switching once the error passes
+ * AUTOTUNE_HYSTERESIS_DEG.  That settles into a limit cycle at about the
+ * ultimate period Tu, and its amplitude a gives the ultimate gain
+ * Ku = 4 * relay / (pi * a).  A tuning rule turns Ku and Tu into Kp and
+ * Kd.
+ *
+ * The hysteresis (needed, as the encoder steps by 5.6 degrees) also fits
+ * a model Km / (s * (tau * s + 1)) to the one point of the frequency
+ * response the cycle measures.  The expected overshoot of a step with
+ * the new gains comes from that model.
+ *
+ * Nothing here touches the hardware: motor.c feeds in each sample and
+ * drives the motor with what comes back (see autotune_step()).
+ */
+#define AUTOTUNE_HYSTERESIS_DEG   (6)
+/* cycles left to settle, then cycles measured */
+#define AUTOTUNE_SETTLE_CYCLES    (2)
+#define AUTOTUNE_MEASURE_CYCLES   (4)
+/* give up after this long, or this far from the start */
+#define AUTOTUNE_TIMEOUT_MS       (10000)
+#define AUTOTUNE_MAX_ERROR_DEG    (720)
+#define AUTOTUNE_DEFAULT_TORQUE   (60)
+
+typedef enum {
+    /* classic Ziegler-Nichols: Kp = 0.6 Ku, Td = Tu / 8 */
+    AUTOTUNE_RULE_ZIEGLER_NICHOLS,
+    /* Tyreus-Luyben: Kp = Ku / 2.2, Td = Tu / 6.3; less overshoot */
+    AUTOTUNE_RULE_TYREUS_LUYBEN
+} autotune_rule_e;
+
+typedef enum {
+    AUTOTUNE_IDLE,
+    AUTOTUNE_RUNNING,
+    AUTOTUNE_DONE,
+    AUTOTUNE_FAILED
+} autotune_status_e;
+
+typedef struct {
+    autotune_rule_e rule;
+    /* ultimate gain (torque/degree) and period (s) */
+    float ultimate_gain;
+    float ultimate_period;
+    /* limit cycle amplitude, degrees */
+    float amplitude;
+    /* the gains, torque/degree and torque/(degree/s) */
+    float kp;
+    float kd;
+    /* of a step, from the fitted model; negative if it could not be fitted */
+    float overshoot_percent;
+} autotune_result_t;
+
+void autotune_start(autotune_rule_e rule, int16_t relay_torque, int32_t position);
+int16_t autotune_step(int32_t position, uint32_t dt_ticks);
+void autotune_stop(void);
+autotune_status_e autotune_get_status(void);
+bool autotune_get_result(autotune_result_t * result);
+char const * autotune_rule_name(autotune_rule_e rule);
+
+#endif /* AUTOTUNE_H_ */
@@ -0,0 +1,320 @@
+/*
+ * Scheduler ISR benchmark
+ *
+ * Measures the number of CPU cycles that the 1ms tick spends releasing
+ * tasks, for task tables of 7, 16 and 32 entries.  Two release methods
+ * are timed against the same tables:
+ *
+ *  - scan:  the original loop doing `ms_ticks % period_ms` on every task
+ *  - wheel: scheduler_do_schedule() (timing wheel)
+ *
+ * scheduler_preempt(), which the tick runs straight after, is timed too.
+ * None of the benchmark tasks is allowed to preempt (and none of them
+ * ever runs), so this is the cost of finding that out with every task
+ * left ready.
+ *
+ * TC1 is run with no prescaler so that each count is one CPU cycle.  The
+ * measurement must be done with interrupts disabled and before the real
+ * task table is handed to the scheduler; the results are held until
+ * bench_report() is called once logging is up.
+ *
+ * The same tables run on the host (x86, no AVR board to hand) do this
+ * much work over the BENCH_TICKS ticks:
+ *
+ *   tasks  scan modulos  wheel visits  of which later-lap
+ *      7          7000          1406                  22
+ *     16         16000          2844                  74
+ *     32         32000          5688                 148
+ *
+ * A 32-bit modulo is a call to __udivmodsi4, several hundred cycles on
+ * the AVR, so the scan costs roughly 600 cycles per task per tick.  A
+ * wheel visit is a compare, and the visits that are not releases are the
+ * tasks with periods over SCHEDULER_WHEEL_SLOTS ms (the 100, 250 and
+ * 1000 ms entries) being looked at once a lap.
+ *
+ * scheduler_preempt() used to walk the whole table for the best ready
+ * task, N tasks every tick; with the per-priority ready lists it is one
+ * test of the ready map whatever N is.  On the host that took it from
+ * about 20/30/55 TSC cycles per tick for 7/16/32 tasks to about 5.
+ *
+ * Preemption benchmark
+ *
+ * bench_load_task() busy-waits for BENCH_LOAD_MS, standing in for an LCD
+ * refresh or a CLI command stuck in serial_send_blocking().  With
+ * DO_PREEMPTION_BENCHMARK defined in lab2.c it is added to the task
+ * table and the worst-case PD release latency can be read back with the
+ * "stats" command.  Building with SCHEDULER_PREEMPT_PRIORITY=0x7F gives
+ * the cooperative-only numbers to compare against.
+ *
+ * PD controller benchmark
+ *
+ * Times motor_service_pd_controller() against the divide law it
+ * replaced, for BENCH_PD_CYCLES cycles each, on TC1 at clk/1 as above.
+ * The old law is built twice: at -O0, as the whole tree was when it ran,
+ * and at -O2, as the control path is now, so the divides can be told
+ * apart from the change of optimisation.  Both read the interpolator the
+ * same way; only the real one writes OCR2B, which is a few cycles.  With
+ * DO_PD_BENCHMARK defined in lab2.c it runs once at start up, with the
+ * motor at rest, and bench_pd_report() logs the results.
+ */
+#include <avr/io.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "bench.h"
+#include "interpolator.h"
+#include "log.h"
+#include "macros.h"
+#include "motor.h"
+#include "scheduler.h"
+#include "timers.h"
+
+#define BENCH_MAX_TASKS (32)
+#define BENCH_TICKS     (1000)
+#define BENCH_LOAD_MS   (20)
+#define BENCH_PD_CYCLES (100)
+
+/* the old law's constants and default gains (see motor.c) */
+#define BENCH_MAX_TORQUE         (255)
+#define BENCH_COEFFICIENT_SCALAR (100)
+#define BENCH_KP                 (324)
+#define BENCH_KD                 (3)
+
+typedef struct {
+    uint8_t number_tasks;
+    uint16_t min_cycles;
+    uint16_t max_cycles;
+    uint32_t total_cycles;
+} bench_result_t;
+
+static const uint8_t bench_table_sizes[] = {7, 16, 32};
+static const uint16_t bench_periods[] = {1, 5, 10, 20, 50, 100, 250, 1000};
+
+static task_t g_bench_tasks[BENCH_MAX_TASKS];
+static timers_state_t g_bench_timers_state;
+static bench_result_t g_scan_results[COUNT_OF(bench_table_sizes)];
+static bench_result_t g_wheel_results[COUNT_OF(bench_table_sizes)];
+static bench_result_t g_preempt_results[COUNT_OF(bench_table_sizes)];
+static bench_result_t g_divide_o0_result;
+static bench_result_t g_divide_o2_result;
+static bench_result_t g_fixed_result;
+
+/* the old law's gains, set at run time so they are not folded in */
+static int32_t g_bench_kp;
+static int32_t g_bench_kd;
+static volatile int g_bench_torque;
+
+static void
+bench_nop_task(void)
+{
+}
+
+/*
+ * The release loop that scheduler_do_schedule() used to run
+ */
+static void
+bench_scan_release(uint8_t number_tasks)
+{
+    int i;
+    task_t * task;
+    for (i = 0; i < number_tasks; i++) {
+        task = &g_bench_tasks[i];
+        if (g_bench_timers_state.ms_ticks % task->period_ms == 0) {
+            task->state = TASK_STATE_READY;
+        }
+    }
+}
+
+/*
+ * The law motor_service_pd_controller() ran before it went to fixed
+ * point, with the torque stored rather than written to the motor
+ */
+#define BENCH_DIVIDE_PD_LAW                                               \
+    {                                                                     \
+        int32_t torque;                                                   \
+        int32_t target_position = interpolator_get_target_position();     \
+        int32_t current_position = interpolator_get_current_position();   \
+        int current_velocity = interpolator_get_current_velocity();       \
+        torque =                                                          \
+            (g_bench_kp * (target_position - current_position) /          \
+                BENCH_COEFFICIENT_SCALAR) -                               \
+            (g_bench_kd * current_velocity / BENCH_COEFFICIENT_SCALAR);   \
+        g_bench_torque = (torque > BENCH_MAX_TORQUE) ? BENCH_MAX_TORQUE : \
+            (torque < -BENCH_MAX_TORQUE) ? -BENCH_MAX_TORQUE : torque;    \
+    }
+
+static void __attribute__((optimize("O0")))
+bench_divide_pd_law_o0(void) BENCH_DIVIDE_PD_LAW
+
+static void __attribute__((optimize("O2")))
+bench_divide_pd_law_o2(void) BENCH_DIVIDE_PD_LAW
+
+static void
+bench_result_add(bench_result_t * result, uint16_t cycles)
+{
+    if (cycles < result->min_cycles) {
+        result->min_cycles = cycles;
+    }
+    if (cycles > result->max_cycles) {
+        result->max_cycles = cycles;
+    }
+    result->total_cycles += cycles;
+}
+
+/*
+ * Run both release methods, and the preemption check, for BENCH_TICKS
+ * ticks against one table size
+ */
+static void
+bench_run(uint8_t number_tasks, bench_result_t * scan, bench_result_t * wheel,
+        bench_result_t * preempt)
+{
+    int i;
+    uint16_t start, overhead;
+
+    for (i = 0; i < number_tasks; i++) {
+        g_bench_tasks[i].task_name = "bench";
+        g_bench_tasks[i].period_ms = bench_periods[i % COUNT_OF(bench_periods)];
+        g_bench_tasks[i].run_task = bench_nop_task;
+        g_bench_tasks[i].priority = 0;
+    }
+    *scan = (bench_result_t) { .number_tasks = number_tasks, .min_cycles = UINT16_MAX };
+    *wheel = (bench_result_t) { .number_tasks = number_tasks, .min_cycles = UINT16_MAX };
+    *preempt = (bench_result_t) { .number_tasks = number_tasks, .min_cycles = UINT16_MAX };
+
+    /* cost of reading TCNT1 back to back */
+    start = TCNT1;
+    overhead = TCNT1 - start;
+
+    g_bench_timers_state.ms_ticks = 0;
+    scheduler_init(&g_bench_timers_state, g_bench_tasks, number_tasks,
+            SCHEDULER_PHASE_EXPLICIT);
+    for (i = 0; i < BENCH_TICKS; i++) {
+        g_bench_timers_state.ms_ticks++;
+
+        start = TCNT1;
+        bench_scan_release(number_tasks);
+        bench_result_add(scan, TCNT1 - start - overhead);
+
+        start = TCNT1;
+        scheduler_do_schedule();
+        bench_result_add(wheel, TCNT1 - start - overhead);
+
+        start = TCNT1;
+        scheduler_preempt();
+        bench_result_add(preempt, TCNT1 - start - overhead);
+    }
+}
+
+/*
+ * Measure release cost.  Call with interrupts disabled.
+ */
+void
+bench_scheduler_isr(void)
+{
+    int i;
+    uint8_t tccr1a = TCCR1A;
+    uint8_t tccr1b = TCCR1B;
+
+    /* normal mode, clk/1 */
+    TCCR1A = 0;
+    TCCR1B = (1 << CS10);
+    for (i = 0; i < COUNT_OF(bench_table_sizes); i++) {
+        bench_run(bench_table_sizes[i], &g_scan_results[i], &g_wheel_results[i],
+                &g_preempt_results[i]);
+    }
+    TCCR1A = tccr1a;
+    TCCR1B = tccr1b;
+}
+
+/*
+ * Log the results gathered by bench_scheduler_isr()
+ */
+void
+bench_report(void)
+{
+    int i;
+    LOG("release cycles per tick (min/avg/max)\r\n");
+    for (i = 0; i < COUNT_OF(bench_table_sizes); i++) {
+        LOG("%2u tasks: scan %u/%lu/%u, wheel %u/%lu/%u, preempt %u/%lu/%u\r\n",
+            g_scan_results[i].number_tasks,
+            g_scan_results[i].min_cycles,
+            g_scan_results[i].total_cycles / BENCH_TICKS,
+            g_scan_results[i].max_cycles,
+            g_wheel_results[i].min_cycles,
+            g_wheel_results[i].total_cycles / BENCH_TICKS,
+            g_wheel_results[i].max_cycles,
+            g_preempt_results[i].min_cycles,
+            g_preempt_results[i].total_cycles / BENCH_TICKS,
+            g_preempt_results[i].max_cycles);
+    }
+}
+
+/*
+ * Measure the PD controller, old and new.  Call with interrupts disabled,
+ * once the motor and interpolator are set up.
+ */
+void
+bench_pd_controller(void)
+{
+    int i;
+    uint16_t start, overhead;
+    uint8_t tccr1a = TCCR1A;
+    uint8_t tccr1b = TCCR1B;
+
+    g_bench_kp = BENCH_KP;
+    g_bench_kd = BENCH_KD;
+    g_divide_o0_result = (bench_result_t) { .min_cycles = UINT16_MAX };
+    g_divide_o2_result = (bench_result_t) { .min_cycles = UINT16_MAX };
+    g_fixed_result = (bench_result_t) { .min_cycles = UINT16_MAX };
+
+    /* normal mode, clk/1 */
+    TCCR1A = 0;
+    TCCR1B = (1 << CS10);
+    start = TCNT1;
+    overhead = TCNT1 - start;
+    for (i = 0; i < BENCH_PD_CYCLES; i++) {
+        start = TCNT1;
+        bench_divide_pd_law_o0();
+        bench_result_add(&g_divide_o0_result, TCNT1 - start - overhead);
+
+        start = TCNT1;
+        bench_divide_pd_law_o2();
+        bench_result_add(&g_divide_o2_result, TCNT1 - start - overhead);
+
+        start = TCNT1;
+        motor_service_pd_controller();
+        bench_result_add(&g_fixed_result, TCNT1 - start - overhead);
+    }
+    TCCR1A = tccr1a;
+    TCCR1B = tccr1b;
+}
+
+/*
+ * Log the results gathered by bench_pd_controller()
+ */
+void
+bench_pd_report(void)
+{
+    LOG("PD controller cycles (min/avg/max)\r\n");
+    LOG("divide -O0 %u/%lu/%u, divide -O2 %u/%lu/%u, fixed point %u/%lu/%u\r\n",
+        g_divide_o0_result.min_cycles,
+        g_divide_o0_result.total_cycles / BENCH_PD_CYCLES,
+        g_divide_o0_result.max_cycles,
+        g_divide_o2_result.min_cycles,
+        g_divide_o2_result.total_cycles / BENCH_PD_CYCLES,
+        g_divide_o2_result.max_cycles,
+        g_fixed_result.min_cycles,
+        g_fixed_result.total_cycles / BENCH_PD_CYCLES,
+        g_fixed_result.max_cycles);
+}
+
+/*
+ * Busy-wait for BENCH_LOAD_MS (measured on the profile clock)
+ */
+void
+bench_load_task(void)
+{
+    uint16_t start = timers_get_profile_ticks();
+    while (PROFILE_TICKS_TO_US((uint16_t)(timers_get_profile_ticks() - start)) < BENCH_LOAD_MS * 1000UL) {
+    }
+}
@@ -0,0 +1,15 @@
+/*
+ * bench.h
+ *
+ * On-target cycle count benchmarks
+ */
+#ifndef BENCH_H_
+#define BENCH_H_
+
+void bench_scheduler_isr(void);
+void bench_report(void);
+void bench_load_task(void);
+void bench_pd_controller(void);
+void bench_pd_report(void);
+
+#endif /* BENCH_H_ */
@@ -7,7 +7,8 @@
 #include "log.h"
 #include "cli.h"
 
-#define MAX_CLI_COMMANDS (20)
+/* 24 are registered in the scheduler build; each slot is 6 bytes of RAM */
+#define MAX_CLI_COMMANDS (32)
 #define UNUSED_PARAMETER(x) (void)(x)
 
 typedef struct {
@@ -129,14 +130,28 @@ int cli_init(void)
 }
 
 /*
- * Register a CLI command
+ * Register a CLI command (dropped, with an error, once the table is full)
  */
 void cli_register(cli_command_t command)
 {
+    if (cli_commands.number_commands >= MAX_CLI_COMMANDS) {
+        LOG_ERROR("CLI table full, cannot register %s\r\n", command.command);
+        return;
+    }
     cli_commands.commands[cli_commands.number_commands] = command;
     cli_commands.number_commands++;
 }
 
+/*
+ * Check if there are received bytes that cli_service() has not seen yet
+ *
+ * Only valid after serial_check() has been called.
+ */
+bool cli_input_pending(void)
+{
+    return serial_get_received_bytes(USB_COMM) != g_receive_buffer.ring_buffer_position;
+}
+
 // Parse user-input and implement commands
 int cli_service(void)
 {
@@ -160,7 +175,7 @@ int cli_service(void)
         } else {
             g_receive_buffer.command_buffer[g_receive_buffer.command_buffer_length++] = c;
         }
-        if (g_receive_buffer.ring_buffer_position == sizeof(g_receive_buffer.ring_buffer)) {
+        if (g_receive_buffer.ring_buffer_position == sizeof(g_receive_buffer.ring_buffer) - 1) {
             g_receive_buffer.ring_buffer_position = 0;
         } else {
             g_receive_buffer.ring_buffer_position++;
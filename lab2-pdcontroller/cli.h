@@ -5,6 +5,7 @@
 #define __CLI_H
 
 #include <inttypes.h>
+#include <stdbool.h>
 #include "macros.h"
 
 typedef int (*cli_command_handler_t)(char const * const args);
@@ -17,6 +18,7 @@ typedef struct {
 
 int cli_init(void);
 int cli_service(void);
+bool cli_input_pending(void);
 void cli_register(cli_command_t command);
 
 #define CLI_REGISTER(...) do { \
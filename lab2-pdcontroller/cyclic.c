@@ -0,0 +1,109 @@
+/*
+ * Cyclic executive runtime
+ *
+ * Runs a frame table built by CYCLIC_EXECUTIVE_TABLE() (see cyclic.h).
+ * The tick ISR counts milliseconds into the frame and flags the start of
+ * each frame; the main loop then runs the tasks in that frame's mask, in
+ * list order.  All of the period arithmetic was done by the compiler.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <util/atomic.h>
+#include "cyclic.h"
+#include "cli.h"
+#include "log.h"
+
+static cyclic_task_t const * g_tasks = NULL;
+static uint16_t const * g_frames = NULL;
+static uint8_t g_number_frames = 0;
+static uint8_t g_frame_ms = 0;
+static uint16_t g_hyperperiod_ms = 0;
+
+/* ms into the current frame (tick ISR only) */
+static uint8_t g_frame_elapsed_ms = 0;
+/* frames started but not yet run */
+static volatile uint8_t g_frames_pending = 0;
+static uint8_t g_next_frame = 0;
+/* frames that started before the previous one had finished */
+static volatile uint16_t g_frame_overruns = 0;
+
+/*
+ * Usage: frames
+ */
+static int clicmd_frames(char const * const args)
+{
+    int i;
+    (void)(args);
+    LOG("frame: %u ms, hyperperiod: %u ms, overruns: %u\r\n",
+        g_frame_ms, g_hyperperiod_ms, g_frame_overruns);
+    for (i = 0; i < g_number_frames; i++) {
+        LOG("  frame %2d: 0x%04x\r\n", i, g_frames[i]);
+    }
+    return 0;
+}
+
+/*
+ * Initialize the executive with a generated table
+ */
+void
+cyclic_init(
+        cyclic_task_t const * tasks,
+        uint16_t const * frames,
+        uint8_t number_frames,
+        uint8_t frame_ms,
+        uint16_t hyperperiod_ms)
+{
+    g_tasks = tasks;
+    g_frames = frames;
+    g_number_frames = number_frames;
+    g_frame_ms = frame_ms;
+    g_hyperperiod_ms = hyperperiod_ms;
+    g_frame_elapsed_ms = 0;
+    g_frames_pending = 0;
+    g_next_frame = 0;
+    CLI_REGISTER(
+        {"frames", "Show the cyclic executive frame table", clicmd_frames}
+    );
+}
+
+/*
+ * Called from the 1ms tick ISR
+ */
+void
+cyclic_tick(void)
+{
+    if (++g_frame_elapsed_ms == g_frame_ms) {
+        g_frame_elapsed_ms = 0;
+        if (g_frames_pending) {
+            g_frame_overruns++;
+        }
+        g_frames_pending++;
+    }
+}
+
+/*
+ * Called from the main loop.  Runs the next frame if it has started.
+ * An overrun frame is still run (late) rather than skipped so that every
+ * task keeps its rate over the hyperperiod.
+ */
+void
+cyclic_service(void)
+{
+    uint16_t mask;
+    uint8_t i;
+
+    if (g_frames_pending == 0) {
+        return;
+    }
+    mask = g_frames[g_next_frame];
+    g_next_frame = (g_next_frame + 1 == g_number_frames) ? 0 : g_next_frame + 1;
+    for (i = 0; mask != 0; i++, mask >>= 1) {
+        if (mask & 1) {
+            g_tasks[i]();
+        }
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        g_frames_pending--;
+    }
+}
@@ -0,0 +1,122 @@
+/*
+ * cyclic.h
+ *
+ * Compile-time cyclic executive
+ *
+ * A task list is written once as an X-macro:
+ *
+ *     #define MY_TASKS(X, a) \
+ *         X(a, name, run_task, period_ms, offset_ms, wcet_us) \
+ *         ...
+ *
+ * and CYCLIC_EXECUTIVE_TABLE(MY_TASKS) works out, at build time, the
+ * frame size (shortest period), the hyperperiod (longest period) and a
+ * bitmask of the tasks to run in each frame.  The build fails if the
+ * periods are not harmonic, if an offset is not a whole number of frames
+ * inside the period, if the table would need more than CE_MAX_FRAMES
+ * frames, or if the declared WCETs of the tasks in any frame add up to
+ * more than the frame.
+ *
+ * The task `name` must be a valid identifier.  Only one table may be
+ * generated per program.
+ */
+#ifndef CYCLIC_H_
+#define CYCLIC_H_
+
+#include <stdint.h>
+
+#define CE_MAX_TASKS  (16)
+#define CE_MAX_FRAMES (32)
+
+typedef void (*cyclic_task_t)(void);
+
+/* pull apart an (x, y) argument */
+#define CE_ARG0(a) CE_ARG0_ a
+#define CE_ARG0_(x, y) x
+#define CE_ARG1(a) CE_ARG1_ a
+#define CE_ARG1_(x, y) y
+
+/* modulo that is safe to expand with a zero divisor in a dead branch */
+#define CE_MOD(n, d) ((n) % ((d) ? (d) : 1))
+
+#define CE_REPEAT_16(M, a) \
+    M(0, a) M(1, a) M(2, a) M(3, a) M(4, a) M(5, a) M(6, a) M(7, a) \
+    M(8, a) M(9, a) M(10, a) M(11, a) M(12, a) M(13, a) M(14, a) M(15, a)
+#define CE_REPEAT_32(M, a) \
+    CE_REPEAT_16(M, a) \
+    M(16, a) M(17, a) M(18, a) M(19, a) M(20, a) M(21, a) M(22, a) M(23, a) \
+    M(24, a) M(25, a) M(26, a) M(27, a) M(28, a) M(29, a) M(30, a) M(31, a)
+#define CE_CHAIN_16(M, a, last) \
+    M(0, a, M(1, a, M(2, a, M(3, a, M(4, a, M(5, a, M(6, a, M(7, a, \
+    M(8, a, M(9, a, M(10, a, M(11, a, M(12, a, M(13, a, M(14, a, M(15, a, \
+    last))))))))))))))))
+
+/* per-task expansions */
+#define CE_X_INDEX(a, name, fn, T, O, C)  CE_TASK_##name,
+#define CE_X_RUN(a, name, fn, T, O, C)    fn,
+#define CE_X_PERIOD_AT(k, name, fn, T, O, C) + ((CE_TASK_##name == (k)) ? (T) : 0)
+#define CE_X_DIVIDES(p, name, fn, T, O, C) + (CE_MOD((T), (p)) == 0)
+#define CE_X_DIVIDES_INTO(p, name, fn, T, O, C) + (CE_MOD((p), (T)) == 0)
+#define CE_X_HARMONIC(p, name, fn, T, O, C) \
+    + (CE_MOD((T), (p)) == 0 || CE_MOD((p), (T)) == 0)
+#define CE_X_RUNS_IN(f, name, fn, T, O, C) \
+    (CE_MOD((f) * CE_FRAME_MS + (T) - (O), (T)) == 0)
+#define CE_X_MASK(f, name, fn, T, O, C) \
+    | (CE_X_RUNS_IN(f, name, fn, T, O, C) ? (1U << CE_TASK_##name) : 0)
+#define CE_X_LOAD(f, name, fn, T, O, C) \
+    + (CE_X_RUNS_IN(f, name, fn, T, O, C) ? (uint32_t)(C) : 0)
+#define CE_X_CHECK_OFFSET(a, name, fn, T, O, C) \
+    _Static_assert((O) < (T) && CE_MOD((O), CE_FRAME_MS) == 0, \
+        "offset of " #name " must be a whole number of frames within its period");
+
+/* per-index / per-frame expansions */
+#define CE_PERIOD_ENUM(k, list) CE_PERIOD_##k = (0 list(CE_X_PERIOD_AT, k)),
+#define CE_PICK_FRAME(k, list, rest) \
+    ((CE_PERIOD_##k != 0 && (0 list(CE_X_DIVIDES, CE_PERIOD_##k)) == CE_NUM_TASKS) ? \
+        CE_PERIOD_##k : (rest))
+#define CE_PICK_HYPERPERIOD(k, list, rest) \
+    ((CE_PERIOD_##k != 0 && (0 list(CE_X_DIVIDES_INTO, CE_PERIOD_##k)) == CE_NUM_TASKS) ? \
+        CE_PERIOD_##k : (rest))
+#define CE_CHECK_HARMONIC(k, list) \
+    _Static_assert((k) >= CE_NUM_TASKS || \
+        (0 list(CE_X_HARMONIC, CE_PERIOD_##k)) == CE_NUM_TASKS, \
+        "task periods are not harmonic");
+#define CE_CHECK_BUDGET(f, list) \
+    _Static_assert((f) >= CE_NUM_FRAMES || \
+        (0 list(CE_X_LOAD, f)) <= CE_FRAME_MS * 1000UL, \
+        "frame " #f " is over budget");
+#define CE_FRAME_MASK(f, list) (0 list(CE_X_MASK, f)),
+
+/*
+ * Generate the frame table for a task list.  Defines:
+ *
+ *  - CE_FRAME_MS, CE_HYPERPERIOD_MS, CE_NUM_FRAMES, CE_NUM_TASKS
+ *  - ce_tasks[]:  run functions, in list order
+ *  - ce_frames[]: bitmask of ce_tasks[] to run in each frame
+ */
+#define CYCLIC_EXECUTIVE_TABLE(list) \
+    enum { list(CE_X_INDEX, 0) CE_NUM_TASKS }; \
+    _Static_assert(CE_NUM_TASKS <= CE_MAX_TASKS, "too many tasks"); \
+    enum { CE_REPEAT_16(CE_PERIOD_ENUM, list) }; \
+    CE_REPEAT_16(CE_CHECK_HARMONIC, list) \
+    enum { \
+        CE_FRAME_MS = CE_CHAIN_16(CE_PICK_FRAME, list, 0), \
+        CE_HYPERPERIOD_MS = CE_CHAIN_16(CE_PICK_HYPERPERIOD, list, 0), \
+        CE_NUM_FRAMES = CE_HYPERPERIOD_MS / (CE_FRAME_MS ? CE_FRAME_MS : 1) \
+    }; \
+    _Static_assert(CE_NUM_FRAMES <= CE_MAX_FRAMES, "too many frames"); \
+    list(CE_X_CHECK_OFFSET, 0) \
+    CE_REPEAT_32(CE_CHECK_BUDGET, list) \
+    static const cyclic_task_t ce_tasks[CE_NUM_TASKS] = { list(CE_X_RUN, 0) }; \
+    static const uint16_t ce_frames[CE_MAX_FRAMES] = { CE_REPEAT_32(CE_FRAME_MASK, list) }
+
+void cyclic_init(
+        cyclic_task_t const * tasks,
+        uint16_t const * frames,
+        uint8_t number_frames,
+        uint8_t frame_ms,
+        uint16_t hyperperiod_ms);
+void cyclic_tick(void);
+void cyclic_service(void);
+
+#endif /* CYCLIC_H_ */
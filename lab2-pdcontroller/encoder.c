@@ -0,0 +1,278 @@
+/*
+ * Quadrature decoder for the motor 2 encoder (A on PD1, B on PD0)
+ *
+ * This takes the place of the Pololu library's encoder driver, so the
+ * pin change ISR can also timestamp every transition for the low speed
+ * velocity estimate.  The Pololu driver must not be linked in as well
+ * (it has its own PCINT ISRs), so encoders_*() are not to be used.
+ *
+ * Input capture is not an option on this board: ICP1 is PD6, which is
+ * the motor PWM output (OC2B), and ICP3 is not wired to the encoder.
+ *
+ * The ISR can also post a task every so many transitions (see
+ * encoder_set_edge_event()).
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "cli.h"
+#include "encoder.h"
+#include "log.h"
+#include "scheduler.h"
+#include "timers.h"
+
+#define ENCODER_PIN_A (PD1)
+#define ENCODER_PIN_B (PD0)
+
+/*
+ * Two edges less than this far apart are timed with the profile clock,
+ * which wraps every ~209ms; further apart, the ms uptime is close enough.
+ */
+#define ENCODER_FINE_MS (150)
+
+/* encoder_velocity() is exact below these (their product is 2^32) */
+#define ENCODER_EXACT_COUNTS (1UL << 10)
+#define ENCODER_EXACT_US     (1UL << 22)
+
+/* When a transition happened, as a coarse and a fine timestamp */
+typedef struct {
+    uint32_t ms;
+    uint16_t ticks;
+} encoder_time_t;
+
+typedef struct {
+    /* position, in transitions */
+    volatile int32_t counts;
+    /* transitions in either direction (wraps) */
+    volatile uint16_t edges;
+    /* time of the last transition */
+    encoder_time_t last_edge;
+    uint8_t last_a;
+    uint8_t last_b;
+    /* the task posted every event_edges transitions (0: none), and the
+     * transitions since it last was */
+    void (*event_task)(void);
+    uint16_t event_edges;
+    uint16_t event_count;
+} encoder_state_t;
+
+/* what the previous encoder_sample_velocity() saw */
+typedef struct {
+    int32_t counts;
+    uint16_t edges;
+    encoder_time_t last_edge;
+    uint32_t sample_us;
+    int32_t velocity;
+} encoder_sample_t;
+
+static encoder_state_t g_encoder;
+static encoder_sample_t g_sample;
+
+static int clicmd_edges(char const * const args)
+{
+    unsigned int edges;
+    if (args != NULL && 1 == sscanf(args, "%u", &edges)) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            g_encoder.event_edges = edges;
+            g_encoder.event_count = 0;
+        }
+    }
+    LOG("edge event every %u transitions\r\n", g_encoder.event_edges);
+    return 0;
+}
+
+/*
+ * Set up the pins and the pin change interrupt.  The count starts at 0.
+ */
+void encoder_init(void)
+{
+    /* inputs, with pull-ups */
+    DDRD &= ~(1 << ENCODER_PIN_A | 1 << ENCODER_PIN_B);
+    PORTD |= (1 << ENCODER_PIN_A | 1 << ENCODER_PIN_B);
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        g_encoder.counts = 0;
+        g_encoder.edges = 0;
+        g_encoder.last_a = (PIND >> ENCODER_PIN_A) & 1;
+        g_encoder.last_b = (PIND >> ENCODER_PIN_B) & 1;
+        g_encoder.last_edge.ms = timers_get_uptime_ms();
+        g_encoder.last_edge.ticks = timers_get_profile_ticks();
+        g_encoder.event_edges = 0;
+
+        /* PD0/PD1 are PCINT24/25 */
+        PCMSK3 |= (1 << PCINT24 | 1 << PCINT25);
+        PCIFR = (1 << PCIE3);
+        PCICR |= (1 << PCIE3);
+    }
+
+    g_sample.counts = 0;
+    g_sample.edges = 0;
+    g_sample.last_edge = g_encoder.last_edge;
+    g_sample.sample_us = timers_get_uptime_us();
+    g_sample.velocity = 0;
+
+    CLI_REGISTER(
+        {"edges", "edges [n]: Post the edge event task every n encoder transitions (0: off), or show it",
+         clicmd_edges}
+    );
+}
+
+/*
+ * Have the pin change ISR post run_task (see scheduler_post()) every
+ * `edges` transitions, in either direction.  0 turns it off.  The ISR
+ * does not call scheduler_preempt(), so the task should be below
+ * SCHEDULER_PREEMPT_PRIORITY: it runs from the main loop, which the
+ * interrupt has woken.
+ */
+void encoder_set_edge_event(void (*run_task)(void), uint16_t edges)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        g_encoder.event_task = run_task;
+        g_encoder.event_edges = edges;
+        g_encoder.event_count = 0;
+    }
+}
+
+/*
+ * Get the position, in transitions (ENCODER_TRANSITIONS_PER_REV per
+ * revolution)
+ */
+int32_t encoder_get_counts(void)
+{
+    int32_t counts;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        counts = g_encoder.counts;
+    }
+    return counts;
+}
+
+/*
+ * Time from one transition to a later one, in us
+ */
+static uint32_t encoder_elapsed_us(encoder_time_t const * from, encoder_time_t const * to)
+{
+    uint32_t ms = to->ms - from->ms;
+    if (ms < ENCODER_FINE_MS) {
+        return PROFILE_TICKS_TO_US((uint16_t)(to->ticks - from->ticks));
+    }
+    return ms * 1000UL;
+}
+
+/*
+ * counts / elapsed_us, in counts/s (ENCODER_VELOCITY_SHIFT fraction bits)
+ *
+ * This may run at the PD rate from an ISR, so it stays in 32 bits (a 64
+ * bit divide is thousands of cycles on the AVR).  The reciprocal of the
+ * interval is taken once, and the counts are multiplied by it; the
+ * remainder is carried while its product fits, which makes the result
+ * exact up to ENCODER_EXACT_COUNTS in ENCODER_EXACT_US.  Past that, the
+ * remainder is dropped, which is out by less than one part in
+ * (2^ENCODER_VELOCITY_SHIFT * 10^6 / elapsed_us).
+ */
+static int32_t encoder_velocity(int32_t counts, uint32_t elapsed_us)
+{
+    uint32_t magnitude = (uint32_t)labs(counts);
+    uint32_t reciprocal;
+    uint32_t remainder;
+    uint32_t speed;
+    if (elapsed_us == 0) {
+        return 0;
+    }
+    reciprocal = (1000000UL << ENCODER_VELOCITY_SHIFT) / elapsed_us;
+    remainder = (1000000UL << ENCODER_VELOCITY_SHIFT) % elapsed_us;
+    speed = magnitude * reciprocal;
+    if (magnitude < ENCODER_EXACT_COUNTS && elapsed_us < ENCODER_EXACT_US) {
+        speed += magnitude * remainder / elapsed_us;
+    }
+    return (counts < 0) ? -(int32_t)speed : (int32_t)speed;
+}
+
+/*
+ * Estimate the velocity since the last call, in counts/s (fixed point,
+ * ENCODER_VELOCITY_SHIFT fraction bits).  Counting is used at speed and
+ * 1/T at low speed (see encoder.h).  Call periodically, from one context
+ * (the PD controller, see interpolator_sample()).
+ */
+int32_t encoder_sample_velocity(void)
+{
+    int32_t counts;
+    uint16_t edges;
+    encoder_time_t last_edge;
+    uint32_t now_us;
+    uint32_t since_edge_ms;
+    int32_t velocity;
+    int32_t bound;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        counts = g_encoder.counts;
+        edges = g_encoder.edges;
+        last_edge = g_encoder.last_edge;
+    }
+    now_us = timers_get_uptime_us();
+
+    if ((uint16_t)(edges - g_sample.edges) >= ENCODER_COUNTING_MIN_EDGES) {
+        velocity = encoder_velocity(counts - g_sample.counts, now_us - g_sample.sample_us);
+    } else if (edges != g_sample.edges) {
+        velocity = encoder_velocity(counts - g_sample.counts,
+                encoder_elapsed_us(&g_sample.last_edge, &last_edge));
+    } else {
+        /* still, or moving slower than one transition in the time since the last */
+        velocity = g_sample.velocity;
+        since_edge_ms = timers_get_uptime_ms() - last_edge.ms;
+        if (since_edge_ms >= ENCODER_STOPPED_MS) {
+            velocity = 0;
+        } else if (since_edge_ms > 0) {
+            bound = encoder_velocity(1, since_edge_ms * 1000UL);
+            if (velocity > bound) {
+                velocity = bound;
+            } else if (velocity < -bound) {
+                velocity = -bound;
+            }
+        }
+    }
+
+    g_sample.counts = counts;
+    g_sample.edges = edges;
+    g_sample.last_edge = last_edge;
+    g_sample.sample_us = now_us;
+    g_sample.velocity = velocity;
+    return velocity;
+}
+
+/*
+ * Pin change on PD0-PD7.  A transition on A counts up when A now differs
+ * from the old B; a transition on B counts down when B now differs from
+ * the old A (if both changed at once a transition was missed, and the
+ * two cancel out).  Every event_edges transitions, the edge event task
+ * is posted.
+ */
+ISR(PCINT3_vect)
+{
+    uint8_t pins = PIND;
+    uint8_t a = (pins >> ENCODER_PIN_A) & 1;
+    uint8_t b = (pins >> ENCODER_PIN_B) & 1;
+
+    if (a == g_encoder.last_a && b == g_encoder.last_b) {
+        return;
+    }
+    if (a ^ g_encoder.last_b) {
+        g_encoder.counts++;
+    }
+    if (b ^ g_encoder.last_a) {
+        g_encoder.counts--;
+    }
+    g_encoder.last_a = a;
+    g_encoder.last_b = b;
+    g_encoder.edges++;
+    g_encoder.last_edge.ms = timers_get_uptime_ms();
+    g_encoder.last_edge.ticks = timers_get_profile_ticks();
+
+    if (g_encoder.event_edges != 0 && ++g_encoder.event_count >= g_encoder.event_edges) {
+        g_encoder.event_count = 0;
+        scheduler_post(g_encoder.event_task);
+    }
+}
@@ -0,0 +1,35 @@
+/*
+ * encoder.h
+ */
+
+#ifndef ENCODER_H_
+#define ENCODER_H_
+
+#include <stdint.h>
+#include "timers.h"
+
+/* Transitions (on A and B) per revolution of the output shaft */
+#define ENCODER_TRANSITIONS_PER_REV (64)
+
+/* Velocities are in counts/s, in fixed point with this many fraction bits */
+#define ENCODER_VELOCITY_SHIFT (8)
+
+/*
+ * Velocity estimation
+ *
+ * With ENCODER_COUNTING_MIN_EDGES or more transitions since the last
+ * sample, the counts are divided by the time between samples.  With
+ * fewer, they are divided by the time between the last transitions of
+ * the two samples (1/T), which is timed to the 3.2us profile clock.
+ * With none, the estimate decays as 1/(time since the last transition),
+ * and is 0 once that is ENCODER_STOPPED_MS or more (under 0.5 RPM).
+ */
+#define ENCODER_COUNTING_MIN_EDGES (8)
+#define ENCODER_STOPPED_MS         (2000)
+
+void encoder_init(void);
+void encoder_set_edge_event(void (*run_task)(void), uint16_t edges);
+int32_t encoder_get_counts(void);
+int32_t encoder_sample_velocity(void);
+
+#endif /* ENCODER_H_ */
@@ -1,19 +1,43 @@
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
 #include <pololu/orangutan.h>
+#include <util/atomic.h>
 #include "interpolator.h"
 #include "timers.h"
+#include "encoder.h"
 #include "deque.h"
 #include "macros.h"
 #include "log.h"
+#include "cli.h"
 
-#define NUMBER_DARK_REGIONS          (32)
-#define NUMBER_TRANSTIONS_REVOLUTION (NUMBER_DARK_REGIONS * 2)
+#define NUMBER_TRANSTIONS_REVOLUTION (ENCODER_TRANSITIONS_PER_REV)
 #define ENDZONE_MS                   (500)
 #define MAX_DELTA                    (90)
 //#define MAX_DELTA                    (720)
 #define CLOSE_ENOUGH_DEGREES         (5)
 
+/*
+ * The estimator measures time in profile clock ticks (3.2us), which
+ * keeps its divides in 32 bits.  The profile clock wraps every
+ * ~209ms, so longer gaps are taken from the ms uptime, and anything over
+ * a second is treated as a second.
+ */
+#define TICKS_WRAP_SAFE_MS   (150)
+#define MAX_SAMPLE_MS        (1000)
+#define FILTER_SHIFT         (12)
+/* alpha-beta velocity, in counts/tick (Q24) */
+#define TRACKER_SHIFT        (24)
+/* alpha-beta position error, in counts (Q16) */
+#define TRACKER_ERROR_SHIFT  (16)
+/* largest alpha-beta error corrected, in counts */
+#define TRACKER_MAX_ERROR    (32)
+/* trajectory positions and velocities are degrees (/s) in Q8 */
+#define REFERENCE_SHIFT      (8)
+/* seconds (Q20) per profile clock tick, in Q16 */
+#define TICK_S_Q36           ((1ULL << 36) / PROFILE_TICKS_PER_S)
+
 typedef enum {
     STATE_IN_ENDZONE,
     STATE_OUT_OF_ENDZONE
@@ -26,19 +50,45 @@ typedef struct _interpolator_target_node_t {
 } interpolator_target_node_t;
 
 /* queue */
-static interpolator_target_node_t q_nodes[10];
+static interpolator_target_node_t q_nodes[INTERPOLATOR_MAX_TARGETS];
 static interpolator_target_node_t * q_head = NULL;
 
-/* The current position in degrees (based on encoder) */
-int32_t current_position;
-/* The current estimate velocity in degrees/second */
-int32_t current_velocity;
-/* for tracking velocity */
-int32_t last_position;
+typedef struct {
+    velocity_filter_e filter;
+    /* time constant, in ms and in profile ticks */
+    uint16_t tau_ms;
+    uint32_t tau_ticks;
+    /* profile clock at the last sample */
+    uint16_t last_ticks;
+    /* IIR: the filtered encoder estimate, counts/s (Q8) */
+    int32_t velocity;
+    /* alpha-beta: the count at the last sample, how far the tracked
+     * position was from it, counts (Q16), and velocity, counts/tick (Q24) */
+    int32_t tracker_counts;
+    int32_t tracker_error;
+    int32_t tracker_velocity;
+} velocity_estimator_t;
+
+/* trapezoidal trajectory (see interpolator_set_trajectory()) */
+typedef struct {
+    /* limits, 0 is off */
+    uint16_t max_velocity;
+    uint32_t max_acceleration;
+    /* where the reference is, degrees (Q8) plus the 20 bits below that,
+     * and how it is moving */
+    int32_t position;
+    uint32_t position_fraction;
+    int32_t velocity;
+    int32_t acceleration;
+} trajectory_t;
+
+/* The last sample (see interpolator_sample()) */
+static interpolator_snapshot_t g_snapshot;
+static velocity_estimator_t g_estimator;
+static trajectory_t g_trajectory;
 /* The time (ms) at which we entered an "endzone" */
-static uint16_t time_entered_end_zone = 0;
+static uint32_t time_entered_end_zone = 0;
 static interpolator_state_t state = STATE_OUT_OF_ENDZONE;
-static timers_state_t * g_timers_state;
 
 static interpolator_target_node_t *
 q_alloc_node(void)
@@ -83,28 +133,45 @@ q_get_tail(void)
 //    }
 //}
 
-static void
+/*
+ * The queue is read by the PD controller, which can preempt any of the
+ * cooperative tasks, so it is only modified with interrupts off.
+ *
+ * Returns -1 if the queue is full.
+ */
+static int
 q_append(int32_t position)
 {
-    interpolator_target_node_t * tail = q_get_tail();
-    interpolator_target_node_t * node = q_alloc_node();
-    node->next = NULL;
-    node->position = position;
-    if (tail == NULL) {
-        q_head = node;
-    } else {
-        tail->next = node;
+    int result = 0;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        interpolator_target_node_t * tail = q_get_tail();
+        interpolator_target_node_t * node = q_alloc_node();
+        if (node == NULL) {
+            result = -1;
+        } else {
+            node->next = NULL;
+            node->position = position;
+            if (tail == NULL) {
+                q_head = node;
+            } else {
+                tail->next = node;
+            }
+        }
     }
+    return result;
 }
 
 static interpolator_target_node_t *
 q_dequeue(void)
 {
-    interpolator_target_node_t * orig_head = q_head;
-    if (orig_head != NULL) {
-        q_head = orig_head->next;
-        orig_head->in_use = false;
-        orig_head->next = NULL;
+    interpolator_target_node_t * orig_head;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        orig_head = q_head;
+        if (orig_head != NULL) {
+            q_head = orig_head->next;
+            orig_head->in_use = false;
+            orig_head->next = NULL;
+        }
     }
 
     return orig_head;
@@ -119,31 +186,341 @@ interpolator_get_current_target(void)
     return q_head;
 }
 
+/*
+ * First order low pass on the encoder's estimate, with
+ * alpha = dt / (tau + dt)
+ */
+static int32_t
+velocity_filter_iir(velocity_estimator_t * estimator, uint32_t dt)
+{
+    int32_t raw = encoder_sample_velocity();
+    int32_t alpha = (int32_t)((dt << FILTER_SHIFT) / (estimator->tau_ticks + dt));
+    estimator->velocity += (int32_t)(((int64_t)(raw - estimator->velocity) * alpha) >> FILTER_SHIFT);
+    return estimator->velocity;
+}
+
+/*
+ * The alpha-beta velocity in counts/s (Q8)
+ */
+static int32_t
+tracker_velocity(velocity_estimator_t const * estimator)
+{
+    return (int32_t)(((int64_t)estimator->tracker_velocity * PROFILE_TICKS_PER_S) >>
+            (TRACKER_SHIFT - ENCODER_VELOCITY_SHIFT));
+}
+
+/*
+ * Critically damped alpha-beta tracker on the count, with
+ * k = dt / (tau + dt), alpha = 1 - (1 - k)^2 and beta = k^2.  beta is
+ * kept in Q24, as it is tiny at the fast PD rates.
+ */
+static int32_t
+velocity_filter_alpha_beta(velocity_estimator_t * estimator, int32_t counts, uint32_t dt)
+{
+    int32_t k = (int32_t)((dt << FILTER_SHIFT) / (estimator->tau_ticks + dt));
+    int32_t alpha = 2 * k - ((k * k) >> FILTER_SHIFT);
+    int32_t beta = k * k;
+    int32_t error;
+
+    /* predict, relative to the new count */
+    error = estimator->tracker_error +
+            (int32_t)(((int64_t)estimator->tracker_velocity * (int32_t)dt) >> (TRACKER_SHIFT - TRACKER_ERROR_SHIFT)) -
+            ((counts - estimator->tracker_counts) << TRACKER_ERROR_SHIFT);
+    estimator->tracker_counts = counts;
+    /* a big jump (or a long gap) pulls the position over, not the velocity */
+    if (error > (TRACKER_MAX_ERROR << TRACKER_ERROR_SHIFT) ||
+            error < -(TRACKER_MAX_ERROR << TRACKER_ERROR_SHIFT)) {
+        estimator->tracker_error = 0;
+        return tracker_velocity(estimator);
+    }
+    estimator->tracker_error = error - (int32_t)(((int64_t)alpha * error) >> FILTER_SHIFT);
+    /* Q24 * Q16 counts to Q24 counts, per tick */
+    estimator->tracker_velocity -= (int32_t)(((int64_t)beta * error) >> TRACKER_ERROR_SHIFT) /
+            (int32_t)dt;
+    return tracker_velocity(estimator);
+}
+
+/*
+ * Profile clock ticks since the last sample, given the ms since then
+ */
+static uint32_t
+interpolator_elapsed_ticks(uint32_t elapsed_ms)
+{
+    uint16_t ticks = timers_get_profile_ticks();
+    uint32_t dt;
+
+    if (elapsed_ms < TICKS_WRAP_SAFE_MS) {
+        dt = (uint16_t)(ticks - g_estimator.last_ticks);
+    } else if (elapsed_ms < MAX_SAMPLE_MS) {
+        dt = PROFILE_MS_TO_TICKS(elapsed_ms);
+    } else {
+        dt = PROFILE_MS_TO_TICKS(MAX_SAMPLE_MS);
+    }
+    g_estimator.last_ticks = ticks;
+    return dt;
+}
+
+/*
+ * Update the velocity estimate over dt profile ticks, in counts/s (Q8)
+ */
+static int32_t
+interpolator_estimate_velocity(uint32_t dt, int32_t counts)
+{
+    if (dt == 0) {
+        return g_estimator.filter == VELOCITY_FILTER_IIR ? g_estimator.velocity :
+                tracker_velocity(&g_estimator);
+    }
+
+    switch (g_estimator.filter) {
+    case VELOCITY_FILTER_ALPHA_BETA:
+        return velocity_filter_alpha_beta(&g_estimator, counts, dt);
+    case VELOCITY_FILTER_IIR:
+    default:
+        return velocity_filter_iir(&g_estimator, dt);
+    }
+}
+
+/*
+ * Select the velocity estimator, and its time constant in ms (1 to
+ * VELOCITY_FILTER_MAX_TAU_MS).  Both restart from the current sample.
+ */
+int
+interpolator_set_velocity_filter(velocity_filter_e filter, uint16_t tau_ms)
+{
+    if (tau_ms == 0 || tau_ms > VELOCITY_FILTER_MAX_TAU_MS ||
+            (filter != VELOCITY_FILTER_IIR && filter != VELOCITY_FILTER_ALPHA_BETA)) {
+        return -1;
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        int32_t velocity = g_snapshot.velocity;
+        g_estimator.filter = filter;
+        g_estimator.tau_ms = tau_ms;
+        g_estimator.tau_ticks = PROFILE_MS_TO_TICKS(tau_ms);
+        /* degrees/s back to counts/s (Q8) and counts/tick (Q24) */
+        g_estimator.velocity = (velocity << ENCODER_VELOCITY_SHIFT) * NUMBER_TRANSTIONS_REVOLUTION / 360;
+        g_estimator.tracker_counts = g_snapshot.counts;
+        g_estimator.tracker_error = 0;
+        g_estimator.tracker_velocity = (int32_t)(((int64_t)g_estimator.velocity <<
+                (TRACKER_SHIFT - ENCODER_VELOCITY_SHIFT)) / PROFILE_TICKS_PER_S);
+    }
+    return 0;
+}
+
+/*
+ * Move the reference dt profile ticks along a trapezoidal velocity
+ * profile toward the current target: accelerate at the limit up to the
+ * velocity limit, and brake at the limit once the stopping distance
+ * (v^2 / 2a) reaches the target.  With no target it holds where it is.
+ * Run from interpolator_sample() only.
+ */
+static void
+interpolator_advance_trajectory(uint32_t dt)
+{
+    trajectory_t * t = &g_trajectory;
+    int32_t goal = (q_head != NULL) ? q_head->position << REFERENCE_SHIFT : t->position;
+    int32_t remaining = goal - t->position;
+    int32_t direction = (remaining < 0) ? -1 : 1;
+    int32_t max_velocity = (int32_t)t->max_velocity << REFERENCE_SHIFT;
+    int32_t dt_s = (int32_t)(((uint64_t)dt * TICK_S_Q36) >> 16);
+    int64_t step;
+    bool braking = false;
+
+    if (remaining == 0 && t->velocity == 0) {
+        t->acceleration = 0;
+        return;
+    }
+    if (t->velocity != 0 && (t->velocity < 0) == (direction < 0) &&
+            (int64_t)t->velocity * t->velocity >=
+            ((int64_t)t->max_acceleration * labs(remaining) << (REFERENCE_SHIFT + 1))) {
+        t->acceleration = -direction * (int32_t)t->max_acceleration;
+        braking = true;
+    } else if (t->velocity * direction < max_velocity) {
+        t->acceleration = direction * (int32_t)t->max_acceleration;
+    } else {
+        t->acceleration = 0;
+    }
+
+    /* Q20 seconds: deg/s^2 to deg/s (Q8, rounded), and deg/s (Q8) to
+     * deg (Q8), keeping the fraction, as a step is tiny at the fast PD
+     * rates */
+    t->velocity += (int32_t)(((int64_t)t->acceleration * dt_s + (1L << (19 - REFERENCE_SHIFT))) >>
+            (20 - REFERENCE_SHIFT));
+    if (t->velocity > max_velocity) {
+        t->velocity = max_velocity;
+    } else if (t->velocity < -max_velocity) {
+        t->velocity = -max_velocity;
+    }
+    step = (int64_t)t->velocity * dt_s + t->position_fraction;
+    t->position += (int32_t)(step >> 20);
+    t->position_fraction = (uint32_t)step & ((1UL << 20) - 1);
+
+    /* stop on the target, rather than hunt around it */
+    if ((goal - t->position) * direction <= 0 || (braking && t->velocity * direction <= 0)) {
+        t->position = goal;
+        t->position_fraction = 0;
+        t->velocity = 0;
+    }
+}
+
+/*
+ * Set the trajectory limits: velocity in degrees/s (up to
+ * TRAJECTORY_MAX_VELOCITY) and acceleration in degrees/s^2 (up to
+ * TRAJECTORY_MAX_ACCELERATION).  0 for either turns the trajectory off,
+ * going back to the MAX_DELTA lead.  A new trajectory starts at rest
+ * where the motor is.
+ */
+int
+interpolator_set_trajectory(uint16_t max_velocity, uint32_t max_acceleration)
+{
+    if (max_velocity > TRAJECTORY_MAX_VELOCITY || max_acceleration > TRAJECTORY_MAX_ACCELERATION) {
+        return -1;
+    }
+    if (max_velocity == 0 || max_acceleration == 0) {
+        max_velocity = 0;
+        max_acceleration = 0;
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (g_trajectory.max_velocity == 0 || max_velocity == 0) {
+            g_trajectory.position = g_snapshot.position << REFERENCE_SHIFT;
+            g_trajectory.position_fraction = 0;
+            g_trajectory.velocity = 0;
+        }
+        g_trajectory.max_velocity = max_velocity;
+        g_trajectory.max_acceleration = max_acceleration;
+        g_trajectory.acceleration = 0;
+    }
+    return 0;
+}
+
+/*
+ * Usage: traj [max deg/s] [max deg/s^2]
+ */
+static int clicmd_trajectory(char const * const args)
+{
+    unsigned int max_velocity;
+    uint32_t max_acceleration = 0;
+    int n = (args == NULL) ? 0 : sscanf(args, "%u %lu", &max_velocity, &max_acceleration);
+    if (n == 1 && max_velocity != 0) {
+        LOG("Usage: traj <deg/s> <deg/s^2>, or traj 0\r\n");
+        return 0;
+    }
+    if (n >= 1) {
+        if (interpolator_set_trajectory(max_velocity, max_acceleration) != 0) {
+            LOG("Limits are %u deg/s and %lu deg/s^2\r\n",
+                TRAJECTORY_MAX_VELOCITY, TRAJECTORY_MAX_ACCELERATION);
+            return 0;
+        }
+    }
+    if (g_trajectory.max_velocity == 0) {
+        LOG("Trajectory off (reference leads by up to %d deg)\r\n", MAX_DELTA);
+    } else {
+        LOG("Trajectory %u deg/s, %lu deg/s^2\r\n",
+            g_trajectory.max_velocity, g_trajectory.max_acceleration);
+    }
+    return 0;
+}
+
+/*
+ * Usage: vfilter [iir|ab] [tau ms]
+ */
+static int clicmd_velocity_filter(char const * const args)
+{
+    char name[4];
+    unsigned int tau_ms = VELOCITY_FILTER_DEFAULT_TAU_MS;
+    int n = (args == NULL) ? 0 : sscanf(args, "%3s %u", name, &tau_ms);
+    velocity_filter_e filter;
+
+    if (n >= 1) {
+        if (strcmp(name, "iir") == 0) {
+            filter = VELOCITY_FILTER_IIR;
+        } else if (strcmp(name, "ab") == 0) {
+            filter = VELOCITY_FILTER_ALPHA_BETA;
+        } else {
+            LOG("Filter must be iir or ab\r\n");
+            return 0;
+        }
+        if (interpolator_set_velocity_filter(filter, tau_ms) != 0) {
+            LOG("tau must be 1-%u ms\r\n", VELOCITY_FILTER_MAX_TAU_MS);
+            return 0;
+        }
+    }
+    LOG("Velocity filter %s, tau %u ms\r\n",
+        g_estimator.filter == VELOCITY_FILTER_IIR ? "iir" : "ab",
+        g_estimator.tau_ms);
+    return 0;
+}
+
 /*
  * Initialize the linear interpolator
  */
 void
-interpolator_init(timers_state_t * timers_state)
+interpolator_init(void)
 {
-    /* warm up the velocity calculation service */
     int i;
-    g_timers_state = timers_state;
-    last_position = interpolator_get_current_position();
-    current_velocity = 0;
     for (i = 0; i < COUNT_OF(q_nodes); i++) {
         q_nodes[i].in_use = false;
     }
+    g_snapshot.time_ms = timers_get_uptime_ms();
+    g_snapshot.counts = encoder_get_counts();
+    g_snapshot.velocity = 0;
+    g_snapshot.dt_ticks = 0;
+    g_snapshot.reference_velocity = 0;
+    g_snapshot.reference_acceleration = 0;
+    g_trajectory.max_velocity = 0;
+    g_estimator.last_ticks = timers_get_profile_ticks();
+    interpolator_set_velocity_filter(VELOCITY_FILTER_IIR, VELOCITY_FILTER_DEFAULT_TAU_MS);
+    interpolator_sample();
+
+    CLI_REGISTER(
+        {"vfilter", "vfilter [iir|ab] [tau ms]: Select the velocity estimator, or show it",
+         clicmd_velocity_filter},
+        {"traj", "traj [deg/s deg/s^2]: Move on a trapezoidal trajectory with these limits (0: off), or show them",
+         clicmd_trajectory}
+    );
 }
 
 /*
- * Update the velocity calculation
+ * Sample the encoder and update the velocity estimate for this control
+ * cycle.  Called by the PD controller at the start of each run, from a
+ * task or from the PD ISR, so the estimate is at the PD rate and is
+ * scaled by the time that actually went by since the last run.
  */
-void interpolator_service_calc_velocity(void)
+void
+interpolator_sample(void)
 {
-    /* TODO: normalize with respect to VELOCITY_POLL_MS */
-    int32_t new_position = interpolator_get_current_position();
-    current_velocity = new_position - last_position;
-    last_position = new_position;
+    interpolator_snapshot_t snapshot;
+    int32_t velocity;
+    snapshot.time_ms = timers_get_uptime_ms();
+    snapshot.counts = encoder_get_counts();
+    /* truncates toward 0, as the conversion from double used to */
+    snapshot.position = snapshot.counts * 360 / NUMBER_TRANSTIONS_REVOLUTION;
+    /* only the PD (this) and interpolator_set_velocity_filter(), with
+     * interrupts off, touch the estimator */
+    snapshot.dt_ticks = interpolator_elapsed_ticks(snapshot.time_ms - g_snapshot.time_ms);
+    velocity = interpolator_estimate_velocity(snapshot.dt_ticks, snapshot.counts);
+    /* counts/s (Q8) to degrees/s */
+    snapshot.velocity = velocity * 360 /
+            ((int32_t)NUMBER_TRANSTIONS_REVOLUTION << ENCODER_VELOCITY_SHIFT);
+    /* likewise the trajectory, with interpolator_set_trajectory() */
+    if (g_trajectory.max_velocity != 0) {
+        interpolator_advance_trajectory(snapshot.dt_ticks);
+    }
+    snapshot.reference_velocity = g_trajectory.velocity / (1 << REFERENCE_SHIFT);
+    snapshot.reference_acceleration = g_trajectory.acceleration;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        g_snapshot = snapshot;
+    }
+}
+
+/*
+ * Get a copy of the last sample
+ */
+void
+interpolator_get_snapshot(interpolator_snapshot_t * snapshot)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        *snapshot = g_snapshot;
+    }
 }
 
 /*
@@ -157,15 +534,17 @@ interpolator_service(void)
 	    uint16_t delta;
 	    switch (state) {
 	    case STATE_OUT_OF_ENDZONE:
-	        delta = abs(interpolator_get_absolute_target_position() - interpolator_get_current_position());
+	        /* from the encoder, not the last sample: this also runs on
+	         * encoder edge events (see encoder_set_edge_event()) */
+	        delta = abs(q_head->position -
+	                encoder_get_counts() * 360 / NUMBER_TRANSTIONS_REVOLUTION);
 	        if (delta < CLOSE_ENOUGH_DEGREES) {
-	            time_entered_end_zone = g_timers_state->ms_ticks;
+	            time_entered_end_zone = timers_get_uptime_ms();
 	            state = STATE_IN_ENDZONE;
 	        }
 	        break;
 	    case STATE_IN_ENDZONE:
-	        timedelta = g_timers_state->ms_ticks - time_entered_end_zone;
-//            LOG("%u, %u, %u\r\n", g_timers_state->ms_ticks, time_entered_end_zone, timedelta);
+	        timedelta = timers_get_uptime_ms() - time_entered_end_zone;
 	        if (timedelta > ENDZONE_MS) {
                 state = STATE_OUT_OF_ENDZONE;
                 q_dequeue();
@@ -176,14 +555,16 @@ interpolator_service(void)
 }
 
 /*
- * Get the current position in degrees (from encoders)
+ * Get the current position in degrees (from the last sample)
  */
 int32_t
 interpolator_get_current_position(void)
 {
-	int encoder_count = encoders_get_counts_m2();
-	int32_t current_position = (int32_t)(360 * ((double)encoder_count / NUMBER_TRANSTIONS_REVOLUTION));
-	return current_position;
+	int32_t position;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+	    position = g_snapshot.position;
+	}
+	return position;
 }
 
 /*
@@ -192,41 +573,61 @@ interpolator_get_current_position(void)
  * The interpolator will target this immediately if it is not already
  * targetting a position.  The interpolator will target the next position
  * if it has been within 15 degrees of its target for 1s.
+ *
+ * Returns -1 (and adds nothing) if INTERPOLATOR_MAX_TARGETS are already
+ * waiting.
  */
-void
+int
 interpolator_add_target_position(int32_t target_position)
 {
-    q_append(target_position);
+    return q_append(target_position);
 }
 
 /*
- * Get the current interpolator adjusted target position (absolute)
+ * Get the current interpolator adjusted target position (absolute): the
+ * trajectory's reference, or the next target but no more than MAX_DELTA
+ * from the motor
  */
 int32_t
 interpolator_get_target_position(void)
 {
     interpolator_target_node_t * t = interpolator_get_current_target();
+    int32_t current_position = interpolator_get_current_position();
+    int32_t reference;
+    bool trajectory;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        trajectory = (g_trajectory.max_velocity != 0);
+        reference = g_trajectory.position;
+    }
+    if (trajectory) {
+        /* rounded to the nearest degree */
+        return (reference + (1L << (REFERENCE_SHIFT - 1))) >> REFERENCE_SHIFT;
+    }
     if (t != NULL) {
-        int32_t delta = t->position - interpolator_get_current_position();
+        int32_t delta = t->position - current_position;
         if (delta > MAX_DELTA) {
-            return interpolator_get_current_position() + MAX_DELTA;
+            return current_position + MAX_DELTA;
         } else if (delta < -MAX_DELTA) {
-            return interpolator_get_current_position() - MAX_DELTA;
+            return current_position - MAX_DELTA;
         } else {
             return t->position;
         }
     } else {
-        return interpolator_get_current_position();
+        return current_position;
     }
 }
 
 /*
- * Get the current velocity of the motor
+ * Get the current velocity of the motor (from the last sample)
  */
 int32_t
 interpolator_get_current_velocity(void)
 {
-    return current_velocity;
+    int32_t velocity;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        velocity = g_snapshot.velocity;
+    }
+    return velocity;
 }
 
 /*
@@ -248,8 +649,10 @@ interpolator_get_absolute_target_position(void)
  *
  * That is, if I have 3 target destinations in the pipeline [0, 1080, 900]
  * and I add a relative target of -360, a fourth target of 720 will be added.
+ *
+ * Returns -1 if the plan is full, as interpolator_add_target_position().
  */
-void
+int
 interpolator_add_relative_target(int32_t degrees_delta)
 {
     /* get the last target if any, default to current position */
@@ -8,16 +8,72 @@
 #include <stdint.h>
 #include "timers.h"
 
-#define VELOCITY_POLL_MS (50)
+/*
+ * Velocity estimation, run at the PD rate from interpolator_sample()
+ *
+ *  - VELOCITY_FILTER_IIR: a first order low pass on the encoder's own
+ *    estimate (counts over the interval, or 1/T at low speed; see
+ *    encoder.h)
+ *  - VELOCITY_FILTER_ALPHA_BETA: a critically damped alpha-beta tracker
+ *    on the encoder count
+ *
+ * Both work on the time that actually went by since the last sample,
+ * with a time constant in ms, so they (and Kd) behave the same at any
+ * PD rate.
+ */
+typedef enum {
+    VELOCITY_FILTER_IIR,
+    VELOCITY_FILTER_ALPHA_BETA
+} velocity_filter_e;
+
+#define VELOCITY_FILTER_DEFAULT_TAU_MS (20)
+#define VELOCITY_FILTER_MAX_TAU_MS     (1000)
+
+/* targets that can wait in the plan (see interpolator_add_target_position()) */
+#define INTERPOLATOR_MAX_TARGETS (10)
+
+/*
+ * Trajectory limits (see interpolator_set_trajectory()).  With them set
+ * the reference moves to each target on a trapezoidal velocity profile,
+ * rather than leading the motor by up to MAX_DELTA degrees, and the
+ * controller gets its velocity and acceleration for feedforward.
+ */
+#define TRAJECTORY_MAX_VELOCITY     (20000)
+#define TRAJECTORY_MAX_ACCELERATION (200000L)
+
+/*
+ * The motor state as sampled at the start of a control cycle (see
+ * interpolator_sample()).  Everything that reports or acts on the
+ * position in that cycle works from the same sample.
+ */
+typedef struct {
+    /* uptime at the sample */
+    uint32_t time_ms;
+    /* encoder transitions */
+    int32_t counts;
+    /* degrees */
+    int32_t position;
+    /* degrees/second */
+    int32_t velocity;
+    /* profile clock ticks since the previous sample (at most a second) */
+    uint32_t dt_ticks;
+    /* the reference's velocity (degrees/s) and acceleration
+     * (degrees/s^2) for this cycle; 0 without a trajectory */
+    int32_t reference_velocity;
+    int32_t reference_acceleration;
+} interpolator_snapshot_t;
 
 int32_t interpolator_get_current_position(void);
 int32_t interpolator_get_target_position(void);
 int32_t interpolator_get_current_velocity(void);
 int32_t interpolator_get_absolute_target_position(void);
-void interpolator_add_target_position(int32_t target_position);
-void interpolator_init(timers_state_t * timers_state);
+int interpolator_add_target_position(int32_t target_position);
+void interpolator_init(void);
+void interpolator_sample(void);
+void interpolator_get_snapshot(interpolator_snapshot_t * snapshot);
+int interpolator_set_velocity_filter(velocity_filter_e filter, uint16_t tau_ms);
+int interpolator_set_trajectory(uint16_t max_velocity, uint32_t max_acceleration);
 void interpolator_service(void);
-void interpolator_add_relative_target(int32_t degrees_delta);
-void interpolator_service_calc_velocity(void);
+int interpolator_add_relative_target(int32_t degrees_delta);
 
 #endif /* INTERPOLATOR_H_ */
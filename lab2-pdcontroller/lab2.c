@@ -11,15 +11,24 @@
 #include "scheduler.h"
 #include "cli.h"
 #include "interpolator.h"
+#include "encoder.h"
+#include "bench.h"
+#include "cyclic.h"
 
 #define COUNT_OF(x)   ((sizeof(x)/sizeof(0[x])) / ((size_t)(!(sizeof(x) % sizeof(0[x])))))
+//#define DO_SCHEDULER_BENCHMARK
+//#define DO_PREEMPTION_BENCHMARK
+//#define DO_PD_BENCHMARK
+//#define CYCLIC_EXECUTIVE  /* or: make CYCLIC_EXECUTIVE=1 */
 
-// 1Khz
-//#define PD_SERVICE_MS (1)
-// 50Hz
-#define PD_SERVICE_MS (20)
-// 5hz
-//#define PD_SERVICE_MS (200)
+/* initial PD rate (matches motor_state_t.poll_rate); change it live
+ * with the "rate" command */
+#define PD_SERVICE_MS PD_PERIOD_50HZ_MS
+
+/* the interpolator is also posted every this many encoder transitions,
+ * so it sees the motor reach a target without waiting for its period;
+ * change it live with the "edges" command */
+#define INTERPOLATOR_EVENT_EDGES (4)
 
 #define CUSTOM_SYMBOL_DEGREE (3)
 static const char degree_symbol[] PROGMEM = {
@@ -48,18 +57,20 @@ update_lcd(void)
 {
     char buf[128];
     char tmp[8];
+    interpolator_snapshot_t snapshot;
+    interpolator_get_snapshot(&snapshot);
     clear();
     lcd_goto_xy(0, 0);
 
     /* Print target/actual degrees */
     sprintf(buf, "(%-5ld , %-5ld )",
             interpolator_get_absolute_target_position(),
-            interpolator_get_current_position());
+            snapshot.position);
     print(buf);
     sprintf(tmp, "%ld", interpolator_get_target_position());
     lcd_goto_xy(1 + strlen(tmp), 0);
     print_character(CUSTOM_SYMBOL_DEGREE);
-    sprintf(tmp, "%ld", interpolator_get_current_position());
+    sprintf(tmp, "%ld", snapshot.position);
     lcd_goto_xy(9 + strlen(tmp), 0);
     print_character(CUSTOM_SYMBOL_DEGREE);
 
@@ -72,7 +83,8 @@ update_lcd(void)
 /*
  * Task: Service CLI
  *
- * Check for new bytes and process them
+ * Process new bytes.  This is an event task, posted from the main loop
+ * as soon as serial_check() has brought in new input.
  */
 static void
 service_cli(void)
@@ -80,23 +92,58 @@ service_cli(void)
     cli_service();
 }
 
+#ifndef CYCLIC_EXECUTIVE
+/*
+ * Priorities: the PD controller is at SCHEDULER_PREEMPT_PRIORITY so it
+ * runs from the tick ISR and is never held up by the LCD or CLI.  The
+ * rest run cooperatively from the main loop.  The interpolator, also
+ * posted by the encoder ISR, goes ahead of everything else there.  The
+ * LCD and motor state logging are the first to go when the system is
+ * overloaded.
+ */
 static task_t g_tasks[] = {
-    {"Update LCD", 100 /* ms */, update_lcd},
-    {"Service CLI", 50 /* ms */, service_cli},
-    {"Service Logs", 50 /* ms */, log_service},
-    {"Log Motor State", 50 /* ms */, motor_log_state},
-    {"Service PD (1KHz)", PD_SERVICE_MS /* ms */, motor_service_pd_controller},
-    {"Service Interpolator", PD_SERVICE_MS /* ms */, interpolator_service},
-    {"Calculate Velocity", VELOCITY_POLL_MS /* ms */, interpolator_service_calc_velocity}
+    {"Update LCD", 100 /* ms */, update_lcd, 0, 0, true},
+    {"Service CLI", TASK_PERIOD_EVENT, service_cli, 0},
+    {"Service Logs", 50 /* ms */, log_service, 0},
+    {"Log Motor State", 50 /* ms */, motor_log_state, 0, 0, true},
+    {"Service PD", PD_SERVICE_MS /* ms */, motor_service_pd_controller, 2},
+    {"Service Interpolator", PD_SERVICE_MS /* ms */, interpolator_service, 1},
+#ifdef DO_PREEMPTION_BENCHMARK
+    {"Busy Load", 50 /* ms */, bench_load_task, 0},
+#endif
 };
+#else
+/*
+ * The same tasks as a time-triggered frame table, built at compile time
+ * (see cyclic.h).  The periods have to be harmonic, so the PD loop runs
+ * at 10ms here, and the 50/100ms tasks are offset into separate frames.
+ * WCETs are upper bounds taken from the "stats" command.
+ *
+ *   name, run_task, period (ms), offset (ms), wcet (us)
+ */
+#define LAB2_CE_TASKS(X, a) \
+    X(a, pd, motor_service_pd_controller, 10, 0, 600) \
+    X(a, interpolator, interpolator_service, 10, 0, 400) \
+    X(a, cli, service_cli, 50, 10, 3000) \
+    X(a, logs, log_service, 50, 20, 500) \
+    X(a, log_motor, motor_log_state, 50, 30, 6000) \
+    X(a, lcd, update_lcd, 100, 40, 6000)
+
+CYCLIC_EXECUTIVE_TABLE(LAB2_CE_TASKS);
+#endif
 
 /*
  * 1ms ISR for TC0 (Red Led & Scheduler)
  */
 ISR(TIMER0_COMPA_vect)
 {
-    g_timers_state.ms_ticks++;
+    timers_tick(&g_timers_state);
+#ifdef CYCLIC_EXECUTIVE
+    cyclic_tick();
+#else
     scheduler_do_schedule();
+    scheduler_preempt();
+#endif
 }
 
 /*
@@ -107,26 +154,62 @@ int main()
     LOG("--------------------------------\r\n");
 
     /* Unmask interrupt for output compare match A on TC0 */
-    timers_setup_timer(TIMER_COUNTER0, TIMER_MODE_CTC, 1000UL);
+    TIMERS_SETUP_CTC_TC0(TIMERS_TICK_US);
     TIMSK0 |= (1 << OCIE0A);
+    timers_init_uptime(&g_timers_state);
+    timers_init_profile_clock();
 
     lcd_load_custom_character(degree_symbol, CUSTOM_SYMBOL_DEGREE);
 
     cli_init();
-    motor_init(&g_timers_state);
+    motor_init();
     log_init();
-	scheduler_init(&g_timers_state, g_tasks, COUNT_OF(g_tasks));
-	interpolator_init(&g_timers_state);
+#ifdef DO_SCHEDULER_BENCHMARK
+    bench_scheduler_isr();
+#endif
+#ifdef CYCLIC_EXECUTIVE
+    cyclic_init(ce_tasks, ce_frames, CE_NUM_FRAMES, CE_FRAME_MS, CE_HYPERPERIOD_MS);
+#else
+	scheduler_init(&g_timers_state, g_tasks, COUNT_OF(g_tasks),
+	        SCHEDULER_PHASE_AUTO);
+#endif
+	interpolator_init();
+#ifndef CYCLIC_EXECUTIVE
+	encoder_set_edge_event(interpolator_service, INTERPOLATOR_EVENT_EDGES);
+#endif
+#ifdef DO_PD_BENCHMARK
+    bench_pd_controller();
+#endif
     sei();
 
     log_start();
-
-	/* Main Loop: Run Tasks scheduled by scheduler */
+#ifdef DO_SCHEDULER_BENCHMARK
+    bench_report();
+#endif
+#ifdef DO_PD_BENCHMARK
+    bench_pd_report();
+#endif
+
+	/* Main Loop: Run Tasks scheduled by scheduler, then sleep until the
+	 * next interrupt.  The 1ms tick wakes us at least once a tick, which
+	 * is often enough for serial_check() to keep up with input at 9600
+	 * baud.  serial_check() sends at most one byte per call though, so
+	 * the send buffer is drained before sleeping; otherwise what
+	 * log_service() hands to serial_send() would go out a byte per wake.
+	 * (LOG after log_start() already waits in serial_send_blocking().) */
 	while (1) {
-	    int i;
-	    for (i = 0; i < 50; i++) {
-	        serial_check(); /* needs to be called frequently */
+	    serial_check(); /* needs to be called frequently */
+#ifdef CYCLIC_EXECUTIVE
+	    cyclic_service();
+	    continue;
+#endif
+	    if (cli_input_pending()) {
+	        scheduler_post(service_cli);
 	    }
 	    scheduler_service();
+	    while (!serial_send_buffer_empty(USB_COMM)) {
+	        serial_check();
+	    }
+	    scheduler_idle();
 	}
 }
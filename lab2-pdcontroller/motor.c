@@ -1,4 +1,6 @@
 #include <pololu/orangutan.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -8,12 +10,43 @@
 #include "cli.h"
 #include "interpolator.h"
 #include "motor.h"
+#include "encoder.h"
+#include "scheduler.h"
+#include "autotune.h"
 
 /*
  * CONSTANTS
  */
 #define MAX_TORQUE         (255)
 #define COEFFICIENT_SCALAR (100)
+/*
+ * The controller works on the gains in Q12 (see motor_set_gains()), so
+ * the P, D and feedforward terms are multiplies and a shift, with no
+ * divides.  Q12 holds the default Kd of 0.03 to within 0.1%, and leaves
+ * room for terms of up to 2^16 torque units before the input limits
+ * come in
+ */
+#define GAIN_SHIFT         (12)
+/* largest gain (COEFFICIENT_SCALAR units) accepted */
+#define MAX_GAIN           (1000000L)
+/* each of the P, D, Kv and Ka terms is kept within this */
+#define MAX_TERM           (1L << 28)
+/*
+ * The I term integrates Ki * error over the profile clock ticks since
+ * the last sample, with Ki in Q32 per tick (0.3% or better from a Ki of
+ * 0.01 up).  It is never more than MAX_TORQUE, and the error going in is
+ * limited so the product stays in 64 bits.
+ */
+#define INTEGRAL_GAIN_SHIFT (32)
+#define MAX_INTEGRAL       ((int32_t)MAX_TORQUE << GAIN_SHIFT)
+#define MAX_INTEGRAL_ERROR (1L << 15)
+/* the filtered velocity, degrees/s in Q8 */
+#define VELOCITY_SHIFT     (8)
+/* motor PWM frequency: clk/64 with an 8-bit TOP at 20MHz */
+#define MOTOR_PWM_HZ       (1220)
+/* with the PD in the TC3 ISR: clk/8, so every update reaches the motor
+ * within one PWM period even at PD_ISR_MAX_HZ */
+#define MOTOR_PWM_ISR_HZ   (9766)
 
 /* MACROS */
 #define MIN(a, b)     (a < b ? a : b)
@@ -24,16 +57,47 @@ void motor_service_pd_controller(void);
 
 
 /* Globals */
-static timers_state_t * g_timers_state;
 static motor_state_t g_motor_state = {
     .current_torque = 0,
     .proportional_gain = 324,
-    .derivative_gain = 50,
+    .derivative_gain = 3,
+    .integral_gain = 0,
+    .velocity_feedforward = 0,
+    .acceleration_feedforward = 0,
+    .derivative_tau_ms = 0,
     .last_torque = 0,
     .logging_enabled = false,
     .poll_rate = SERVICE_RATE_50HZ
 };
 static bool paused = false;
+/* an autotune result is waiting to be reported (see motor_log_state()) */
+static volatile bool g_autotune_report = false;
+
+/*
+ * PD ISR mode (see motor_set_isr_rate()).  Offsets are TC3 counts from
+ * the compare match to just after OCR2B was written; TC3 runs at clk/1
+ * at every rate from PD_ISR_MIN_HZ up.
+ */
+typedef struct {
+    uint16_t hz;
+    uint32_t runs;
+    uint16_t offset_min;
+    uint16_t offset_max;
+    uint32_t offset_total;
+    /* the ISR ran past its next compare match */
+    uint16_t overruns;
+} pd_isr_state_t;
+static pd_isr_state_t g_pd_isr = { .hz = 0 };
+
+static void motor_set_gains(int32_t kp, int32_t kd, int32_t ki);
+static void motor_set_feedforward(int32_t kv, int32_t ka);
+
+/* PD (and interpolator) task period for each poll rate */
+static const uint16_t g_poll_rate_ms[] = {
+    [SERVICE_RATE_5HZ] = PD_PERIOD_5HZ_MS,
+    [SERVICE_RATE_50HZ] = PD_PERIOD_50HZ_MS,
+    [SERVICE_RATE_1000HZ] = PD_PERIOD_1000HZ_MS
+};
 
 /*
  * Usage: r <degrees:int>
@@ -41,8 +105,10 @@ static bool paused = false;
 static int clicmd_set_reference(char const * const args)
 {
     int32_t target_degrees;
-    if (1 == sscanf(args, "%ld", &target_degrees)) {
-        interpolator_add_target_position(target_degrees);
+    if (args != NULL && 1 == sscanf(args, "%ld", &target_degrees) &&
+            interpolator_add_target_position(target_degrees) != 0) {
+        LOG("Target queue full (%d targets), %ld not added\r\n",
+                INTERPOLATOR_MAX_TARGETS, target_degrees);
     }
     return 0;
 }
@@ -53,8 +119,10 @@ static int clicmd_set_reference(char const * const args)
 static int clicmd_increase_reference(char const * const args)
 {
     int32_t degrees_delta;
-    if (1 == sscanf(args, "%ld", &degrees_delta)) {
-        interpolator_add_relative_target(degrees_delta);
+    if (args != NULL && 1 == sscanf(args, "%ld", &degrees_delta) &&
+            interpolator_add_relative_target(degrees_delta) != 0) {
+        LOG("Target queue full (%d targets), r+ %ld not added\r\n",
+                INTERPOLATOR_MAX_TARGETS, degrees_delta);
     }
     return 0;
 }
@@ -65,8 +133,10 @@ static int clicmd_increase_reference(char const * const args)
 static int clicmd_decrease_reference(char const * const args)
 {
     int32_t degrees_delta;
-    if (1 == sscanf(args, "%ld", &degrees_delta)) {
-        interpolator_add_relative_target(-degrees_delta);
+    if (args != NULL && 1 == sscanf(args, "%ld", &degrees_delta) &&
+            interpolator_add_relative_target(-degrees_delta) != 0) {
+        LOG("Target queue full (%d targets), r- %ld not added\r\n",
+                INTERPOLATOR_MAX_TARGETS, degrees_delta);
     }
     return 0;
 }
@@ -87,14 +157,19 @@ static int clicmd_toggle_logging(char const * const args)
 static int clicmd_view_parameters(char const * const args)
 {
     (void)(args);
-    LOG("Kd=%ld, Kp=%ld, ",
+    interpolator_snapshot_t snapshot;
+    interpolator_get_snapshot(&snapshot);
+    LOG("Kd=%ld, Kp=%ld, Ki=%ld, Kv=%ld, Ka=%ld, ",
             g_motor_state.derivative_gain,
-            g_motor_state.proportional_gain);
+            g_motor_state.proportional_gain,
+            g_motor_state.integral_gain,
+            g_motor_state.velocity_feedforward,
+            g_motor_state.acceleration_feedforward);
     LOG("Vm=%ld, Pr=%ld, Pm=%ld, T=%d\r\n",
-            interpolator_get_current_velocity(),
+            snapshot.velocity,
             interpolator_get_target_position(),
-            interpolator_get_current_position(),
-            g_motor_state.last_torque);
+            snapshot.position,
+            motor_get_last_torque());
     return 0;
 }
 
@@ -104,8 +179,12 @@ static int clicmd_view_parameters(char const * const args)
 static int clicmd_set_kp(char const * const args)
 {
     int32_t kp;
-    if (1 == sscanf(args, "%ld", &kp)) {
-        g_motor_state.proportional_gain = kp;
+    if (args != NULL && 1 == sscanf(args, "%ld", &kp)) {
+        if (labs(kp) > MAX_GAIN) {
+            LOG("Kp must be within +/-%ld\r\n", MAX_GAIN);
+            return 0;
+        }
+        motor_set_gains(kp, g_motor_state.derivative_gain, g_motor_state.integral_gain);
         LOG("Kp is now: %ld\r\n", kp);
     }
     return 0;
@@ -117,17 +196,240 @@ static int clicmd_set_kp(char const * const args)
 static int clicmd_set_kd(char const * const args)
 {
     int32_t kd;
-    if (1 == sscanf(args, "%ld", &kd)) {
-        g_motor_state.derivative_gain = kd;
+    if (args != NULL && 1 == sscanf(args, "%ld", &kd)) {
+        if (labs(kd) > MAX_GAIN) {
+            LOG("Kd must be within +/-%ld\r\n", MAX_GAIN);
+            return 0;
+        }
+        motor_set_gains(g_motor_state.proportional_gain, kd, g_motor_state.integral_gain);
         LOG("Kd is now: %ld\r\n", kd);
     }
     return 0;
 }
 
+/*
+ * Usage: i <int:Ki value>
+ */
+static int clicmd_set_ki(char const * const args)
+{
+    int32_t ki;
+    if (args != NULL && 1 == sscanf(args, "%ld", &ki)) {
+        if (labs(ki) > MAX_GAIN) {
+            LOG("Ki must be within +/-%ld\r\n", MAX_GAIN);
+            return 0;
+        }
+        motor_set_gains(g_motor_state.proportional_gain, g_motor_state.derivative_gain, ki);
+        LOG("Ki is now: %ld\r\n", ki);
+    }
+    return 0;
+}
+
+/*
+ * Usage: kv <int:Kv value>
+ */
+static int clicmd_set_kv(char const * const args)
+{
+    int32_t kv;
+    if (args != NULL && 1 == sscanf(args, "%ld", &kv)) {
+        if (labs(kv) > MAX_GAIN) {
+            LOG("Kv must be within +/-%ld\r\n", MAX_GAIN);
+            return 0;
+        }
+        motor_set_feedforward(kv, g_motor_state.acceleration_feedforward);
+        LOG("Kv is now: %ld\r\n", kv);
+    }
+    return 0;
+}
+
+/*
+ * Usage: ka <int:Ka value>
+ */
+static int clicmd_set_ka(char const * const args)
+{
+    int32_t ka;
+    if (args != NULL && 1 == sscanf(args, "%ld", &ka)) {
+        if (labs(ka) > MAX_GAIN) {
+            LOG("Ka must be within +/-%ld\r\n", MAX_GAIN);
+            return 0;
+        }
+        motor_set_feedforward(g_motor_state.velocity_feedforward, ka);
+        LOG("Ka is now: %ld\r\n", ka);
+    }
+    return 0;
+}
+
+/*
+ * Usage: dfilter [tau ms:0-1000]
+ */
+static int clicmd_set_derivative_filter(char const * const args)
+{
+    unsigned int tau_ms;
+    if (args != NULL && 1 == sscanf(args, "%u", &tau_ms)) {
+        if (motor_set_derivative_filter(tau_ms) != 0) {
+            LOG("tau must be 0 (off) to %u ms\r\n", DERIVATIVE_FILTER_MAX_TAU_MS);
+            return 0;
+        }
+    }
+    LOG("Derivative filter tau %u ms\r\n", g_motor_state.derivative_tau_ms);
+    return 0;
+}
+
+/*
+ * Usage: rate <hz:5|50|1000>
+ */
+static int clicmd_set_rate(char const * const args)
+{
+    int hz;
+    pd_controller_poll_state_e rate;
+    if (args == NULL || 1 != sscanf(args, "%d", &hz)) {
+        LOG("PD rate is %u ms\r\n", g_poll_rate_ms[g_motor_state.poll_rate]);
+        return 0;
+    }
+    switch (hz) {
+    case 5:
+        rate = SERVICE_RATE_5HZ;
+        break;
+    case 50:
+        rate = SERVICE_RATE_50HZ;
+        break;
+    case 1000:
+        rate = SERVICE_RATE_1000HZ;
+        break;
+    default:
+        LOG("Rate must be 5, 50 or 1000\r\n");
+        return 0;
+    }
+    if (motor_set_poll_rate(rate) == 0) {
+        LOG("PD rate is now %d Hz\r\n", hz);
+    } else {
+        LOG("PD rate cannot be changed in this build\r\n");
+    }
+    return 0;
+}
+
+/*
+ * Usage: pdisr [hz:0|500-5000]
+ */
+static int clicmd_pd_isr(char const * const args)
+{
+    unsigned int hz;
+    pd_isr_state_t stats;
+    if (args != NULL && 1 == sscanf(args, "%u", &hz)) {
+        if (motor_set_isr_rate(hz) != 0) {
+            LOG("Rate must be 0 (off) or %u-%u Hz, with the scheduler\r\n",
+                PD_ISR_MIN_HZ, PD_ISR_MAX_HZ);
+        }
+        return 0;
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        stats = g_pd_isr;
+    }
+    if (stats.hz == 0) {
+        LOG("PD ISR off (PD runs as a task)\r\n");
+    } else if (stats.runs == 0) {
+        LOG("PD ISR at %u Hz, no runs yet\r\n", stats.hz);
+    } else {
+        LOG("PD ISR at %u Hz, %lu runs, %u overruns\r\n",
+            stats.hz, stats.runs, stats.overruns);
+        LOG("output at %lu/%lu/%lu us (min/avg/max), jitter %lu us\r\n",
+            stats.offset_min / TIMERS_CYCLES_PER_US,
+            stats.offset_total / stats.runs / TIMERS_CYCLES_PER_US,
+            stats.offset_max / TIMERS_CYCLES_PER_US,
+            (stats.offset_max - stats.offset_min) / TIMERS_CYCLES_PER_US);
+    }
+    return 0;
+}
+
+/*
+ * Report how the last autotune went
+ */
+static void motor_report_autotune(void)
+{
+    autotune_result_t result;
+    switch (autotune_get_status()) {
+    case AUTOTUNE_IDLE:
+        LOG("No autotune run yet\r\n");
+        break;
+    case AUTOTUNE_RUNNING:
+        LOG("Autotune running\r\n");
+        break;
+    case AUTOTUNE_FAILED:
+        LOG("Autotune failed (no steady oscillation within %u ms, or stopped)\r\n",
+            AUTOTUNE_TIMEOUT_MS);
+        break;
+    case AUTOTUNE_DONE:
+        autotune_get_result(&result);
+        LOG("Autotune (%s): Ku=%ld (0.01/deg), Tu=%ld ms, a=%ld deg\r\n",
+            autotune_rule_name(result.rule),
+            (int32_t)(result.ultimate_gain * COEFFICIENT_SCALAR + 0.5f),
+            (int32_t)(result.ultimate_period * 1000.0f + 0.5f),
+            (int32_t)(result.amplitude + 0.5f));
+        LOG("Kp=%ld, Kd=%ld applied, ",
+            g_motor_state.proportional_gain, g_motor_state.derivative_gain);
+        if (result.overshoot_percent < 0.0f) {
+            LOG("overshoot unknown\r\n");
+        } else {
+            LOG("expected overshoot %d%%\r\n", (int)(result.overshoot_percent + 0.5f));
+        }
+        break;
+    }
+}
+
+/*
+ * Usage: autotune [zn|tl|stop] [relay torque]
+ */
+static int clicmd_autotune(char const * const args)
+{
+    char name[5];
+    unsigned int torque = AUTOTUNE_DEFAULT_TORQUE;
+    autotune_rule_e rule;
+    int n = (args == NULL) ? 0 : sscanf(args, "%4s %u", name, &torque);
+    interpolator_snapshot_t snapshot;
+
+    if (n < 1) {
+        motor_report_autotune();
+        return 0;
+    }
+    if (strcmp(name, "stop") == 0) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            autotune_stop();
+        }
+        return 0;
+    } else if (strcmp(name, "zn") == 0) {
+        rule = AUTOTUNE_RULE_ZIEGLER_NICHOLS;
+    } else if (strcmp(name, "tl") == 0) {
+        rule = AUTOTUNE_RULE_TYREUS_LUYBEN;
+    } else {
+        LOG("Rule must be zn or tl\r\n");
+        return 0;
+    }
+    if (torque == 0 || torque > MAX_TORQUE) {
+        LOG("Relay torque must be 1-%d\r\n", MAX_TORQUE);
+        return 0;
+    }
+    if (paused) {
+        LOG("Unpause first\r\n");
+        return 0;
+    }
+    interpolator_get_snapshot(&snapshot);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        autotune_start(rule, torque, snapshot.position);
+        g_autotune_report = false;
+    }
+    LOG("Autotune (%s) about %ld deg with +/-%u torque\r\n",
+        autotune_rule_name(rule), snapshot.position, torque);
+    return 0;
+}
+
 static int clicmd_pause(char const * const args)
 {
     (void)(args);
-    paused = paused ? false : true;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        autotune_stop();
+        paused = paused ? false : true;
+        /* start over, rather than push with whatever built up before */
+        g_motor_state.integral = 0;
+    }
     return 0;
 }
 
@@ -141,9 +443,9 @@ static int clicmd_pause(char const * const args)
  *  - OC2B: PWM Signal
  *  - PC6:  Direction
  *
- * We will use fast PWM mode (bit easier to work with).  To
- * change our duty cycle, we change the top value for the
- * output compare match.
+ * We will use fast PWM mode (bit easier to work with, set up
+ * in motor_init()).  To change our duty cycle, we change the
+ * value for the output compare match.
  */
 static void motor_set_output(int16_t torque)
 {
@@ -157,12 +459,229 @@ static void motor_set_output(int16_t torque)
 	OCR2B = abs_torque;
 }
 
+/*
+ * Convert a gain in COEFFICIENT_SCALAR units to Q12 (rounded)
+ */
+static int32_t motor_gain_to_q(int32_t gain)
+{
+    int64_t scaled = (int64_t)gain << GAIN_SHIFT;
+    scaled += (gain < 0) ? -COEFFICIENT_SCALAR / 2 : COEFFICIENT_SCALAR / 2;
+    return (int32_t)(scaled / COEFFICIENT_SCALAR);
+}
+
+/*
+ * Largest input whose product with a Q12 gain is within MAX_TERM
+ */
+static int32_t motor_input_limit(int32_t gain_q)
+{
+    return (gain_q == 0) ? INT32_MAX : MAX_TERM / labs(gain_q);
+}
+
+/*
+ * Set Kp, Kd and Ki (in COEFFICIENT_SCALAR units, within +/-MAX_GAIN)
+ *
+ * This is where the divides happen, once per change rather than once
+ * per cycle.  The input limits keep each of the P and D products (and
+ * the feedforward ones, see motor_set_feedforward()) within MAX_TERM,
+ * so their sum with the I term cannot overflow; an input is
+ * only ever limited where its term alone is far beyond MAX_TORQUE.
+ * The I term holds torque rather than error, so a new Ki takes effect
+ * from here on without a jump in the output.
+ */
+static void motor_set_gains(int32_t kp, int32_t kd, int32_t ki)
+{
+    int32_t kp_q = motor_gain_to_q(kp);
+    int32_t kd_q = motor_gain_to_q(kd);
+    int32_t ki_q = (int32_t)(((int64_t)ki << INTEGRAL_GAIN_SHIFT) /
+            ((int64_t)COEFFICIENT_SCALAR * PROFILE_TICKS_PER_S));
+    int32_t error_limit = motor_input_limit(kp_q);
+    int32_t velocity_limit = motor_input_limit(kd_q);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        g_motor_state.proportional_gain = kp;
+        g_motor_state.derivative_gain = kd;
+        g_motor_state.integral_gain = ki;
+        g_motor_state.proportional_gain_q = kp_q;
+        g_motor_state.derivative_gain_q = kd_q;
+        g_motor_state.integral_gain_q = ki_q;
+        g_motor_state.error_limit = error_limit;
+        g_motor_state.velocity_limit = velocity_limit;
+        if (ki == 0) {
+            g_motor_state.integral = 0;
+        }
+    }
+}
+
+/*
+ * Set Kv and Ka (in COEFFICIENT_SCALAR units, within +/-MAX_GAIN), the
+ * feedforward of the trajectory's velocity and acceleration (see
+ * interpolator_set_trajectory()).  Kv covers the back EMF and viscous
+ * friction at speed, and Ka the inertia, so the motor keeps up with the
+ * reference instead of lagging it until the error is large enough.
+ */
+static void motor_set_feedforward(int32_t kv, int32_t ka)
+{
+    int32_t kv_q = motor_gain_to_q(kv);
+    int32_t ka_q = motor_gain_to_q(ka);
+    int32_t velocity_limit = motor_input_limit(kv_q);
+    int32_t acceleration_limit = motor_input_limit(ka_q);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        g_motor_state.velocity_feedforward = kv;
+        g_motor_state.acceleration_feedforward = ka;
+        g_motor_state.velocity_feedforward_q = kv_q;
+        g_motor_state.acceleration_feedforward_q = ka_q;
+        g_motor_state.reference_velocity_limit = velocity_limit;
+        g_motor_state.reference_acceleration_limit = acceleration_limit;
+    }
+}
+
+/*
+ * Take the gains from a finished autotune
+ */
+static void motor_apply_autotune(void)
+{
+    autotune_result_t result;
+    int32_t kp, kd;
+    if (autotune_get_result(&result)) {
+        kp = (int32_t)(result.kp * COEFFICIENT_SCALAR + 0.5f);
+        kd = (int32_t)(result.kd * COEFFICIENT_SCALAR + 0.5f);
+        motor_set_gains(MIN(kp, MAX_GAIN), MIN(kd, MAX_GAIN), g_motor_state.integral_gain);
+    }
+    g_autotune_report = true;
+}
+
+/*
+ * Low pass the velocity going into the D term, with a time constant of
+ * tau_ms (0 is off, up to DERIVATIVE_FILTER_MAX_TAU_MS).  This is on top
+ * of the velocity estimator's own filter (see vfilter), for when a
+ * large Kd makes the output noisy.
+ */
+int motor_set_derivative_filter(uint16_t tau_ms)
+{
+    interpolator_snapshot_t snapshot;
+    if (tau_ms > DERIVATIVE_FILTER_MAX_TAU_MS) {
+        return -1;
+    }
+    interpolator_get_snapshot(&snapshot);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        g_motor_state.derivative_tau_ms = tau_ms;
+        g_motor_state.derivative_tau_ticks = PROFILE_MS_TO_TICKS(tau_ms);
+        g_motor_state.filtered_velocity = snapshot.velocity << VELOCITY_SHIFT;
+    }
+    return 0;
+}
+
+/*
+ * The velocity for the D term, low passed over dt profile ticks (see
+ * motor_set_derivative_filter())
+ */
+static int32_t motor_filter_velocity(int32_t velocity, uint32_t dt)
+{
+    int32_t alpha;
+    if (g_motor_state.derivative_tau_ticks == 0) {
+        return velocity;
+    }
+    alpha = (int32_t)((dt << GAIN_SHIFT) / (g_motor_state.derivative_tau_ticks + dt));
+    g_motor_state.filtered_velocity += (int32_t)(((int64_t)(((int64_t)velocity << VELOCITY_SHIFT) -
+            g_motor_state.filtered_velocity) * alpha) >> GAIN_SHIFT);
+    return (g_motor_state.filtered_velocity + (1L << (VELOCITY_SHIFT - 1))) >> VELOCITY_SHIFT;
+}
+
+/*
+ * Limit a value to +/-limit
+ */
+static inline int32_t motor_saturate(int32_t value, int32_t limit)
+{
+    if (value > limit) {
+        return limit;
+    } else if (value < -limit) {
+        return -limit;
+    }
+    return value;
+}
+
 /*
  * Get the last motor torque that was used
  */
 int motor_get_last_torque(void)
 {
-    return g_motor_state.last_torque;
+    int torque;
+    /* written by the PD controller, which may preempt the caller */
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        torque = g_motor_state.last_torque;
+    }
+    return torque;
+}
+
+/*
+ * Change how often the PD controller (and the interpolator feeding it)
+ * runs.  Both tasks get the new period in the scheduler; returns -1 if
+ * they are not scheduler tasks (the cyclic executive build).
+ */
+int motor_set_poll_rate(pd_controller_poll_state_e rate)
+{
+    task_t * pd_task = scheduler_find_task(motor_service_pd_controller);
+    task_t * interpolator_task = scheduler_find_task(interpolator_service);
+    if (pd_task == NULL) {
+        return -1;
+    }
+    scheduler_set_period(pd_task, g_poll_rate_ms[rate]);
+    if (interpolator_task != NULL) {
+        scheduler_set_period(interpolator_task, g_poll_rate_ms[rate]);
+    }
+    g_motor_state.poll_rate = rate;
+    return 0;
+}
+
+/*
+ * Run the PD controller from the TC3 compare match ISR at hz (between
+ * PD_ISR_MIN_HZ and PD_ISR_MAX_HZ), or with 0 go back to running it as
+ * a scheduler task.
+ *
+ * In the ISR the encoder sample, the control law and the OCR2B write
+ * happen at a fixed point in every period, whatever task is running;
+ * the only jitter is the ISR's entry latency (the tick ISR keeps
+ * interrupts off while it releases tasks).  The PD task is suspended
+ * meanwhile, and the other tasks (the interpolator included) carry on
+ * as before.  The motor PWM goes up to MOTOR_PWM_ISR_HZ.  Returns -1
+ * if the rate is out of range, or the PD is not a scheduler task (the
+ * cyclic executive build).
+ */
+int motor_set_isr_rate(uint16_t hz)
+{
+    task_t * pd_task = scheduler_find_task(motor_service_pd_controller);
+    if (pd_task == NULL || (hz != 0 && (hz < PD_ISR_MIN_HZ || hz > PD_ISR_MAX_HZ))) {
+        return -1;
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        TIMSK3 &= ~(1 << OCIE3A);
+    }
+    if (hz == 0) {
+        if (g_pd_isr.hz != 0) {
+            timers_setup_pwm(TIMER_COUNTER2, TIMER_MODE_FAST_PWM, TIMER_TOP_8_BIT, MOTOR_PWM_HZ);
+            scheduler_resume_task(pd_task);
+        }
+        g_pd_isr.hz = 0;
+        return 0;
+    }
+
+    scheduler_suspend_task(pd_task);
+    if (g_pd_isr.hz == 0) {
+        timers_setup_pwm(TIMER_COUNTER2, TIMER_MODE_FAST_PWM, TIMER_TOP_8_BIT, MOTOR_PWM_ISR_HZ);
+    }
+    timers_setup_timer(TIMER_COUNTER3, TIMER_MODE_CTC, (1000000UL + hz / 2) / hz);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        g_pd_isr.hz = hz;
+        g_pd_isr.runs = 0;
+        g_pd_isr.offset_min = UINT16_MAX;
+        g_pd_isr.offset_max = 0;
+        g_pd_isr.offset_total = 0;
+        g_pd_isr.overruns = 0;
+        TCNT3 = 0;
+        TIFR3 = (1 << OCF3A);
+        TIMSK3 |= (1 << OCIE3A);
+    }
+    return 0;
 }
 
 /*
@@ -170,52 +689,45 @@ int motor_get_last_torque(void)
  */
 void motor_log_state(void)
 {
+    if (g_autotune_report) {
+        g_autotune_report = false;
+        motor_report_autotune();
+    }
     if (!paused && g_motor_state.logging_enabled) {
+        interpolator_snapshot_t snapshot;
+        interpolator_get_snapshot(&snapshot);
         LOG("%lu,%ld,%ld,%d\r\n",
-            g_timers_state->ms_ticks,
-            interpolator_get_current_position(),
+            snapshot.time_ms,
+            snapshot.position,
             interpolator_get_absolute_target_position(),
-            g_motor_state.last_torque);
+            motor_get_last_torque());
     }
 }
 
 /*
  * MOTOR FUNCTIONS
  */
-void motor_init(timers_state_t * timers_state)
+void motor_init(void)
 {
-    g_timers_state = timers_state;
-
-    /* setup encoder (only 1 motor - motor 2) */
-    encoders_init(IO_D3, IO_D2, IO_D1, IO_D0);
+    /* setup encoder (only 1 motor - motor 2); counts start at 0 */
+    encoder_init();
 
-    /* reset counters */
-    encoders_get_counts_and_reset_m2();
+    motor_set_gains(g_motor_state.proportional_gain, g_motor_state.derivative_gain,
+            g_motor_state.integral_gain);
+    motor_set_feedforward(g_motor_state.velocity_feedforward,
+            g_motor_state.acceleration_feedforward);
+    motor_set_derivative_filter(g_motor_state.derivative_tau_ms);
 
     /* Setup PC6 (direction) and PD6 (PWM) as outputs */
     DDRC |= (1 << PC6);
     DDRD |= (1 << PD6);
 
-    /* We are using Fast PWM for the mode and we want to be able
-     * put a PWM signal on OC2B at some frequency */
-
-    /* COM2A1 = 0, COM2A0 = 0; OC2A disconnected (PB3) */
-    TCCR2A &= ~(1 << COM2A1 | 1 << COM2A0);
-
-    /* Clear OC2B on Compare Match, set OC2B at BOTTOM, (non-inverting mode). */
-    TCCR2A |=  (1 << COM2B1);
-    TCCR2A &= ~(1 << COM2B0);
-
-    /* Waveform Generation Mode: Fast PWM
-     *
-     * TOP = 0xFF, Update of OCRx at BOTTOM, TOV Flag Set on MAX
-     */
-    TCCR2A |=  (1 << WGM21 | 1 << WGM20);
-    TCCR2B &= ~(1 << WGM22);
-
-    /* Clock Select: prescaler of 64 */
-    TCCR2B &= ~(1 << CS21 | 1 << CS20);
-    TCCR2B |=  (1 << CS22);
+    /* Fast PWM with a TOP of 0xFF, so a torque of up to MAX_TORQUE goes
+     * straight into OCR2B.  OC2B is cleared on compare match and set at
+     * BOTTOM (non-inverting); OC2A (PB3) is not used. */
+    timers_setup_pwm(TIMER_COUNTER2, TIMER_MODE_FAST_PWM, TIMER_TOP_8_BIT, MOTOR_PWM_HZ);
+    timers_set_output(TIMER_COUNTER2, TIMER_CHANNEL_A, TIMER_OUTPUT_DISCONNECTED);
+    timers_set_output(TIMER_COUNTER2, TIMER_CHANNEL_B, TIMER_OUTPUT_NON_INVERTING);
 
     /* Start out by not driving the motor */
     OCR2B = 0;
@@ -236,8 +748,22 @@ void motor_init(timers_state_t * timers_state)
          clicmd_set_kp},
         {"d", "d <degrees>: Set Kd to the specified value",
          clicmd_set_kd},
+        {"i", "i <value>: Set Ki to the specified value (0: PD only)",
+         clicmd_set_ki},
+        {"kv", "kv <value>: Set the trajectory velocity feedforward Kv (see traj)",
+         clicmd_set_kv},
+        {"ka", "ka <value>: Set the trajectory acceleration feedforward Ka (see traj)",
+         clicmd_set_ka},
+        {"autotune", "autotune [zn|tl|stop] [torque]: Tune Kp and Kd by relay feedback, or show the last result",
+         clicmd_autotune},
+        {"dfilter", "dfilter [0-1000]: Low pass the D term velocity, time constant in ms (0: off)",
+         clicmd_set_derivative_filter},
         {"pause", "pause/unpause",
-         clicmd_pause}
+         clicmd_pause},
+        {"rate", "rate <5|50|1000>: Set the PD controller rate in Hz",
+         clicmd_set_rate},
+        {"pdisr", "pdisr [0|500-5000]: Run the PD from a timer ISR at a rate in Hz (0: off), or show its jitter",
+         clicmd_pd_isr}
     );
 }
 
@@ -250,12 +776,13 @@ void motor_init(timers_state_t * timers_state)
  *
  *     T = Kp(Pr - Pm) - Kd*Vm
  *
- * where
+ * (plus the optional Ki * integral(Pr - Pm) dt, and Kv * Vr + Ka * Ar
+ * feedforward, see below) where
  *
  *     T = Output motor signal (torque)
  *     Pr = Desired motor position
  *     Pm = Current motor position
- *     Vm = Current motor velocity (computed based on finite differences)
+ *     Vm = Current motor velocity (filtered, see interpolator_sample())
  *     Kp = Proportional gain
  *     Kd = Derivative gain
  *
@@ -288,19 +815,100 @@ void motor_init(timers_state_t * timers_state)
  * position. In other words, even if the motor is where it should be, do
  * not stop sending commands to the motor, instead send it 0 (or whatever
  * torque value your controller produces).
+ *
+ * With Ki set, the I term takes out the steady state error that
+ * friction or a load leaves.  It is integrated over the time that went
+ * by since the last cycle, so Ki means the same at any PD rate, and has
+ * conditional integration for anti-windup: while the output is
+ * saturated, error that would push it further into saturation is not
+ * integrated, and the term itself is held within MAX_TORQUE.
+ *
+ * With a trajectory (see interpolator_set_trajectory()), Vr and Ar are
+ * its velocity and acceleration this cycle, and Kv and Ka feed them
+ * forward, so the torque a move needs does not have to come from error.
+ *
+ * While an autotune runs, it drives the motor instead (see autotune.h),
+ * and its gains are applied here when it is done.
  */
 void motor_service_pd_controller(void)
 {
-    if (!paused) {
+    interpolator_snapshot_t snapshot;
+    /* the one encoder sample for this cycle, which everything else reads */
+    interpolator_sample();
+    if (!paused && autotune_get_status() == AUTOTUNE_RUNNING) {
+        interpolator_get_snapshot(&snapshot);
+        g_motor_state.integral = 0;
+        g_motor_state.last_torque = autotune_step(snapshot.position, snapshot.dt_ticks);
+        motor_set_output(g_motor_state.last_torque);
+        if (autotune_get_status() != AUTOTUNE_RUNNING) {
+            motor_apply_autotune();
+        }
+    } else if (!paused) {
         int32_t torque;
+        int32_t unsaturated;
         int32_t target_position = interpolator_get_target_position();
-        int32_t current_position = interpolator_get_current_position();
-        int current_velocity = interpolator_get_current_velocity();
+        int32_t position_error;
+        int32_t error;
+        int32_t current_velocity;
+        int64_t integral;
+        interpolator_get_snapshot(&snapshot);
+        position_error = target_position - snapshot.position;
+        error = motor_saturate(position_error, g_motor_state.error_limit);
+        current_velocity = motor_filter_velocity(snapshot.velocity, snapshot.dt_ticks);
+        current_velocity = motor_saturate(current_velocity, g_motor_state.velocity_limit);
+        /* Q12, each product within MAX_TERM */
         torque =
-            (g_motor_state.proportional_gain * (target_position - current_position) / COEFFICIENT_SCALAR) -
-            (g_motor_state.derivative_gain * current_velocity / COEFFICIENT_SCALAR);
+            g_motor_state.proportional_gain_q * error -
+            g_motor_state.derivative_gain_q * current_velocity +
+            g_motor_state.velocity_feedforward_q *
+                motor_saturate(snapshot.reference_velocity, g_motor_state.reference_velocity_limit) +
+            g_motor_state.acceleration_feedforward_q *
+                motor_saturate(snapshot.reference_acceleration, g_motor_state.reference_acceleration_limit) +
+            g_motor_state.integral;
+        /* back to whole torque units, rounded (>> is arithmetic in gcc) */
+        unsaturated = (torque + (1L << (GAIN_SHIFT - 1))) >> GAIN_SHIFT;
+        torque = motor_saturate(unsaturated, MAX_TORQUE);
+        if (g_motor_state.integral_gain_q != 0 &&
+                !(unsaturated != torque && (position_error < 0) == (unsaturated < 0))) {
+            error = motor_saturate(position_error, MAX_INTEGRAL_ERROR);
+            integral = g_motor_state.integral +
+                    (((int64_t)g_motor_state.integral_gain_q * error * (int32_t)snapshot.dt_ticks) >>
+                    (INTEGRAL_GAIN_SHIFT - GAIN_SHIFT));
+            /* limited before it is narrowed: a large Ki over a long dt
+             * can take the step alone past 32 bits */
+            if (integral > MAX_INTEGRAL) {
+                integral = MAX_INTEGRAL;
+            } else if (integral < -MAX_INTEGRAL) {
+                integral = -MAX_INTEGRAL;
+            }
+            g_motor_state.integral = (int32_t)integral;
+        }
         /* update the output value */
-        g_motor_state.last_torque = MAX(MIN(torque, MAX_TORQUE), -MAX_TORQUE);
+        g_motor_state.last_torque = torque;
         motor_set_output(g_motor_state.last_torque);
     }
 }
+
+/*
+ * PD ISR (see motor_set_isr_rate())
+ */
+ISR(TIMER3_COMPA_vect)
+{
+    uint16_t offset;
+
+    motor_service_pd_controller();
+    /* counts since the compare match, with OCR2B now written */
+    offset = TCNT3;
+
+    g_pd_isr.runs++;
+    g_pd_isr.offset_total += offset;
+    if (offset < g_pd_isr.offset_min) {
+        g_pd_isr.offset_min = offset;
+    }
+    if (offset > g_pd_isr.offset_max) {
+        g_pd_isr.offset_max = offset;
+    }
+    if (TIFR3 & (1 << OCF3A)) {
+        g_pd_isr.overruns++;
+    }
+}
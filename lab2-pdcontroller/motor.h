@@ -11,13 +11,50 @@ typedef enum {
     SERVICE_RATE_1000HZ
 } pd_controller_poll_state_e;
 
+/* PD task period at each pd_controller_poll_state_e */
+#define PD_PERIOD_5HZ_MS    (200)
+#define PD_PERIOD_50HZ_MS   (20)
+#define PD_PERIOD_1000HZ_MS (1)
+
+/* rates for running the PD from the TC3 ISR (see motor_set_isr_rate) */
+#define PD_ISR_MIN_HZ (500)
+#define PD_ISR_MAX_HZ (5000)
+
+/* longest derivative filter time constant (see motor_set_derivative_filter) */
+#define DERIVATIVE_FILTER_MAX_TAU_MS (1000)
+
 typedef struct {
     /* The last torque value used to drive the motor */
     uint8_t current_torque;
     /* Kp - The 'P' in PD (0.01/bit) */
     int32_t proportional_gain;
-    /* Kp - The 'P' in PD (0.01/bit) */
+    /* Kd - The 'D' in PD (0.01/bit, per degree/s) */
     int32_t derivative_gain;
+    /* Ki - The optional 'I' (0.01/bit, per degree*s); 0 is off */
+    int32_t integral_gain;
+    /* Kv and Ka - feedforward of the trajectory's velocity and
+     * acceleration (0.01/bit, per degree/s and per degree/s^2) */
+    int32_t velocity_feedforward;
+    int32_t acceleration_feedforward;
+    /* Kp, Kd, Kv and Ka in Q12, as used by the controller */
+    int32_t proportional_gain_q;
+    int32_t derivative_gain_q;
+    int32_t velocity_feedforward_q;
+    int32_t acceleration_feedforward_q;
+    /* Ki in Q32 per profile clock tick */
+    int32_t integral_gain_q;
+    /* inputs are limited to these, to keep the products in range */
+    int32_t error_limit;
+    int32_t velocity_limit;
+    int32_t reference_velocity_limit;
+    int32_t reference_acceleration_limit;
+    /* the integral term, torque in Q12 */
+    int32_t integral;
+    /* derivative low pass time constant (0 is off), in ms and ticks */
+    uint16_t derivative_tau_ms;
+    uint32_t derivative_tau_ticks;
+    /* the low passed velocity, degrees/s in Q8 */
+    int32_t filtered_velocity;
     /* last torque value */
     int last_torque;
     /* logging enabled/disabled */
@@ -26,12 +63,15 @@ typedef struct {
     pd_controller_poll_state_e poll_rate;
 } motor_state_t;
 
-void motor_init(timers_state_t * timers_state);
+void motor_init(void);
 void motor_service_pd_controller(void);
 void motor_drive(void);
 int32_t motor_get_target_pos(void);
 int32_t motor_get_current_pos(void);
 int motor_get_last_torque(void);
 void motor_log_state(void);
+int motor_set_poll_rate(pd_controller_poll_state_e rate);
+int motor_set_isr_rate(uint16_t hz);
+int motor_set_derivative_filter(uint16_t tau_ms);
 
 #endif /* MOTOR_H_ */
@@ -1,62 +1,1050 @@
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
 #include "scheduler.h"
+#include "cli.h"
+#include "log.h"
 
-static task_t * g_tasks = NULL;
+/* tasks in table order (initial table first, then any added later) */
+static task_t * g_tasks[SCHEDULER_MAX_TASKS];
 static uint8_t g_number_tasks = 0;
 static timers_state_t * g_timers_state;
+static bool g_cli_registered = false;
+/* priority of the task that is running (-1 when none is) */
+static volatile int8_t g_running_priority = -1;
+
+/* idle accounting: profile ticks spent asleep since the last reset */
+static volatile bool g_sleeping = false;
+static volatile uint16_t g_sleep_start_ticks;
+static volatile uint32_t g_idle_ticks = 0;
+static uint32_t g_idle_reset_ms = 0;
+static bool g_idle_used = false;
+
+/* overload shedding state */
+static volatile uint8_t g_shed_level = 0;
+static volatile uint16_t g_shed_events = 0;
+static volatile bool g_critical_late = false;
+static uint8_t g_window_ms = 0;
+static uint32_t g_window_idle_ticks = 0;
+
+/*
+ * Timing wheel of pending releases
+ *
+ * Each task lives in the slot matching the low bits of its next release
+ * tick.  On every tick only the tasks in the current slot are looked at,
+ * so the ISR does not have to walk (or divide against) the whole task
+ * table.  Tasks with a period longer than the wheel are simply passed
+ * over until the wheel comes around to their release tick.
+ */
+static task_t * g_wheel[SCHEDULER_WHEEL_SLOTS];
+
+/*
+ * Ready tasks
+ *
+ * One FIFO list per priority, and a bitmap of the priorities that have a
+ * ready task, so that neither a release nor the check for something to
+ * preempt with has to walk the task table.  A task is on its list exactly
+ * while it is TASK_STATE_READY.
+ */
+static task_t * g_ready_head[SCHEDULER_PRIORITY_LEVELS];
+static task_t * g_ready_tail[SCHEDULER_PRIORITY_LEVELS];
+static volatile uint8_t g_ready_map = 0;
+
+/*
+ * Add a task to the end of its ready list.  Call with interrupts
+ * disabled.
+ */
+static void
+scheduler_ready_push(task_t * task)
+{
+    uint8_t priority = task->priority;
+    task->ready_next = NULL;
+    if (g_ready_head[priority] == NULL) {
+        g_ready_head[priority] = task;
+    } else {
+        g_ready_tail[priority]->ready_next = task;
+    }
+    g_ready_tail[priority] = task;
+    g_ready_map |= (1 << priority);
+}
+
+/*
+ * Take a task off its ready list (if it is on it).  Call with interrupts
+ * disabled.
+ */
+static void
+scheduler_ready_remove(task_t * task)
+{
+    uint8_t priority = task->priority;
+    task_t * previous = NULL;
+    task_t * entry = g_ready_head[priority];
+    while (entry != NULL && entry != task) {
+        previous = entry;
+        entry = entry->ready_next;
+    }
+    if (entry == NULL) {
+        return;
+    }
+    if (previous == NULL) {
+        g_ready_head[priority] = task->ready_next;
+    } else {
+        previous->ready_next = task->ready_next;
+    }
+    if (g_ready_tail[priority] == task) {
+        g_ready_tail[priority] = previous;
+    }
+    if (g_ready_head[priority] == NULL) {
+        g_ready_map &= ~(1 << priority);
+    }
+    task->ready_next = NULL;
+}
+
+/*
+ * Add a task to the wheel slot for its next release
+ */
+static void
+scheduler_wheel_insert(task_t * task)
+{
+    task_t ** slot = &g_wheel[task->next_release_ms & SCHEDULER_WHEEL_MASK];
+    task->next = *slot;
+    *slot = task;
+}
+
+/*
+ * Take a task out of its wheel slot (if it is in one).  Call with
+ * interrupts disabled.
+ */
+static void
+scheduler_wheel_remove(task_t * task)
+{
+    task_t ** link = &g_wheel[task->next_release_ms & SCHEDULER_WHEEL_MASK];
+    while (*link != NULL) {
+        if (*link == task) {
+            *link = task->next;
+            task->next = NULL;
+            return;
+        }
+        link = &(*link)->next;
+    }
+}
+
+/*
+ * File a periodic task under its first release after now.  Tasks are
+ * released when (ms_ticks - phase_ms) is a multiple of the period; with
+ * no phase that is when the old `ms_ticks % period_ms` check would have
+ * fired.  Call with interrupts disabled.
+ */
+static void
+scheduler_wheel_schedule(task_t * task, uint32_t now)
+{
+    if (TASK_IS_EVENT(task) || task->state == TASK_STATE_SUSPENDED) {
+        return;
+    }
+    /* phase_ms < period_ms, so before the first period the phase itself
+     * is the first release */
+    if (now < task->phase_ms) {
+        task->next_release_ms = task->phase_ms;
+    } else {
+        task->next_release_ms = ((now - task->phase_ms) / task->period_ms + 1) *
+                task->period_ms + task->phase_ms;
+    }
+    scheduler_wheel_insert(task);
+}
+
+/*
+ * Fold one run of a task into its statistics
+ */
+static void
+scheduler_stats_update(task_stats_t * stats, uint16_t latency, uint16_t exec)
+{
+    if (stats->runs == 0 || exec < stats->exec_min) {
+        stats->exec_min = exec;
+    }
+    if (exec > stats->exec_max) {
+        stats->exec_max = exec;
+    }
+    if (stats->runs == 0 || latency < stats->latency_min) {
+        stats->latency_min = latency;
+    }
+    if (latency > stats->latency_max) {
+        stats->latency_max = latency;
+    }
+    stats->exec_total += exec;
+    stats->latency_total += latency;
+    stats->runs++;
+}
+
+/*
+ * Usage: stats [reset]
+ *
+ * Dump the per-task timing table (all times in us).  Jitter is the
+ * spread between the best and worst release latency.
+ */
+static int clicmd_stats(char const * const args)
+{
+    int i;
+    task_t * task;
+    task_stats_t stats;
+
+    if (args != NULL && strncmp(args, "reset", 5) == 0) {
+        scheduler_reset_stats();
+        LOG("Task stats reset\r\n");
+        return 0;
+    }
+
+    LOG("%-20s %6s %17s %17s %6s %4s %4s %4s\r\n", "task", "runs",
+        "exec min/avg/max", "lat min/avg/max", "jitter", "mrg", "ovr", "shed");
+    for (i = 0; i < g_number_tasks; i++) {
+        task = g_tasks[i];
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            stats = task->stats;
+        }
+        if (stats.runs == 0) {
+            LOG("%-20s %6lu\r\n", task->task_name, stats.runs);
+            continue;
+        }
+        LOG("%-20s %6lu %5lu/%5lu/%5lu %5lu/%5lu/%5lu %6lu %4u %4u %4u\r\n",
+            task->task_name, stats.runs,
+            PROFILE_TICKS_TO_US(stats.exec_min),
+            PROFILE_TICKS_TO_US(stats.exec_total / stats.runs),
+            PROFILE_TICKS_TO_US(stats.exec_max),
+            PROFILE_TICKS_TO_US(stats.latency_min),
+            PROFILE_TICKS_TO_US(stats.latency_total / stats.runs),
+            PROFILE_TICKS_TO_US(stats.latency_max),
+            PROFILE_TICKS_TO_US(stats.latency_max - stats.latency_min),
+            stats.merged_releases, stats.overruns, stats.shed_releases);
+    }
+    LOG("shed level: %u, overload events: %u\r\n", g_shed_level, g_shed_events);
+
+    {
+        uint32_t idle_ms, elapsed_ms;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            idle_ms = PROFILE_TICKS_TO_MS(g_idle_ticks);
+            elapsed_ms = g_timers_state->ms_ticks - g_idle_reset_ms;
+        }
+        if (elapsed_ms > 0) {
+            LOG("idle: %lu of %lu ms (%lu%%)\r\n",
+                idle_ms, elapsed_ms, idle_ms * 100 / elapsed_ms);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Clear the timing statistics for every task
+ */
+void
+scheduler_reset_stats(void)
+{
+    int i;
+    for (i = 0; i < g_number_tasks; i++) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            uint16_t release_ticks = g_tasks[i]->stats.release_ticks;
+            memset(&g_tasks[i]->stats, 0, sizeof(g_tasks[i]->stats));
+            g_tasks[i]->stats.release_ticks = release_ticks;
+        }
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        g_idle_ticks = 0;
+        g_idle_reset_ms = g_timers_state->ms_ticks;
+        g_window_idle_ticks = 0;
+        g_shed_events = 0;
+    }
+}
+
+static uint16_t
+scheduler_gcd(uint16_t a, uint16_t b)
+{
+    uint16_t t;
+    while (b != 0) {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/*
+ * Least common multiple of all task periods, capped at
+ * SCHEDULER_MAX_HYPERPERIOD_MS
+ */
+static uint32_t
+scheduler_hyperperiod(void)
+{
+    int i;
+    uint32_t hyperperiod = 1;
+    for (i = 0; i < g_number_tasks; i++) {
+        if (TASK_IS_EVENT(g_tasks[i])) {
+            continue;
+        }
+        hyperperiod = hyperperiod / scheduler_gcd(hyperperiod, g_tasks[i]->period_ms) *
+                g_tasks[i]->period_ms;
+        if (hyperperiod > SCHEDULER_MAX_HYPERPERIOD_MS) {
+            return SCHEDULER_MAX_HYPERPERIOD_MS;
+        }
+    }
+    return hyperperiod;
+}
+
+/*
+ * Two periodic tasks are ever released on the same tick exactly when
+ * their phases are congruent modulo the gcd of their periods.  Count how
+ * many of the placed tasks a given phase would collide with.
+ */
+static uint8_t
+scheduler_phase_collisions(task_t * task, uint16_t phase, bool * placed)
+{
+    int i;
+    uint16_t gcd;
+    uint8_t collisions = 0;
+    for (i = 0; i < g_number_tasks; i++) {
+        if (placed[i] && !TASK_IS_EVENT(g_tasks[i])) {
+            gcd = scheduler_gcd(task->period_ms, g_tasks[i]->period_ms);
+            if (phase % gcd == g_tasks[i]->phase_ms % gcd) {
+                collisions++;
+            }
+        }
+    }
+    return collisions;
+}
+
+/*
+ * Greedily pick a phase for each task without one.  Tasks are placed
+ * highest priority first (then shortest period first), each taking the
+ * earliest phase that collides with the fewest tasks already placed.
+ */
+static void
+scheduler_assign_phases(void)
+{
+    int i;
+    uint16_t phase, best_phase;
+    uint8_t collisions, best_collisions;
+    task_t * task;
+    bool placed[g_number_tasks];
+
+    /* event tasks have no phase, but are marked placed so they are
+     * skipped below; collisions only count periodic placed tasks */
+    for (i = 0; i < g_number_tasks; i++) {
+        placed[i] = (g_tasks[i]->phase_ms != 0) || TASK_IS_EVENT(g_tasks[i]);
+    }
+
+    for (;;) {
+        int next = -1;
+        for (i = 0; i < g_number_tasks; i++) {
+            if (placed[i]) {
+                continue;
+            }
+            if (next < 0 ||
+                    g_tasks[i]->priority > g_tasks[next]->priority ||
+                    (g_tasks[i]->priority == g_tasks[next]->priority &&
+                     g_tasks[i]->period_ms < g_tasks[next]->period_ms)) {
+                next = i;
+            }
+        }
+        if (next < 0) {
+            break;
+        }
+
+        task = g_tasks[next];
+        best_phase = 0;
+        best_collisions = UINT8_MAX;
+        for (phase = 0; phase < task->period_ms; phase++) {
+            collisions = scheduler_phase_collisions(task, phase, placed);
+            if (collisions < best_collisions) {
+                best_collisions = collisions;
+                best_phase = phase;
+                if (collisions == 0) {
+                    break;
+                }
+            }
+        }
+        task->phase_ms = best_phase;
+        placed[next] = true;
+    }
+}
+
+/*
+ * Walk one hyperperiod and find the busiest tick, both in number of
+ * releases and in worst-case work (sum of the measured exec_max of the
+ * tasks released on it, in profile ticks).  With use_phases false all
+ * tasks are treated as having a phase of zero.
+ */
+static void
+scheduler_peak_load(bool use_phases, uint8_t * peak_releases, uint32_t * peak_work)
+{
+    int i;
+    uint32_t tick, hyperperiod = scheduler_hyperperiod();
+    uint8_t releases;
+    uint32_t work;
+    uint16_t countdown[g_number_tasks];
+
+    for (i = 0; i < g_number_tasks; i++) {
+        countdown[i] = use_phases ? g_tasks[i]->phase_ms : 0;
+    }
+    *peak_releases = 0;
+    *peak_work = 0;
+    for (tick = 0; tick < hyperperiod; tick++) {
+        releases = 0;
+        work = 0;
+        for (i = 0; i < g_number_tasks; i++) {
+            if (TASK_IS_EVENT(g_tasks[i])) {
+                continue;
+            }
+            if (countdown[i] == 0) {
+                releases++;
+                work += g_tasks[i]->stats.exec_max;
+                countdown[i] = g_tasks[i]->period_ms;
+            }
+            countdown[i]--;
+        }
+        if (releases > *peak_releases) {
+            *peak_releases = releases;
+        }
+        if (work > *peak_work) {
+            *peak_work = work;
+        }
+    }
+}
+
+/*
+ * Usage: phases
+ *
+ * Show each task's period and phase, and the worst tick in the
+ * hyperperiod with and without the phases applied.  Work is based on the
+ * measured exec_max (see "stats"), so let the system run for a while
+ * before asking.
+ */
+static int clicmd_phases(char const * const args)
+{
+    int i;
+    uint8_t releases;
+    uint32_t work;
+
+    (void)(args);
+    for (i = 0; i < g_number_tasks; i++) {
+        LOG("%-20s period %5u phase %5u\r\n",
+            g_tasks[i]->task_name, g_tasks[i]->period_ms, g_tasks[i]->phase_ms);
+    }
+    LOG("worst tick over %lu ms:\r\n", scheduler_hyperperiod());
+    scheduler_peak_load(false, &releases, &work);
+    LOG("  no phases: %u releases, %lu us\r\n", releases, PROFILE_TICKS_TO_US(work));
+    scheduler_peak_load(true, &releases, &work);
+    LOG("  phased:    %u releases, %lu us\r\n", releases, PROFILE_TICKS_TO_US(work));
+    return 0;
+}
+
+static char const * const g_task_state_names[] = {
+    "idle", "ready", "running", "suspended"
+};
+
+/*
+ * Usage: tasks
+ */
+static int clicmd_tasks(char const * const args)
+{
+    int i;
+    task_t * task;
+
+    (void)(args);
+    LOG("%2s %-20s %6s %5s %4s %s\r\n", "#", "task", "period", "phase", "prio", "state");
+    for (i = 0; i < g_number_tasks; i++) {
+        task = g_tasks[i];
+        if (TASK_IS_EVENT(task)) {
+            LOG("%2d %-20s %6s %5s %4u %s\r\n", i, task->task_name, "event", "-",
+                task->priority, g_task_state_names[task->state]);
+        } else {
+            LOG("%2d %-20s %6u %5u %4u %s\r\n", i, task->task_name, task->period_ms,
+                task->phase_ms, task->priority, g_task_state_names[task->state]);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Parse the task number at the start of a command's arguments
+ */
+static task_t *
+scheduler_cli_task(char const * const args)
+{
+    int i;
+    if (args == NULL || 1 != sscanf(args, "%d", &i) || i < 0 || i >= g_number_tasks) {
+        LOG("No such task (see \"tasks\")\r\n");
+        return NULL;
+    }
+    return g_tasks[i];
+}
+
+/*
+ * Usage: suspend <task:int>
+ *
+ * The CLI task itself is running while this runs, and cannot be
+ * suspended (it would never get to run "resume").
+ */
+static int clicmd_suspend(char const * const args)
+{
+    task_t * task = scheduler_cli_task(args);
+    if (task != NULL) {
+        if (task->state == TASK_STATE_RUNNING) {
+            LOG("Cannot suspend the running task\r\n");
+        } else {
+            scheduler_suspend_task(task);
+            LOG("%s suspended\r\n", task->task_name);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Usage: resume <task:int>
+ */
+static int clicmd_resume(char const * const args)
+{
+    task_t * task = scheduler_cli_task(args);
+    if (task != NULL) {
+        if (scheduler_resume_task(task) == 0) {
+            LOG("%s resumed\r\n", task->task_name);
+        } else {
+            LOG("%s is not suspended\r\n", task->task_name);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Usage: period <task:int> <ms:int>
+ */
+static int clicmd_period(char const * const args)
+{
+    int i;
+    unsigned int period_ms;
+    if (args == NULL || 2 != sscanf(args, "%d %u", &i, &period_ms)) {
+        LOG("Usage: period <task> <ms>\r\n");
+        return 0;
+    }
+    if (i < 0 || i >= g_number_tasks) {
+        LOG("No such task (see \"tasks\")\r\n");
+        return 0;
+    }
+    scheduler_set_period(g_tasks[i], period_ms);
+    LOG("%s period is now %u ms\r\n", g_tasks[i]->task_name, period_ms);
+    return 0;
+}
 
 /*
  * Initialize the scheduler
  */
 int
-scheduler_init(timers_state_t * timers_state, task_t * tasks, uint8_t number_tasks)
+scheduler_init(
+        timers_state_t * timers_state,
+        task_t * tasks,
+        uint8_t number_tasks,
+        scheduler_phase_mode_e phase_mode)
 {
     int i;
+    uint32_t now;
+    if (number_tasks > SCHEDULER_MAX_TASKS) {
+        return -1;
+    }
+    for (i = 0; i < number_tasks; i++) {
+        if (tasks[i].priority >= SCHEDULER_PRIORITY_LEVELS) {
+            return -1;
+        }
+    }
     g_timers_state = timers_state;
-    g_tasks = tasks;
     g_number_tasks = number_tasks;
+    for (i = 0; i < SCHEDULER_WHEEL_SLOTS; i++) {
+        g_wheel[i] = NULL;
+    }
+    for (i = 0; i < SCHEDULER_PRIORITY_LEVELS; i++) {
+        g_ready_head[i] = NULL;
+        g_ready_tail[i] = NULL;
+    }
+    g_ready_map = 0;
+    for (i = 0; i < number_tasks; i++) {
+        g_tasks[i] = &tasks[i];
+        if (TASK_IS_EVENT(&tasks[i])) {
+            tasks[i].phase_ms = 0;
+        } else {
+            tasks[i].phase_ms %= tasks[i].period_ms;
+        }
+    }
+    if (phase_mode == SCHEDULER_PHASE_AUTO) {
+        scheduler_assign_phases();
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        now = g_timers_state->ms_ticks;
+    }
     for (i = 0; i < number_tasks; i++) {
         tasks[i].state = TASK_STATE_IDLE;
+        tasks[i].release_count = 0;
+        memset(&tasks[i].stats, 0, sizeof(tasks[i].stats));
+        scheduler_wheel_schedule(&tasks[i], now);
+    }
+
+    /* scheduler_init() may be called again with a new table */
+    if (!g_cli_registered) {
+        CLI_REGISTER(
+            {"stats", "stats [reset]: Show (or clear) per-task timing statistics",
+             clicmd_stats},
+            {"phases", "Show task phases and the worst-case load per tick",
+             clicmd_phases},
+            {"tasks", "List tasks with their number, period and state",
+             clicmd_tasks},
+            {"suspend", "suspend <task>: Stop releasing a task",
+             clicmd_suspend},
+            {"resume", "resume <task>: Start releasing a suspended task again",
+             clicmd_resume},
+            {"period", "period <task> <ms>: Change a task's period (0 = event only)",
+             clicmd_period}
+        );
+        g_cli_registered = true;
     }
     return 0;
 }
 
+/*
+ * Mark a task ready.  Call with interrupts disabled.
+ */
+static void
+scheduler_release(task_t * task, uint16_t release_ticks)
+{
+    if (task->state == TASK_STATE_SUSPENDED) {
+        return;
+    }
+    if (task->state == TASK_STATE_READY) {
+        /* previous release has not run yet; this one is lost */
+        task->stats.merged_releases++;
+    } else {
+        if (task->state == TASK_STATE_RUNNING) {
+            task->stats.overruns++;
+        }
+        task->stats.release_ticks = release_ticks;
+        task->state = TASK_STATE_READY;
+        scheduler_ready_push(task);
+    }
+}
+
+/*
+ * Release an event task (or release a periodic task early)
+ *
+ * May be called from an ISR or from a task.  The task runs under the same
+ * priority rules as a periodic one.  A task at or above
+ * SCHEDULER_PREEMPT_PRIORITY posted from an ISR other than the tick
+ * should be followed by scheduler_preempt() at the end of that ISR, or
+ * it will wait for the next tick.  Posting a suspended task does nothing.
+ *
+ * Returns -1 if no task in the table runs run_task.
+ */
+int
+scheduler_post(void (*run_task)(void))
+{
+    task_t * task = scheduler_find_task(run_task);
+    if (task == NULL) {
+        return -1;
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        scheduler_release(task, timers_get_profile_ticks());
+    }
+    return 0;
+}
+
+/*
+ * Find the first task in the table that runs run_task
+ */
+task_t *
+scheduler_find_task(void (*run_task)(void))
+{
+    int i;
+    for (i = 0; i < g_number_tasks; i++) {
+        if (g_tasks[i]->run_task == run_task) {
+            return g_tasks[i];
+        }
+    }
+    return NULL;
+}
+
+static int
+scheduler_task_index(task_t * task)
+{
+    int i;
+    for (i = 0; i < g_number_tasks; i++) {
+        if (g_tasks[i] == task) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Add a task to the end of the table
+ *
+ * The task is owned by the caller and must stay valid until it is
+ * removed.  phase_ms is used as given (no automatic placement) and the
+ * first release is the next one after now.  Returns -1 if the task is
+ * already in the table, the table is full or the priority is out of range.
+ */
+int
+scheduler_add_task(task_t * task)
+{
+    int result = -1;
+    if (task->priority >= SCHEDULER_PRIORITY_LEVELS) {
+        return -1;
+    }
+    if (!TASK_IS_EVENT(task)) {
+        task->phase_ms %= task->period_ms;
+    } else {
+        task->phase_ms = 0;
+    }
+    task->release_count = 0;
+    task->next = NULL;
+    task->ready_next = NULL;
+    memset(&task->stats, 0, sizeof(task->stats));
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (g_number_tasks < SCHEDULER_MAX_TASKS && scheduler_task_index(task) < 0) {
+            task->state = TASK_STATE_IDLE;
+            scheduler_wheel_schedule(task, g_timers_state->ms_ticks);
+            g_tasks[g_number_tasks++] = task;
+            result = 0;
+        }
+    }
+    return result;
+}
+
+/*
+ * Take a task out of the table
+ *
+ * A pending release is dropped.  If the task is running it is left to
+ * finish.  Returns -1 if the task is not in the table.
+ */
+int
+scheduler_remove_task(task_t * task)
+{
+    int i;
+    int result = -1;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        i = scheduler_task_index(task);
+        if (i >= 0) {
+            scheduler_wheel_remove(task);
+            for (; i < g_number_tasks - 1; i++) {
+                g_tasks[i] = g_tasks[i + 1];
+            }
+            g_number_tasks--;
+            if (task->state == TASK_STATE_READY) {
+                scheduler_ready_remove(task);
+                task->state = TASK_STATE_IDLE;
+            }
+            result = 0;
+        }
+    }
+    return result;
+}
+
+/*
+ * Stop releasing a task until scheduler_resume_task()
+ *
+ * A pending release is dropped.  If the task is running it is left to
+ * finish.  Returns -1 if the task is not in the table.
+ */
+int
+scheduler_suspend_task(task_t * task)
+{
+    int result = -1;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (scheduler_task_index(task) >= 0) {
+            scheduler_wheel_remove(task);
+            if (task->state == TASK_STATE_READY) {
+                scheduler_ready_remove(task);
+            }
+            task->state = TASK_STATE_SUSPENDED;
+            result = 0;
+        }
+    }
+    return result;
+}
+
+/*
+ * Release a suspended task again, starting from its next release after
+ * now.  Returns -1 if the task is not in the table or is not suspended.
+ */
+int
+scheduler_resume_task(task_t * task)
+{
+    int result = -1;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (scheduler_task_index(task) >= 0 && task->state == TASK_STATE_SUSPENDED) {
+            task->state = TASK_STATE_IDLE;
+            scheduler_wheel_schedule(task, g_timers_state->ms_ticks);
+            result = 0;
+        }
+    }
+    return result;
+}
+
+/*
+ * Change a task's period (TASK_PERIOD_EVENT makes it event only)
+ *
+ * The change is made with interrupts off, so the tick sees either the
+ * old period or the new one.  The phase is kept (modulo the new period)
+ * and the task is next released on its first release after now under
+ * the new period; a release already pending still runs.  Returns -1 if
+ * the task is not in the table.
+ */
+int
+scheduler_set_period(task_t * task, uint16_t period_ms)
+{
+    int result = -1;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (scheduler_task_index(task) >= 0) {
+            scheduler_wheel_remove(task);
+            task->period_ms = period_ms;
+            if (TASK_IS_EVENT(task)) {
+                task->phase_ms = 0;
+            } else {
+                task->phase_ms %= period_ms;
+            }
+            scheduler_wheel_schedule(task, g_timers_state->ms_ticks);
+            result = 0;
+        }
+    }
+    return result;
+}
+
+/*
+ * Called from the tick once per SCHEDULER_LOAD_WINDOW_MS to raise or
+ * lower the shed level.  Utilisation is only known when the main loop
+ * uses scheduler_idle(); otherwise lateness alone decides.
+ */
+static void
+scheduler_update_shed_level(void)
+{
+    uint8_t utilisation = 0;
+    if (g_idle_used) {
+        uint32_t idle = g_idle_ticks - g_window_idle_ticks;
+        uint32_t window = PROFILE_MS_TO_TICKS(SCHEDULER_LOAD_WINDOW_MS);
+        utilisation = (idle >= window) ? 0 : 100 - (idle * 100 / window);
+    }
+    g_window_idle_ticks = g_idle_ticks;
+
+    if (g_critical_late || utilisation > SCHEDULER_SHED_UTIL_PERCENT) {
+        if (g_shed_level < SCHEDULER_MAX_SHED_LEVEL) {
+            g_shed_level++;
+            g_shed_events++;
+        }
+    } else if (utilisation < SCHEDULER_RESTORE_UTIL_PERCENT && g_shed_level > 0) {
+        g_shed_level--;
+    }
+    g_critical_late = false;
+}
+
 /*
  * Called from ISR.  Release appropriate tasks to be called from main thread
+ *
+ * Only the current slot is walked, but that includes tasks due on a later
+ * lap of the wheel: a task with a period over SCHEDULER_WHEEL_SLOTS ms is
+ * looked at once a lap, so about P/64 times per release instead of P
+ * modulos.  Each look is a 32-bit compare rather than a divide.
  */
 void
 scheduler_do_schedule(void)
 {
-    int i;
+    uint32_t now = g_timers_state->ms_ticks;
+    task_t ** link = &g_wheel[now & SCHEDULER_WHEEL_MASK];
+    task_t * released = NULL;
     task_t * task;
-    for (i = 0; i < g_number_tasks; i++) {
-        task = &g_tasks[i];
-        if (g_timers_state->ms_ticks % task->period_ms == 0) {
-            task->state = true;
+    uint16_t release_ticks = timers_get_profile_ticks();
+
+    /* the tick is what normally wakes scheduler_idle(); stop counting idle
+     * time here so the ISR and anything run from it is not included */
+    if (g_sleeping) {
+        g_idle_ticks += (uint16_t)(release_ticks - g_sleep_start_ticks);
+        g_sleeping = false;
+    }
+
+    /* pull the tasks that are due out of the current slot */
+    while ((task = *link) != NULL) {
+        if (task->next_release_ms == now) {
+            *link = task->next;
+            task->next = released;
+            released = task;
+        } else {
+            link = &task->next;
         }
     }
+
+    /* release them and file them under their next release */
+    while ((task = released) != NULL) {
+        released = task->next;
+        task->release_count++;
+        if (task->sheddable &&
+                (task->release_count & ((1 << g_shed_level) - 1)) != 0) {
+            task->stats.shed_releases++;
+        } else {
+            scheduler_release(task, release_ticks);
+        }
+        task->next_release_ms += task->period_ms;
+        scheduler_wheel_insert(task);
+    }
+
+    if (++g_window_ms == SCHEDULER_LOAD_WINDOW_MS) {
+        g_window_ms = 0;
+        scheduler_update_shed_level();
+    }
+}
+
+/*
+ * Find the highest priority ready task at or above min_priority that may
+ * preempt whatever is currently running.  Ties go to the task released
+ * first.  Call with interrupts disabled.
+ */
+static task_t *
+scheduler_next_ready(int16_t min_priority)
+{
+    int8_t priority = SCHEDULER_PRIORITY_LEVELS - 1;
+    if (min_priority <= g_running_priority) {
+        min_priority = g_running_priority + 1;
+    }
+    if (min_priority >= SCHEDULER_PRIORITY_LEVELS ||
+            (g_ready_map >> min_priority) == 0) {
+        return NULL;
+    }
+    while ((g_ready_map & (1 << priority)) == 0) {
+        priority--;
+    }
+    return g_ready_head[priority];
+}
+
+/*
+ * Run ready tasks at or above min_priority, highest priority first, until
+ * none are left or max_runs tasks have run.  Tasks run with interrupts
+ * enabled, so a task may itself be preempted from the tick ISR; its
+ * execution time then includes the time spent preempted.
+ */
+static void
+scheduler_dispatch(int16_t min_priority, uint8_t max_runs)
+{
+    task_t * task;
+    int8_t preempted_priority = -1;
+    uint16_t release_ticks = 0, start_ticks, end_ticks;
+    while (max_runs--) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            task = scheduler_next_ready(min_priority);
+            if (task != NULL) {
+                scheduler_ready_remove(task);
+                task->state = TASK_STATE_RUNNING;
+                release_ticks = task->stats.release_ticks;
+                preempted_priority = g_running_priority;
+                g_running_priority = task->priority;
+            }
+        }
+        if (task == NULL) {
+            break;
+        }
+
+        start_ticks = timers_get_profile_ticks();
+        task->run_task();
+        end_ticks = timers_get_profile_ticks();
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            if (task->state == TASK_STATE_RUNNING) {
+                task->state = TASK_STATE_IDLE;
+            }
+            g_running_priority = preempted_priority;
+        }
+        scheduler_stats_update(&task->stats,
+                start_ticks - release_ticks, end_ticks - start_ticks);
+
+        /* a critical task starting more than half a period late counts
+         * as overload */
+        if (!task->sheddable && !TASK_IS_EVENT(task) &&
+                (uint16_t)(start_ticks - release_ticks) >
+                PROFILE_MS_TO_TICKS(task->period_ms) / 2) {
+            g_critical_late = true;
+        }
+    }
+}
+
+/*
+ * Called from the tick ISR after scheduler_do_schedule()
+ *
+ * If a task at or above SCHEDULER_PREEMPT_PRIORITY is ready and outranks
+ * the task that was interrupted, run it right here with interrupts
+ * re-enabled.  The interrupted task resumes when the ISR returns.
+ * Nesting is bounded by the number of distinct priorities in use.
+ */
+void
+scheduler_preempt(void)
+{
+    if (scheduler_next_ready(SCHEDULER_PREEMPT_PRIORITY) != NULL) {
+        sei();
+        scheduler_dispatch(SCHEDULER_PREEMPT_PRIORITY, UINT8_MAX);
+        cli();
+    }
 }
 
 /*
  * It is expected that will be called frequently from the main thread
  *
- * This will execute any tasks that are released in the order they were
- * provided in the initial task list.  There is no preemption.
+ * This will execute any tasks that are released, highest priority first
+ * and otherwise in the order they were released.
+ * Each call runs at most one task per table entry so that the main loop
+ * gets back to serial_check() when the system is busy.  A task that is
+ * released again while it is running is left ready so that it runs once
+ * more instead of losing the release.
  */
 int
 scheduler_service(void)
 {
-    int i;
-    task_t * task;
-    for (i = 0; i < g_number_tasks; i++) {
-        task = &g_tasks[i];
-        if (task->state == TASK_STATE_READY) {
-            task->state = TASK_STATE_RUNNING;
-            task->run_task();
-            task->state = TASK_STATE_IDLE;
+    scheduler_dispatch(0, g_number_tasks);
+    return 0;
+}
+
+/*
+ * Called from the main loop once scheduler_service() has run what is
+ * ready.  If no cooperative task is ready, the CPU is put in idle sleep
+ * until the next interrupt, which is normally the tick (where any periodic
+ * release happens).  The encoder pin change and PD timer ISRs also wake
+ * it; the encoder ISR may have posted a task (see
+ * encoder_set_edge_event()), which the main loop then runs.  Serial
+ * traffic does not: USB_COMM is polled by serial_check(), so input waits
+ * for the tick to wake the main loop, up to 1ms.  Time spent asleep is
+ * added to the idle counter shown by "stats".
+ *
+ * The tick is left running at 1ms since it is also the system time base,
+ * so the longest sleep is one tick.  Periodic releases only ever happen
+ * from the tick, so waking on each tick and going straight back to sleep
+ * when nothing was released is equivalent to sleeping until the next
+ * release computed from the wheel.
+ */
+void
+scheduler_idle(void)
+{
+    cli();
+    if (scheduler_next_ready(0) != NULL) {
+        sei();
+        return;
+    }
+
+    g_idle_used = true;
+    g_sleep_start_ticks = timers_get_profile_ticks();
+    g_sleeping = true;
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_enable();
+    /* the instruction after sei() always runs before any pending
+     * interrupt, so a wakeup cannot be missed between here and sleep */
+    sei();
+    sleep_cpu();
+    sleep_disable();
+
+    /* woken by something other than the tick */
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (g_sleeping) {
+            g_idle_ticks += (uint16_t)(timers_get_profile_ticks() - g_sleep_start_ticks);
+            g_sleeping = false;
         }
     }
-    return 0;
 }
@@ -5,21 +5,150 @@
 #include <stdbool.h>
 #include "timers.h"
 
+/* Number of slots in the release timing wheel (must be a power of 2) */
+#define SCHEDULER_WHEEL_SLOTS (64)
+#define SCHEDULER_WHEEL_MASK  (SCHEDULER_WHEEL_SLOTS - 1)
+
+/*
+ * Tasks with a priority at or above this are run straight from the tick
+ * ISR (with interrupts re-enabled) and preempt lower priority work.
+ * Lower priority tasks are run cooperatively by scheduler_service().
+ * Define as SCHEDULER_PRIORITY_LEVELS or higher to turn preemption off.
+ */
+#ifndef SCHEDULER_PREEMPT_PRIORITY
+#define SCHEDULER_PREEMPT_PRIORITY (2)
+#endif
+
+/*
+ * Overload shedding
+ *
+ * Every SCHEDULER_LOAD_WINDOW_MS the tick looks at the CPU utilisation
+ * over the window (from scheduler_idle()) and at whether any critical
+ * (non-sheddable) task started more than half a period late.  If either
+ * is over the line the shed level goes up by one, and sheddable tasks
+ * then only run on every 2^level-th release.  The level comes back down
+ * one step per quiet window once utilisation is below
+ * SCHEDULER_RESTORE_UTIL_PERCENT.
+ */
+#define SCHEDULER_LOAD_WINDOW_MS       (100)
+#ifndef SCHEDULER_SHED_UTIL_PERCENT
+#define SCHEDULER_SHED_UTIL_PERCENT    (90)
+#endif
+#define SCHEDULER_RESTORE_UTIL_PERCENT (70)
+#define SCHEDULER_MAX_SHED_LEVEL       (3)
+
+/*
+ * Number of task priorities (0 .. SCHEDULER_PRIORITY_LEVELS - 1).  Each
+ * has its own ready list, and a bitmap of the non-empty ones lets the tick
+ * find the highest ready priority without looking at the task table.
+ */
+#ifndef SCHEDULER_PRIORITY_LEVELS
+#define SCHEDULER_PRIORITY_LEVELS (8)
+#endif
+#if SCHEDULER_PRIORITY_LEVELS > 8
+#error "the ready bitmap is one byte"
+#endif
+
+/* Most tasks the scheduler tracks (initial table plus any added later) */
+#ifndef SCHEDULER_MAX_TASKS
+#define SCHEDULER_MAX_TASKS (32)
+#endif
+
+/* Longest window searched when assigning or reporting on phases */
+#define SCHEDULER_MAX_HYPERPERIOD_MS (1000)
+
+/*
+ * How scheduler_init() treats task phases
+ *
+ *  - SCHEDULER_PHASE_EXPLICIT: use phase_ms exactly as given
+ *  - SCHEDULER_PHASE_AUTO: keep any non-zero phase_ms, and pick a phase
+ *    for every other task so that as few tasks as possible are released
+ *    on the same tick
+ */
+typedef enum {
+    SCHEDULER_PHASE_EXPLICIT,
+    SCHEDULER_PHASE_AUTO
+} scheduler_phase_mode_e;
+
+/*
+ * A task with this period is never released by the tick.  It runs only
+ * when posted with scheduler_post(), from an ISR or from another task.
+ */
+#define TASK_PERIOD_EVENT (0)
+#define TASK_IS_EVENT(task) ((task)->period_ms == TASK_PERIOD_EVENT)
+
 typedef enum {
     TASK_STATE_IDLE,
     TASK_STATE_READY,
-    TASK_STATE_RUNNING
+    TASK_STATE_RUNNING,
+    /* not released until scheduler_resume_task() */
+    TASK_STATE_SUSPENDED
 } task_state_t;
 
+/*
+ * Timing statistics kept for each task.  Times are in profile clock
+ * ticks (see PROFILE_TICKS_TO_US).
+ */
 typedef struct {
+    /* profile clock at the last release (set from the tick ISR) */
+    volatile uint16_t release_ticks;
+    /* number of completed runs */
+    uint32_t runs;
+    /* execution time */
+    uint16_t exec_min;
+    uint16_t exec_max;
+    uint32_t exec_total;
+    /* release to start latency */
+    uint16_t latency_min;
+    uint16_t latency_max;
+    uint32_t latency_total;
+    /* released again while still waiting to run (release lost) */
+    volatile uint16_t merged_releases;
+    /* released again while still running (run deferred) */
+    volatile uint16_t overruns;
+    /* releases skipped because of overload */
+    volatile uint16_t shed_releases;
+} task_stats_t;
+
+typedef struct _task_t {
     char * task_name;
+    /* release period, or TASK_PERIOD_EVENT */
     uint16_t period_ms;
     void (*run_task)(void);
+    /* higher runs first (below SCHEDULER_PRIORITY_LEVELS) */
+    uint8_t priority;
+    /* release offset within the period (ms) */
+    uint16_t phase_ms;
+    /* may be skipped when the system is overloaded */
+    bool sheddable;
     volatile task_state_t  state;
+    /* releases seen so far (used to pick which ones to shed) */
+    uint8_t release_count;
+    /* tick (ms) at which this task is next released */
+    uint32_t next_release_ms;
+    /* next task hashed to the same timing wheel slot */
+    struct _task_t * next;
+    /* next task in the ready list for this priority */
+    struct _task_t * ready_next;
+    task_stats_t stats;
 } task_t;
 
-int scheduler_init(timers_state_t * timers_state, task_t * tasks, uint8_t number_tasks);
+int scheduler_init(
+        timers_state_t * timers_state,
+        task_t * tasks,
+        uint8_t number_tasks,
+        scheduler_phase_mode_e phase_mode);
 void scheduler_do_schedule(void);
+void scheduler_preempt(void);
+int scheduler_post(void (*run_task)(void));
+task_t * scheduler_find_task(void (*run_task)(void));
+int scheduler_add_task(task_t * task);
+int scheduler_remove_task(task_t * task);
+int scheduler_suspend_task(task_t * task);
+int scheduler_resume_task(task_t * task);
+int scheduler_set_period(task_t * task, uint16_t period_ms);
 int scheduler_service(void);
+void scheduler_idle(void);
+void scheduler_reset_stats(void);
 
 #endif /* SCHEDULER_H_ */
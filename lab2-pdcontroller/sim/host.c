@@ -0,0 +1,78 @@
+/*
+ * Host versions of target code shared by the simulators and the tests
+ * (see sim.c, plant.c and pd_law.c)
+ *
+ * The target's formats are written for the AVR, where int32_t and
+ * uint32_t are longs; on the host they are ints, so the 'l' length
+ * modifiers are dropped before the host's printf or scanf sees them.
+ */
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "host.h"
+#include "log.h"
+
+/*
+ * Copy an AVR format without its 'l' length modifiers
+ */
+static void
+host_format(char * host_fmt, size_t size, char const * fmt)
+{
+    char * out = host_fmt;
+    bool in_spec = false;
+
+    for (; *fmt != '\0' && out < &host_fmt[size - 1]; fmt++) {
+        if (in_spec && *fmt == 'l') {
+            continue;
+        }
+        if (*fmt == '%') {
+            in_spec = !in_spec;
+        } else if (in_spec && strchr("diouxXcsp[", *fmt) != NULL) {
+            in_spec = false;
+        }
+        *out++ = *fmt;
+    }
+    *out = '\0';
+}
+
+static bool g_logging = true;
+
+void
+host_set_logging(bool enabled)
+{
+    g_logging = enabled;
+}
+
+void
+log_message(log_level_e lvl, char *fmt, ...)
+{
+    char host_fmt[256];
+    va_list args;
+
+    (void)(lvl);
+    if (!g_logging) {
+        return;
+    }
+    host_format(host_fmt, sizeof(host_fmt), fmt);
+    va_start(args, fmt);
+    vprintf(host_fmt, args);
+    va_end(args);
+}
+
+/*
+ * sscanf() for the CLI handlers, which read int32_t with "%ld"
+ */
+int
+host_sscanf(char const * str, char const * fmt, ...)
+{
+    char host_fmt[256];
+    va_list args;
+    int n;
+
+    host_format(host_fmt, sizeof(host_fmt), fmt);
+    va_start(args, fmt);
+    n = vsscanf(str, host_fmt, args);
+    va_end(args);
+    return n;
+}
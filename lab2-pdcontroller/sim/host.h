@@ -0,0 +1,19 @@
+/*
+ * host.h (see host.c)
+ *
+ * Forced into the target sources the plant simulator and the tests build
+ * (-include), so their "%ld" conversions read into int32_t correctly on
+ * the host.
+ */
+#ifndef SIM_HOST_H_
+#define SIM_HOST_H_
+
+#include <stdbool.h>
+#include <stdio.h>
+
+int host_sscanf(char const * str, char const * fmt, ...);
+/* turn the target's LOG output off (and back on) */
+void host_set_logging(bool enabled);
+#define sscanf host_sscanf
+
+#endif /* SIM_HOST_H_ */
@@ -0,0 +1,370 @@
+/*
+ * PD control law check
+ *
+ * Runs the real motor_service_pd_controller() from motor.c over a grid
+ * of gains, position errors and velocities, and checks its torque three
+ * ways:
+ *
+ *  - against the fixed point law as specified (gains rounded to Q12,
+ *    inputs limited to keep each product within 2^30, the sum rounded
+ *    back to whole torque units and saturated), worked independently in
+ *    64 bits: the two must match exactly
+ *  - against the divide formula it replaced,
+ *
+ *      T = Kp * (Pr - Pm) / 100 - Kd * Vm / 100
+ *
+ *    in C integer arithmetic (each term truncated towards zero),
+ *    saturated to +/-MAX_TORQUE.  Each of the old terms is up to a count
+ *    short, and the new law rounds once, so the two may differ by up to
+ *    PD_LAW_TOLERANCE torque counts
+ *  - against the exact value, rounded, to within PD_LAW_TOLERANCE
+ *
+ * The encoder, interpolator, autotune, timers and scheduler are stubs
+ * here: the snapshot the controller reads is set directly.
+ *
+ * Usage: pd_law [-p kp_max] [-d kd_max] [-e error_max] [-w velocity_max]
+ *
+ *   -p  largest Kp tried, 0.01 units (default 2000)
+ *   -d  largest Kd tried, 0.01 units (default 300)
+ *   -e  largest |Pr - Pm| tried, degrees (default 1000)
+ *   -w  largest |Vm| tried, degrees/s (default 10000)
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <avr/io.h>
+#include "autotune.h"
+#include "cli.h"
+#include "interpolator.h"
+#include "motor.h"
+#include "scheduler.h"
+#include "timers.h"
+
+#define MAX_TORQUE         (255)
+#define COEFFICIENT_SCALAR (100)
+#define GAIN_SHIFT         (12)
+#define MAX_TERM           (1L << 30)
+/* old truncated each of two terms (under a count each), new rounds once */
+#define PD_LAW_TOLERANCE   (2)
+
+#define PD_LAW_MAX_COMMANDS (32)
+
+/* the registers motor.c touches */
+volatile uint8_t OCR2B;
+volatile uint8_t PORTC;
+volatile uint8_t DDRC;
+volatile uint8_t DDRD;
+volatile uint16_t TCNT3;
+volatile uint8_t TIMSK3;
+volatile uint8_t TIFR3;
+
+static cli_command_t g_commands[PD_LAW_MAX_COMMANDS];
+static int g_num_commands;
+
+/* what the controller sees this cycle */
+static interpolator_snapshot_t g_snapshot;
+static int32_t g_target;
+
+/*
+ * Stubs for everything motor.c calls but the control law
+ */
+void
+cli_register(cli_command_t command)
+{
+    if (g_num_commands < PD_LAW_MAX_COMMANDS) {
+        g_commands[g_num_commands++] = command;
+    }
+}
+
+void encoder_init(void) {}
+void interpolator_sample(void) {}
+void interpolator_service(void) {}
+int interpolator_add_target_position(int32_t target_position) { return 0; }
+int interpolator_add_relative_target(int32_t degrees_delta) { return 0; }
+
+void
+interpolator_get_snapshot(interpolator_snapshot_t * snapshot)
+{
+    *snapshot = g_snapshot;
+}
+
+int32_t
+interpolator_get_target_position(void)
+{
+    return g_target;
+}
+
+int32_t
+interpolator_get_absolute_target_position(void)
+{
+    return g_target;
+}
+
+void autotune_start(autotune_rule_e rule, int16_t relay_torque, int32_t position) {}
+void autotune_stop(void) {}
+
+int16_t
+autotune_step(int32_t position, uint32_t dt_ticks)
+{
+    return 0;
+}
+
+autotune_status_e
+autotune_get_status(void)
+{
+    return AUTOTUNE_IDLE;
+}
+
+bool
+autotune_get_result(autotune_result_t * result)
+{
+    return false;
+}
+
+char const *
+autotune_rule_name(autotune_rule_e rule)
+{
+    return "";
+}
+
+task_t *
+scheduler_find_task(void (*run_task)(void))
+{
+    return NULL;
+}
+
+int scheduler_set_period(task_t * task, uint16_t period_ms) { return 0; }
+int scheduler_suspend_task(task_t * task) { return 0; }
+int scheduler_resume_task(task_t * task) { return 0; }
+
+int
+timers_setup_pwm(timer_counter_e timer_counter, timer_counter_mode_e mode,
+        timer_top_e top, uint32_t frequency_hz)
+{
+    return 0;
+}
+
+void
+timers_set_output(timer_counter_e timer_counter, timer_channel_e channel,
+        timer_output_e output)
+{
+}
+
+int
+timers_setup_timer(timer_counter_e timer_counter, timer_counter_mode_e mode,
+        uint32_t target_period_microseconds)
+{
+    return 0;
+}
+
+/*
+ * Run a CLI command registered by motor.c
+ */
+static void
+pd_law_command(char const * name, int32_t value)
+{
+    char args[16];
+    int i;
+
+    snprintf(args, sizeof(args), "%d", value);
+    for (i = 0; i < g_num_commands; i++) {
+        if (strcmp(g_commands[i].command, name) == 0) {
+            g_commands[i].handler(args);
+            return;
+        }
+    }
+    fprintf(stderr, "no command %s\n", name);
+    exit(2);
+}
+
+/*
+ * The law motor.c used before it went to fixed point
+ */
+static int32_t
+pd_law_old(int32_t kp, int32_t kd, int32_t error, int32_t velocity)
+{
+    int32_t torque = (kp * error / COEFFICIENT_SCALAR) - (kd * velocity / COEFFICIENT_SCALAR);
+    return torque > MAX_TORQUE ? MAX_TORQUE : torque < -MAX_TORQUE ? -MAX_TORQUE : torque;
+}
+
+/*
+ * The law exactly, rounded to nearest
+ */
+static int32_t
+pd_law_exact(int32_t kp, int32_t kd, int32_t error, int32_t velocity)
+{
+    int64_t scaled = (int64_t)kp * error - (int64_t)kd * velocity;
+    int64_t torque = (scaled >= 0) ?
+        (scaled + COEFFICIENT_SCALAR / 2) / COEFFICIENT_SCALAR :
+        -((-scaled + COEFFICIENT_SCALAR / 2) / COEFFICIENT_SCALAR);
+    return torque > MAX_TORQUE ? MAX_TORQUE : torque < -MAX_TORQUE ? -MAX_TORQUE : torque;
+}
+
+/*
+ * A Q12 gain, as motor_set_gains() should make it: rounded to nearest,
+ * halves away from zero
+ */
+static int64_t
+pd_law_gain_q(int32_t gain)
+{
+    int64_t scaled = (int64_t)gain << GAIN_SHIFT;
+    scaled += (gain < 0) ? -COEFFICIENT_SCALAR / 2 : COEFFICIENT_SCALAR / 2;
+    return scaled / COEFFICIENT_SCALAR;
+}
+
+/*
+ * An input limited so that its product with a Q12 gain is within MAX_TERM
+ */
+static int64_t
+pd_law_limit(int64_t input, int64_t gain_q)
+{
+    int64_t limit = (gain_q == 0) ? INT32_MAX : MAX_TERM / (gain_q < 0 ? -gain_q : gain_q);
+    return input > limit ? limit : input < -limit ? -limit : input;
+}
+
+/*
+ * The fixed point law as specified, in 64 bits
+ */
+static int32_t
+pd_law_q12(int32_t kp, int32_t kd, int32_t error, int32_t velocity)
+{
+    int64_t kp_q = pd_law_gain_q(kp);
+    int64_t kd_q = pd_law_gain_q(kd);
+    int64_t sum = kp_q * pd_law_limit(error, kp_q) - kd_q * pd_law_limit(velocity, kd_q);
+    /* round to nearest, halves up, as an arithmetic shift does */
+    int64_t scaled = sum + (1L << (GAIN_SHIFT - 1));
+    int64_t torque = (scaled >= 0) ? scaled >> GAIN_SHIFT :
+        -((-scaled + (1L << GAIN_SHIFT) - 1) >> GAIN_SHIFT);
+    return torque > MAX_TORQUE ? MAX_TORQUE : torque < -MAX_TORQUE ? -MAX_TORQUE : torque;
+}
+
+typedef struct {
+    int64_t count;
+    /* how often, and how far, the torque differed from the reference */
+    int64_t differ;
+    int32_t worst;
+    int32_t worst_kp;
+    int32_t worst_kd;
+    int32_t worst_error;
+    int32_t worst_velocity;
+} deviation_t;
+
+static void
+deviation_add(deviation_t * d, int32_t diff, int32_t kp, int32_t kd,
+        int32_t error, int32_t velocity)
+{
+    d->count++;
+    if (diff < 0) {
+        diff = -diff;
+    }
+    if (diff != 0) {
+        d->differ++;
+    }
+    if (diff > d->worst) {
+        d->worst = diff;
+        d->worst_kp = kp;
+        d->worst_kd = kd;
+        d->worst_error = error;
+        d->worst_velocity = velocity;
+    }
+}
+
+static void
+deviation_print(char const * name, deviation_t const * d)
+{
+    printf("%-20s: %lld of %lld differ (%.2f%%), worst %d counts "
+            "(Kp %d Kd %d error %d Vm %d)\n", name, (long long)d->differ,
+            (long long)d->count, 100.0 * d->differ / d->count, d->worst,
+            d->worst_kp, d->worst_kd, d->worst_error, d->worst_velocity);
+}
+
+int
+main(int argc, char * argv[])
+{
+    int32_t kp_max = 2000;
+    int32_t kd_max = 300;
+    int32_t error_max = 1000;
+    int32_t velocity_max = 10000;
+    deviation_t vs_q12 = {0};
+    deviation_t vs_old = {0};
+    deviation_t vs_exact = {0};
+    deviation_t old_vs_exact = {0};
+    int32_t kp, kd, error, velocity;
+    int32_t torque, old, exact;
+    int failures = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:d:e:w:")) != -1) {
+        switch (opt) {
+        case 'p':
+            kp_max = atoi(optarg);
+            break;
+        case 'd':
+            kd_max = atoi(optarg);
+            break;
+        case 'e':
+            error_max = atoi(optarg);
+            break;
+        case 'w':
+            velocity_max = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-p kp_max] [-d kd_max] [-e error_max] "
+                    "[-w velocity_max]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    host_set_logging(false);
+    motor_init();
+    g_snapshot.dt_ticks = PROFILE_MS_TO_TICKS(1);
+
+    /* gains on a grid (every value near 0, where Q12 is coarsest), the
+     * inputs on a grid that takes in both ends and 0 */
+    for (kp = 0; kp <= kp_max; kp += (kp < 100) ? 1 : 25) {
+        pd_law_command("p", kp);
+        for (kd = 0; kd <= kd_max; kd += (kd < 20) ? 1 : 10) {
+            pd_law_command("d", kd);
+            for (error = -error_max; error <= error_max; error += 1 + error_max / 50) {
+                for (velocity = -velocity_max; velocity <= velocity_max;
+                        velocity += 1 + velocity_max / 50) {
+                    g_target = error;
+                    g_snapshot.position = 0;
+                    g_snapshot.velocity = velocity;
+                    motor_service_pd_controller();
+                    torque = motor_get_last_torque();
+                    deviation_add(&vs_q12, torque - pd_law_q12(kp, kd, error, velocity),
+                            kp, kd, error, velocity);
+                    old = pd_law_old(kp, kd, error, velocity);
+                    exact = pd_law_exact(kp, kd, error, velocity);
+                    deviation_add(&vs_old, torque - old, kp, kd, error, velocity);
+                    deviation_add(&vs_exact, torque - exact, kp, kd, error, velocity);
+                    deviation_add(&old_vs_exact, old - exact, kp, kd, error, velocity);
+                }
+            }
+        }
+    }
+    host_set_logging(true);
+
+    deviation_print("fixed point vs Q12", &vs_q12);
+    deviation_print("fixed point vs old", &vs_old);
+    deviation_print("fixed point vs exact", &vs_exact);
+    deviation_print("old vs exact", &old_vs_exact);
+    if (vs_q12.worst != 0) {
+        printf("FAIL: not bit-exact with the Q12 law\n");
+        failures++;
+    }
+    if (vs_old.worst > PD_LAW_TOLERANCE) {
+        printf("FAIL: more than %d counts from the old law\n", PD_LAW_TOLERANCE);
+        failures++;
+    }
+    if (vs_exact.worst > PD_LAW_TOLERANCE) {
+        printf("FAIL: more than %d counts from the exact law\n", PD_LAW_TOLERANCE);
+        failures++;
+    }
+    printf("%s\n", failures == 0 ? "PASS" : "FAIL");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,512 @@
+/*
+ * Motor plant simulator
+ *
+ * Runs the real motor.c, interpolator.c, encoder.c and autotune.c on the
+ * host against a model of the Solarbotics GM2 and its encoder, so a gain,
+ * rate or estimator change can be tried out closed loop without the
+ * board.  The control code sees the same registers it drives on the
+ * target:
+ *
+ *  - OCR2B and PC6 set the motor voltage.  The PWM is averaged over each
+ *    period (the electrical time constant is a few PWM periods), so only
+ *    its 8 bit quantisation is modelled.
+ *  - the encoder sets PD1/PD0 (A/B) in PIND and calls the PCINT3 ISR on
+ *    every transition, 64 to an output shaft revolution, as the real
+ *    encoder does.
+ *  - the TC3 compare match ISR is called at the rate set up for it, when
+ *    the PD is run from an ISR ("pdisr").
+ *
+ * The motor is the usual first order electrical and mechanical model,
+ *
+ *   L di/dt = V - R i - Ke w
+ *   J dw/dt = Kt i - b w - friction
+ *
+ * with Coulomb friction and stiction on the motor shaft, and backlash
+ * between the gearbox and the output shaft (which carries the encoder
+ * and is taken to have no inertia of its own).  It is integrated with a
+ * fixed SIM_STEP_US step.
+ *
+ * The tasks run on the 1ms tick at their periods, or on the first tick
+ * after they are posted (the interpolator, by the encoder ISR, as in
+ * lab2.c), in priority order, and take no time; the scheduler itself is
+ * not simulated (see sim.c for that).
+ *
+ * Usage: plant_sim [-t seconds] [-b backlash_deg] [-v volts] <script>
+ *
+ *   -t  simulated run time (default 10s)
+ *   -b  output backlash (default 2 degrees)
+ *   -v  supply voltage (default 12V)
+ *
+ * The script has one CLI command per line, preceded by the simulated time
+ * (ms) to run it at:
+ *
+ *   time_ms command [args]
+ *
+ * Lines starting with '#' are comments.  See the *.plant scripts.
+ *
+ * The output is whatever the commands log (with "l", the motor state
+ * every 50ms), followed by '#' lines summing up how well the output
+ * tracked the interpolator's absolute target.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <avr/io.h>
+#include "cli.h"
+#include "log.h"
+#include "scheduler.h"
+#include "timers.h"
+#include "motor.h"
+#include "interpolator.h"
+#include "encoder.h"
+
+#define SIM_STEP_US           (10)
+#define SIM_MAX_COMMANDS      (64)
+#define SIM_MAX_SCRIPT_LINES  (256)
+#define SIM_LINE_LENGTH       (128)
+/* the settle time is measured to within this of the target, degrees */
+#define SIM_SETTLE_DEG        (5)
+/* as lab2.c */
+#define SIM_EVENT_EDGES       (4)
+
+/* GM2 224:1 with its encoder */
+#define PLANT_GEAR_RATIO          (224.0)
+#define PLANT_ENCODER_COUNTS      (64)
+#define PLANT_DEFAULT_SUPPLY_V    (12.0)
+#define PLANT_DEFAULT_BACKLASH    (2.0)
+/* winding resistance (ohm) and inductance (H) */
+#define PLANT_R                   (7.0)
+#define PLANT_L                   (3.0e-3)
+/* back EMF (V s/rad) and torque (N m/A) constants */
+#define PLANT_KE                  (5.5e-3)
+#define PLANT_KT                  (5.5e-3)
+/* rotor inertia (kg m^2) and viscous friction (N m s/rad) */
+#define PLANT_J                   (1.5e-7)
+#define PLANT_B                   (1.0e-8)
+/* Coulomb friction and stiction at the motor (N m) */
+#define PLANT_COULOMB             (0.6e-3)
+#define PLANT_STICTION            (0.75e-3)
+/* below this the shaft is taken to be stopped (rad/s) */
+#define PLANT_STOPPED             (1.0e-3)
+
+#define RAD_TO_DEG                (180.0 / M_PI)
+
+/* the registers the control code uses (see stubs/avr/io.h) */
+volatile uint8_t OCR2B;
+volatile uint8_t PORTC;
+volatile uint8_t DDRC;
+volatile uint8_t PORTD;
+volatile uint8_t DDRD;
+volatile uint8_t PIND;
+volatile uint8_t PCICR;
+volatile uint8_t PCIFR;
+volatile uint8_t PCMSK3;
+volatile uint16_t TCNT3;
+volatile uint8_t TIMSK3;
+volatile uint8_t TIFR3;
+
+void PCINT3_vect(void);
+void TIMER3_COMPA_vect(void);
+
+typedef struct {
+    double supply;
+    double backlash;
+    /* winding current (A) and motor speed (rad/s) */
+    double current;
+    double speed;
+    /* gearbox and output shaft angles, degrees */
+    double gear_angle;
+    double output_angle;
+    int32_t encoder_counts;
+} plant_t;
+
+typedef struct {
+    uint32_t time_ms;
+    char line[SIM_LINE_LENGTH];
+} script_line_t;
+
+static plant_t g_plant = {
+    .supply = PLANT_DEFAULT_SUPPLY_V,
+    .backlash = PLANT_DEFAULT_BACKLASH
+};
+
+/* simulated time */
+static uint64_t g_now_us;
+/* the TC3 ISR period (0: not set up) and when it is next due */
+static uint32_t g_tc3_period_us;
+static uint64_t g_tc3_next_us;
+
+static cli_command_t g_commands[SIM_MAX_COMMANDS];
+static int g_num_commands;
+
+static script_line_t g_script[SIM_MAX_SCRIPT_LINES];
+static int g_script_length;
+
+/* as lab2.c, less the tasks that talk to the board */
+static task_t g_tasks[] = {
+    {"Service PD", PD_PERIOD_50HZ_MS, motor_service_pd_controller, 2},
+    {"Service Interpolator", PD_PERIOD_50HZ_MS, interpolator_service, 1},
+    {"Log Motor State", 50, motor_log_state, 0}
+};
+
+/*
+ * Timers: everything runs off the simulated clock
+ */
+uint32_t
+timers_get_uptime_ms(void)
+{
+    return g_now_us / 1000;
+}
+
+uint32_t
+timers_get_uptime_us(void)
+{
+    return g_now_us;
+}
+
+uint16_t
+timers_get_profile_ticks(void)
+{
+    /* TC1 at clk/64 */
+    return g_now_us * (F_CPU / 64 / 1000) / 1000;
+}
+
+int
+timers_setup_pwm(timer_counter_e timer_counter, timer_counter_mode_e mode,
+        timer_top_e top, uint32_t frequency_hz)
+{
+    (void)(timer_counter);
+    (void)(mode);
+    (void)(top);
+    (void)(frequency_hz);
+    return 0;
+}
+
+void
+timers_set_output(timer_counter_e timer_counter, timer_channel_e channel,
+        timer_output_e output)
+{
+    (void)(timer_counter);
+    (void)(channel);
+    (void)(output);
+}
+
+int
+timers_setup_timer(timer_counter_e timer_counter, timer_counter_mode_e mode,
+        uint32_t target_period_microseconds)
+{
+    if (timer_counter != TIMER_COUNTER3 || mode != TIMER_MODE_CTC) {
+        return -1;
+    }
+    g_tc3_period_us = target_period_microseconds;
+    g_tc3_next_us = g_now_us + target_period_microseconds;
+    return 0;
+}
+
+/*
+ * Scheduler: just enough for motor_set_poll_rate(),
+ * motor_set_isr_rate() and the encoder's edge event
+ */
+task_t *
+scheduler_find_task(void (*run_task)(void))
+{
+    int i;
+
+    for (i = 0; i < COUNT_OF(g_tasks); i++) {
+        if (g_tasks[i].run_task == run_task) {
+            return &g_tasks[i];
+        }
+    }
+    return NULL;
+}
+
+int
+scheduler_post(void (*run_task)(void))
+{
+    task_t * task = scheduler_find_task(run_task);
+
+    if (task == NULL) {
+        return -1;
+    }
+    if (task->state != TASK_STATE_SUSPENDED) {
+        task->state = TASK_STATE_READY;
+    }
+    return 0;
+}
+
+int
+scheduler_set_period(task_t * task, uint16_t period_ms)
+{
+    task->period_ms = period_ms;
+    return 0;
+}
+
+int
+scheduler_suspend_task(task_t * task)
+{
+    task->state = TASK_STATE_SUSPENDED;
+    return 0;
+}
+
+int
+scheduler_resume_task(task_t * task)
+{
+    task->state = TASK_STATE_IDLE;
+    return 0;
+}
+
+void
+cli_register(cli_command_t command)
+{
+    if (g_num_commands < SIM_MAX_COMMANDS) {
+        g_commands[g_num_commands++] = command;
+    }
+}
+
+/*
+ * Run a script line as the CLI would; -1 if there is no such command
+ */
+static int
+sim_run_command(char const * line)
+{
+    char name[SIM_LINE_LENGTH];
+    char const * args;
+    int i;
+
+    if (sscanf(line, "%127s", name) != 1) {
+        return 0;
+    }
+    args = strstr(line, name) + strlen(name);
+    while (*args == ' ') {
+        args++;
+    }
+    /* The firmware CLI hands a bare command NULL, so do the same. */
+    if (*args == '\0') {
+        args = NULL;
+    }
+    for (i = 0; i < g_num_commands; i++) {
+        if (strcmp(g_commands[i].command, name) == 0) {
+            g_commands[i].handler(args);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int
+sim_load_script(char const * path)
+{
+    FILE * file = fopen(path, "r");
+    char line[SIM_LINE_LENGTH];
+    script_line_t * entry;
+    int offset;
+
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '#' || line[strspn(line, " \t")] == '\0') {
+            continue;
+        }
+        if (g_script_length == SIM_MAX_SCRIPT_LINES) {
+            fprintf(stderr, "%s: too many lines\n", path);
+            fclose(file);
+            return -1;
+        }
+        entry = &g_script[g_script_length];
+        if (sscanf(line, "%u %n", &entry->time_ms, &offset) != 1 || line[offset] == '\0') {
+            fprintf(stderr, "%s: bad line: %s\n", path, line);
+            fclose(file);
+            return -1;
+        }
+        strcpy(entry->line, &line[offset]);
+        if (g_script_length > 0 && entry->time_ms < g_script[g_script_length - 1].time_ms) {
+            fprintf(stderr, "%s: out of order: %s\n", path, line);
+            fclose(file);
+            return -1;
+        }
+        g_script_length++;
+    }
+    fclose(file);
+    return 0;
+}
+
+/*
+ * Present encoder count n on PD1/PD0; the forward sequence of (A, B) is
+ * 00, 10, 11, 01
+ */
+static void
+plant_set_encoder_pins(int32_t n)
+{
+    static const uint8_t a[] = {0, 1, 1, 0};
+    static const uint8_t b[] = {0, 0, 1, 1};
+    uint8_t phase = n & 3;
+
+    PIND = (PIND & ~(1 << PD1 | 1 << PD0)) | a[phase] << PD1 | b[phase] << PD0;
+}
+
+/*
+ * Advance the motor by SIM_STEP_US, then step the encoder through any
+ * transitions that took
+ */
+static void
+plant_step(void)
+{
+    double dt = SIM_STEP_US * 1e-6;
+    double duty = (OCR2B == 0) ? 0.0 : (OCR2B + 1) / 256.0;
+    double voltage = g_plant.supply * duty * ((PORTC & (1 << PC6)) ? 1.0 : -1.0);
+    double torque, friction, half_backlash;
+    int32_t counts;
+
+    g_plant.current += dt * (voltage - PLANT_R * g_plant.current -
+        PLANT_KE * g_plant.speed) / PLANT_L;
+
+    torque = PLANT_KT * g_plant.current;
+    if (fabs(g_plant.speed) < PLANT_STOPPED && fabs(torque) <= PLANT_STICTION) {
+        /* held by stiction */
+        g_plant.speed = 0.0;
+    } else {
+        double direction = (fabs(g_plant.speed) < PLANT_STOPPED) ? copysign(1.0, torque) :
+            copysign(1.0, g_plant.speed);
+        double speed;
+
+        friction = PLANT_COULOMB * direction + PLANT_B * g_plant.speed;
+        speed = g_plant.speed + dt * (torque - friction) / PLANT_J;
+        /* friction alone stops the shaft, it does not reverse it */
+        if (speed * direction < 0.0 && fabs(torque) <= PLANT_STICTION) {
+            speed = 0.0;
+        }
+        g_plant.speed = speed;
+    }
+    g_plant.gear_angle += dt * g_plant.speed * RAD_TO_DEG / PLANT_GEAR_RATIO;
+
+    /* the output only moves once the gear has taken up the backlash */
+    half_backlash = g_plant.backlash / 2.0;
+    if (g_plant.gear_angle - g_plant.output_angle > half_backlash) {
+        g_plant.output_angle = g_plant.gear_angle - half_backlash;
+    } else if (g_plant.output_angle - g_plant.gear_angle > half_backlash) {
+        g_plant.output_angle = g_plant.gear_angle + half_backlash;
+    }
+
+    counts = (int32_t)floor(g_plant.output_angle * PLANT_ENCODER_COUNTS / 360.0);
+    while (g_plant.encoder_counts != counts) {
+        g_plant.encoder_counts += (counts > g_plant.encoder_counts) ? 1 : -1;
+        plant_set_encoder_pins(g_plant.encoder_counts);
+        if ((PCICR & (1 << PCIE3)) && (PCMSK3 & (1 << PCINT24 | 1 << PCINT25))) {
+            PCINT3_vect();
+        }
+    }
+}
+
+/*
+ * Run the tasks due or posted at this tick, highest priority first
+ * (g_tasks is in that order)
+ */
+static void
+sim_run_tasks(uint32_t ms)
+{
+    int i;
+
+    for (i = 0; i < COUNT_OF(g_tasks); i++) {
+        if (g_tasks[i].state == TASK_STATE_READY ||
+                (g_tasks[i].state != TASK_STATE_SUSPENDED && ms % g_tasks[i].period_ms == 0)) {
+            g_tasks[i].state = TASK_STATE_IDLE;
+            g_tasks[i].run_task();
+        }
+    }
+}
+
+static void
+usage(char const * name)
+{
+    fprintf(stderr, "usage: %s [-t seconds] [-b backlash_deg] [-v volts] <script>\n", name);
+    exit(1);
+}
+
+int
+main(int argc, char * argv[])
+{
+    uint32_t run_ms = 10000;
+    uint32_t ms;
+    int next_line = 0;
+    double total_squared_error = 0.0;
+    double max_error = 0.0;
+    uint32_t settled_ms = 0;
+    clock_t wall_start = clock();
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:b:v:")) != -1) {
+        switch (opt) {
+        case 't':
+            run_ms = atof(optarg) * 1000;
+            break;
+        case 'b':
+            g_plant.backlash = atof(optarg);
+            break;
+        case 'v':
+            g_plant.supply = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || sim_load_script(argv[optind]) != 0) {
+        usage(argv[0]);
+    }
+
+    plant_set_encoder_pins(0);
+    motor_init();
+    interpolator_init();
+    encoder_set_edge_event(interpolator_service, SIM_EVENT_EDGES);
+
+    for (ms = 0; ms < run_ms; ms++) {
+        uint32_t us;
+        double error;
+
+        while (next_line < g_script_length && g_script[next_line].time_ms <= ms) {
+            if (sim_run_command(g_script[next_line].line) != 0) {
+                fprintf(stderr, "unknown command: %s\n", g_script[next_line].line);
+                return 1;
+            }
+            next_line++;
+        }
+        sim_run_tasks(ms);
+
+        for (us = 0; us < 1000; us += SIM_STEP_US) {
+            plant_step();
+            g_now_us += SIM_STEP_US;
+            if ((TIMSK3 & (1 << OCIE3A)) && g_now_us >= g_tc3_next_us) {
+                g_tc3_next_us += g_tc3_period_us;
+                /* the ISR is entered on time, which clears its flag */
+                TCNT3 = 0;
+                TIFR3 &= ~(1 << OCF3A);
+                TIMER3_COMPA_vect();
+            }
+        }
+
+        error = interpolator_get_absolute_target_position() - g_plant.output_angle;
+        total_squared_error += error * error;
+        if (fabs(error) > max_error) {
+            max_error = fabs(error);
+        }
+        if (fabs(error) > SIM_SETTLE_DEG) {
+            settled_ms = ms + 1;
+        }
+    }
+
+    printf("# simulated %.3f s in %.3f s\n", run_ms / 1000.0,
+        (double)(clock() - wall_start) / CLOCKS_PER_SEC);
+    printf("# output %.1f deg, target %ld deg\n", g_plant.output_angle,
+        (long)interpolator_get_absolute_target_position());
+    printf("# error from the target: rms %.1f deg, max %.1f deg\n",
+        sqrt(total_squared_error / run_ms), max_error);
+    printf("# within %d deg of the target from %u ms\n", SIM_SETTLE_DEG, settled_ms);
+    return 0;
+}
@@ -0,0 +1,471 @@
+/*
+ * Scheduler simulator
+ *
+ * Runs the real scheduler.c on the host against a simulated CPU, so a
+ * task mix or a period change can be tried out in seconds instead of on
+ * the board.  The simulation follows lab2.c:
+ *
+ *  - the 1ms tick ISR bumps ms_ticks, then calls scheduler_do_schedule()
+ *    and scheduler_preempt(); preemptive tasks nest inside it
+ *  - the main loop runs serial_check() (a fixed cost), posts any event
+ *    tasks that are due, then scheduler_service() and scheduler_idle()
+ *  - the encoder ISR, with -r, comes at a steady transition rate and
+ *    posts the tasks it is set up to (see encoder_set_edge_event())
+ *  - interrupts are only taken while a task (or the main loop) is running
+ *    or the CPU is asleep, and one that comes due while an ISR has
+ *    interrupts masked is taken as soon as they are re-enabled
+ *
+ * Each task "runs" for a time drawn from its execution time distribution
+ * and the clock is advanced by that much, taking interrupts along the
+ * way.  Nothing else on the target (serial interrupts, the time spent in
+ * the scheduler itself outside the ISR) is modelled.
+ *
+ * Usage: sched_sim [-e] [-t seconds] [-s seed] [-w bucket_us]
+ *                  [-i isr_us] [-l loop_us] [-r edges_per_s] <task file>
+ *
+ *   -e  use the phases in the file as given (lab2.c uses automatic phases)
+ *   -t  simulated run time (default 60s)
+ *   -s  random seed
+ *   -w  latency histogram bucket width (default 100us)
+ *   -i  tick ISR cost outside of any task (default 10us)
+ *   -l  main loop cost per pass (default 20us)
+ *   -r  encoder transitions per second (default 0: none)
+ *
+ * The task file has one task per line, in g_tasks order:
+ *
+ *   period priority phase sheddable exec post name...
+ *
+ * period, phase and post are in ms and exec is in us.  A period of 0 is
+ * an event task, which is posted from the main loop every `post` ms
+ * (0 = never).  A post of Ne instead has the encoder ISR post the task
+ * (event or periodic) every N transitions.  exec is
+ * either a fixed time or min/avg/max as printed by the "stats" command,
+ * and is sampled from a triangular distribution with that min, max and
+ * mean.  Lines starting with '#' are comments.  See lab2.tasks and
+ * encoder.tasks.
+ *
+ * The output is the target's own "stats" table followed by a release
+ * latency histogram for each task.  Latencies are measured as on the
+ * target (on the 16 bit profile clock) and so wrap after ~209ms.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "scheduler.h"
+#include "cli.h"
+#include "log.h"
+
+#define MIN(a, b)     ((a) < (b) ? (a) : (b))
+#define MAX(a, b)     ((a) > (b) ? (a) : (b))
+
+#define SIM_CYCLES_PER_MS     (F_CPU / 1000)
+#define SIM_CYCLES_PER_US     (F_CPU / 1000000)
+#define SIM_MAX_TASKS         (16)
+#define SIM_MAX_COMMANDS      (20)
+#define SIM_HISTOGRAM_BUCKETS (20)
+#define SIM_HISTOGRAM_WIDTH   (40)
+/* deeper tick nesting than this means the preemptive tasks alone need
+ * more than the whole CPU; the target would overflow its stack */
+#define SIM_MAX_ISR_NESTING   (8)
+/* the encoder ISR's cost, posting included */
+#define SIM_EDGE_ISR_US       (5)
+
+typedef struct {
+    /* execution time distribution (us) */
+    uint32_t exec_min_us;
+    uint32_t exec_mode_us;
+    uint32_t exec_max_us;
+    /* event tasks: post every post_ms (0 = never) */
+    uint16_t post_ms;
+    uint32_t next_post_ms;
+    /* or from the encoder ISR, every post_edges transitions (0 = never) */
+    uint16_t post_edges;
+    uint16_t edge_count;
+    /* release latency histogram; the last bucket catches everything over */
+    uint32_t histogram[SIM_HISTOGRAM_BUCKETS + 1];
+} sim_task_t;
+
+static task_t g_tasks[SIM_MAX_TASKS];
+static sim_task_t g_sim_tasks[SIM_MAX_TASKS];
+static char g_task_names[SIM_MAX_TASKS][32];
+static uint8_t g_number_tasks = 0;
+static timers_state_t g_timers_state;
+
+static cli_command_t g_commands[SIM_MAX_COMMANDS];
+static uint8_t g_number_commands = 0;
+
+/* simulated time in CPU cycles */
+static uint64_t g_now = 0;
+static uint64_t g_next_tick = SIM_CYCLES_PER_MS;
+/* the next encoder transition, and the time between them (0: none) */
+static uint64_t g_next_edge = UINT64_MAX;
+static uint64_t g_edge_cycles = 0;
+static uint8_t g_isr_nesting = 0;
+
+static uint32_t g_isr_cycles = 10 * SIM_CYCLES_PER_US;
+static uint32_t g_loop_cycles = 20 * SIM_CYCLES_PER_US;
+static uint32_t g_bucket_us = 100;
+static uint64_t g_rng = 88172645463325252ULL;
+
+/*
+ * Target hooks
+ */
+uint16_t
+timers_get_profile_ticks(void)
+{
+    return (uint16_t)(g_now / PROFILE_CLOCK_DIVISOR);
+}
+
+void
+cli_register(cli_command_t command)
+{
+    if (g_number_commands < SIM_MAX_COMMANDS) {
+        g_commands[g_number_commands++] = command;
+    }
+}
+
+static void sim_run(uint64_t cycles);
+
+/*
+ * The 1ms tick, as in lab2.c
+ */
+static void
+sim_isr(void)
+{
+    if (++g_isr_nesting > SIM_MAX_ISR_NESTING) {
+        fprintf(stderr, "tick ISR nested %d deep at %u ms: "
+                "preemptive tasks need more than the CPU\n",
+                SIM_MAX_ISR_NESTING, g_timers_state.ms_ticks);
+        exit(1);
+    }
+    g_now += g_isr_cycles;
+    g_next_tick += SIM_CYCLES_PER_MS;
+    g_timers_state.ms_ticks++;
+    scheduler_do_schedule();
+    scheduler_preempt();
+    g_isr_nesting--;
+}
+
+/*
+ * An encoder transition: post the tasks that have had their share of
+ * them, as encoder.c does (it does not call scheduler_preempt())
+ */
+static void
+sim_edge_isr(void)
+{
+    int i;
+    sim_task_t * sim;
+
+    g_now += SIM_EDGE_ISR_US * SIM_CYCLES_PER_US;
+    g_next_edge += g_edge_cycles;
+    for (i = 0; i < g_number_tasks; i++) {
+        sim = &g_sim_tasks[i];
+        if (sim->post_edges != 0 && ++sim->edge_count >= sim->post_edges) {
+            sim->edge_count = 0;
+            scheduler_post(g_tasks[i].run_task);
+        }
+    }
+}
+
+/*
+ * Execute for the given number of cycles with interrupts enabled,
+ * taking any interrupt that comes due (including one already pending)
+ */
+static void
+sim_run(uint64_t cycles)
+{
+    uint64_t step;
+    for (;;) {
+        if (g_now >= g_next_tick) {
+            sim_isr();
+            continue;
+        }
+        if (g_now >= g_next_edge) {
+            sim_edge_isr();
+            continue;
+        }
+        if (cycles == 0) {
+            break;
+        }
+        step = MIN(g_next_tick, g_next_edge) - g_now;
+        if (step > cycles) {
+            step = cycles;
+        }
+        g_now += step;
+        cycles -= step;
+    }
+}
+
+/*
+ * Called by scheduler_idle(); idle sleep lasts until the next interrupt
+ */
+void
+sim_sleep(void)
+{
+    uint64_t wake = MIN(g_next_tick, g_next_edge);
+    if (g_now < wake) {
+        g_now = wake;
+    }
+    sim_run(0);
+}
+
+static double
+sim_random(void)
+{
+    /* xorshift64* */
+    g_rng ^= g_rng >> 12;
+    g_rng ^= g_rng << 25;
+    g_rng ^= g_rng >> 27;
+    return (double)((g_rng * 2685821657736338717ULL) >> 11) / (double)(1ULL << 53);
+}
+
+/*
+ * Draw an execution time from a triangular distribution
+ */
+static uint32_t
+sim_exec_us(sim_task_t * sim)
+{
+    double a = sim->exec_min_us, c = sim->exec_mode_us, b = sim->exec_max_us;
+    double u = sim_random();
+    if (b <= a) {
+        return sim->exec_min_us;
+    }
+    if (u < (c - a) / (b - a)) {
+        return a + sqrt(u * (b - a) * (c - a));
+    }
+    return b - sqrt((1 - u) * (b - a) * (b - c));
+}
+
+/*
+ * Body of every simulated task
+ */
+static void
+sim_task_run(uint8_t index)
+{
+    task_t * task = &g_tasks[index];
+    sim_task_t * sim = &g_sim_tasks[index];
+    uint32_t latency_us = PROFILE_TICKS_TO_US(
+            (uint16_t)(timers_get_profile_ticks() - task->stats.release_ticks));
+    uint32_t bucket = latency_us / g_bucket_us;
+
+    sim->histogram[bucket < SIM_HISTOGRAM_BUCKETS ? bucket : SIM_HISTOGRAM_BUCKETS]++;
+    sim_run((uint64_t)sim_exec_us(sim) * SIM_CYCLES_PER_US);
+}
+
+/* the scheduler tells tasks apart by run_task, so each needs its own */
+#define SIM_TASK(n) static void sim_task_##n(void) { sim_task_run(n); }
+SIM_TASK(0) SIM_TASK(1) SIM_TASK(2) SIM_TASK(3)
+SIM_TASK(4) SIM_TASK(5) SIM_TASK(6) SIM_TASK(7)
+SIM_TASK(8) SIM_TASK(9) SIM_TASK(10) SIM_TASK(11)
+SIM_TASK(12) SIM_TASK(13) SIM_TASK(14) SIM_TASK(15)
+
+static void (* const g_task_functions[SIM_MAX_TASKS])(void) = {
+    sim_task_0, sim_task_1, sim_task_2, sim_task_3,
+    sim_task_4, sim_task_5, sim_task_6, sim_task_7,
+    sim_task_8, sim_task_9, sim_task_10, sim_task_11,
+    sim_task_12, sim_task_13, sim_task_14, sim_task_15
+};
+
+/*
+ * Read the task file into g_tasks
+ */
+static int
+sim_load_tasks(char const * const path)
+{
+    FILE * file;
+    char line[256];
+    char exec[64];
+    char post_spec[16];
+    char * name;
+    char unit;
+    unsigned int period, priority, phase, sheddable, post, min, avg, max;
+    int line_number = 0, name_offset;
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        name = line + strspn(line, " \t");
+        if (*name == '#' || *name == '\n' || *name == '\0') {
+            continue;
+        }
+        if (6 != sscanf(line, "%u %u %u %u %63s %15s %n", &period, &priority,
+                        &phase, &sheddable, exec, post_spec, &name_offset)) {
+            fprintf(stderr, "%s:%d: expected: period priority phase sheddable exec post name\n",
+                    path, line_number);
+            return -1;
+        }
+        if (g_number_tasks == SIM_MAX_TASKS) {
+            fprintf(stderr, "%s:%d: too many tasks (max %d)\n", path, line_number, SIM_MAX_TASKS);
+            return -1;
+        }
+        if (3 == sscanf(exec, "%u/%u/%u", &min, &avg, &max)) {
+            if (min > avg || avg > max) {
+                fprintf(stderr, "%s:%d: exec must be min/avg/max\n", path, line_number);
+                return -1;
+            }
+        } else if (1 == sscanf(exec, "%u", &min)) {
+            avg = max = min;
+        } else {
+            fprintf(stderr, "%s:%d: bad exec time '%s'\n", path, line_number, exec);
+            return -1;
+        }
+        unit = '\0';
+        if (sscanf(post_spec, "%u%c", &post, &unit) < 1 || (unit != '\0' && unit != 'e')) {
+            fprintf(stderr, "%s:%d: post must be ms or Ne (transitions)\n", path, line_number);
+            return -1;
+        }
+
+        name = line + name_offset;
+        name[strcspn(name, "\r\n")] = '\0';
+        snprintf(g_task_names[g_number_tasks], sizeof(g_task_names[0]), "%s", name);
+
+        /* a triangular distribution's mean is (min + mode + max) / 3 */
+        g_sim_tasks[g_number_tasks].exec_min_us = min;
+        g_sim_tasks[g_number_tasks].exec_max_us = max;
+        g_sim_tasks[g_number_tasks].exec_mode_us =
+                3 * avg < min + max ? min : MIN(3 * avg - min - max, max);
+        g_sim_tasks[g_number_tasks].post_ms = (unit == 'e') ? 0 : post;
+        g_sim_tasks[g_number_tasks].next_post_ms = post;
+        g_sim_tasks[g_number_tasks].post_edges = (unit == 'e') ? post : 0;
+
+        g_tasks[g_number_tasks] = (task_t){
+            g_task_names[g_number_tasks], period, g_task_functions[g_number_tasks],
+            priority, phase, sheddable != 0
+        };
+        g_number_tasks++;
+    }
+    fclose(file);
+    return 0;
+}
+
+/*
+ * Post event tasks that are due, as lab2.c does for the CLI when serial
+ * input arrives
+ */
+static void
+sim_post_events(void)
+{
+    int i;
+    sim_task_t * sim;
+    for (i = 0; i < g_number_tasks; i++) {
+        sim = &g_sim_tasks[i];
+        if (sim->post_ms != 0 && g_timers_state.ms_ticks >= sim->next_post_ms) {
+            scheduler_post(g_tasks[i].run_task);
+            sim->next_post_ms += sim->post_ms;
+        }
+    }
+}
+
+static void
+sim_run_command(char const * const command)
+{
+    int i;
+    for (i = 0; i < g_number_commands; i++) {
+        if (strcmp(g_commands[i].command, command) == 0) {
+            g_commands[i].handler(NULL);
+        }
+    }
+}
+
+static void
+sim_report(void)
+{
+    int i, bucket;
+    uint32_t count, peak;
+    sim_task_t * sim;
+
+    sim_run_command("stats");
+    printf("\n(mrg = releases lost because the previous one had not run yet)\n");
+
+    for (i = 0; i < g_number_tasks; i++) {
+        sim = &g_sim_tasks[i];
+        printf("\n%s: release latency\n", g_tasks[i].task_name);
+        peak = 0;
+        for (bucket = 0; bucket <= SIM_HISTOGRAM_BUCKETS; bucket++) {
+            peak = MAX(peak, sim->histogram[bucket]);
+        }
+        for (bucket = 0; bucket <= SIM_HISTOGRAM_BUCKETS; bucket++) {
+            count = sim->histogram[bucket];
+            if (count == 0) {
+                continue;
+            }
+            if (bucket < SIM_HISTOGRAM_BUCKETS) {
+                printf("  %6u-%-6u us %8u ", bucket * g_bucket_us,
+                       (bucket + 1) * g_bucket_us, count);
+            } else {
+                printf("  %6u+       us %8u ", bucket * g_bucket_us, count);
+            }
+            printf("%.*s\n", (int)((uint64_t)count * SIM_HISTOGRAM_WIDTH / peak),
+                   "########################################");
+        }
+    }
+}
+
+int
+main(int argc, char ** argv)
+{
+    int option;
+    uint32_t seconds = 60;
+    uint32_t edges_per_s;
+    scheduler_phase_mode_e phase_mode = SCHEDULER_PHASE_AUTO;
+
+    while ((option = getopt(argc, argv, "et:s:w:i:l:r:")) != -1) {
+        switch (option) {
+        case 'e':
+            phase_mode = SCHEDULER_PHASE_EXPLICIT;
+            break;
+        case 't':
+            seconds = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            g_rng = strtoull(optarg, NULL, 0) | 1;
+            break;
+        case 'w':
+            g_bucket_us = MAX(strtoul(optarg, NULL, 0), 1UL);
+            break;
+        case 'i':
+            g_isr_cycles = strtoul(optarg, NULL, 0) * SIM_CYCLES_PER_US;
+            break;
+        case 'l':
+            g_loop_cycles = strtoul(optarg, NULL, 0) * SIM_CYCLES_PER_US;
+            break;
+        case 'r':
+            edges_per_s = strtoul(optarg, NULL, 0);
+            g_edge_cycles = (edges_per_s == 0) ? 0 : F_CPU / edges_per_s;
+            g_next_edge = (edges_per_s == 0) ? UINT64_MAX : g_edge_cycles;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-e] [-t seconds] [-s seed] [-w bucket_us] "
+                    "[-i isr_us] [-l loop_us] [-r edges_per_s] <task file>\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [options] <task file>\n", argv[0]);
+        return 2;
+    }
+    if (sim_load_tasks(argv[optind]) != 0) {
+        return 1;
+    }
+    if (scheduler_init(&g_timers_state, g_tasks, g_number_tasks, phase_mode) != 0) {
+        fprintf(stderr, "scheduler_init failed\n");
+        return 1;
+    }
+
+    while (g_timers_state.ms_ticks < seconds * 1000) {
+        sim_run(g_loop_cycles);
+        sim_post_events();
+        scheduler_service();
+        scheduler_idle();
+    }
+
+    sim_report();
+    return 0;
+}
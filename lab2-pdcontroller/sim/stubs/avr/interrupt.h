@@ -0,0 +1,20 @@
+/*
+ * Host stand-in for <avr/interrupt.h> (see sim.c and plant.c)
+ *
+ * The simulators only deliver interrupts between tasks (or, in sim.c,
+ * while a task is "executing" or the CPU is asleep), so there is nothing
+ * for cli()/sei() to mask.
+ */
+#ifndef SIM_AVR_INTERRUPT_H_
+#define SIM_AVR_INTERRUPT_H_
+
+/* as on the target, the registers come along with it */
+#include <avr/io.h>
+
+#define sei() ((void)0)
+#define cli() ((void)0)
+
+/* an ISR is a plain function, which the plant simulator calls itself */
+#define ISR(vector) void vector(void)
+
+#endif /* SIM_AVR_INTERRUPT_H_ */
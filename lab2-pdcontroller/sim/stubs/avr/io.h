@@ -0,0 +1,99 @@
+/*
+ * Host stand-in for <avr/io.h> (see plant.c, timers_hal.c and pd_law.c)
+ *
+ * Only the registers and bits the control path and the timers use.  They
+ * are plain variables, defined by the program that uses them: plant.c
+ * reads OCR2B and PC6 to drive the motor model and sets PIND from the
+ * encoder model, timers_hal.c reads back what timers.c writes, and
+ * pd_law.c only gives motor.c somewhere to write.
+ */
+#ifndef SIM_AVR_IO_H_
+#define SIM_AVR_IO_H_
+
+#include <stdint.h>
+
+extern volatile uint8_t PORTC;
+extern volatile uint8_t DDRC;
+extern volatile uint8_t PORTD;
+extern volatile uint8_t DDRD;
+extern volatile uint8_t PIND;
+extern volatile uint8_t PCICR;
+extern volatile uint8_t PCIFR;
+extern volatile uint8_t PCMSK3;
+
+/* Timer/Counters 0 to 3 */
+extern volatile uint8_t TCCR0A;
+extern volatile uint8_t TCCR0B;
+extern volatile uint8_t TCNT0;
+extern volatile uint8_t OCR0A;
+extern volatile uint8_t OCR0B;
+extern volatile uint8_t TIMSK0;
+extern volatile uint8_t TIFR0;
+extern volatile uint8_t TCCR1A;
+extern volatile uint8_t TCCR1B;
+extern volatile uint16_t TCNT1;
+extern volatile uint16_t OCR1A;
+extern volatile uint16_t OCR1B;
+extern volatile uint16_t ICR1;
+extern volatile uint8_t TIMSK1;
+extern volatile uint8_t TIFR1;
+extern volatile uint8_t TCCR2A;
+extern volatile uint8_t TCCR2B;
+extern volatile uint8_t TCNT2;
+extern volatile uint8_t OCR2A;
+extern volatile uint8_t OCR2B;
+extern volatile uint8_t TIMSK2;
+extern volatile uint8_t TIFR2;
+extern volatile uint8_t TCCR3A;
+extern volatile uint8_t TCCR3B;
+extern volatile uint16_t TCNT3;
+extern volatile uint16_t OCR3A;
+extern volatile uint16_t OCR3B;
+extern volatile uint16_t ICR3;
+extern volatile uint8_t TIMSK3;
+extern volatile uint8_t TIFR3;
+
+#define PD0     (0)
+#define PD1     (1)
+#define PD6     (6)
+#define PC6     (6)
+#define PCINT24 (0)
+#define PCINT25 (1)
+#define PCIE3   (3)
+
+#define WGM00   (0)
+#define WGM01   (1)
+#define WGM02   (3)
+#define CS00    (0)
+#define CS01    (1)
+#define CS02    (2)
+#define OCF0A   (1)
+#define WGM10   (0)
+#define WGM11   (1)
+#define COM1B0  (4)
+#define COM1B1  (5)
+#define COM1A0  (6)
+#define COM1A1  (7)
+#define WGM12   (3)
+#define WGM13   (4)
+#define CS10    (0)
+#define CS11    (1)
+#define CS12    (2)
+#define ICES1   (6)
+#define ICNC1   (7)
+#define TOIE1   (0)
+#define OCIE1A  (1)
+#define ICIE1   (5)
+#define TOV1    (0)
+#define OCF1A   (1)
+#define ICF1    (5)
+#define CS20    (0)
+#define CS21    (1)
+#define CS22    (2)
+#define CS30    (0)
+#define CS31    (1)
+#define CS32    (2)
+#define OCIE3A  (1)
+#define OCF3A   (1)
+
+#endif /* SIM_AVR_IO_H_ */
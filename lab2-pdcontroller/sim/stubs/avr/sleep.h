@@ -0,0 +1,20 @@
+/*
+ * Host stand-in for <avr/sleep.h> (see sim.c)
+ *
+ * sleep_cpu() advances simulated time to the next interrupt (the tick or
+ * an encoder transition) and runs its ISR, which is what wakes the real
+ * CPU from idle sleep.
+ */
+#ifndef SIM_AVR_SLEEP_H_
+#define SIM_AVR_SLEEP_H_
+
+#define SLEEP_MODE_IDLE (0)
+
+void sim_sleep(void);
+
+#define set_sleep_mode(mode) ((void)(mode))
+#define sleep_enable() ((void)0)
+#define sleep_disable() ((void)0)
+#define sleep_cpu() sim_sleep()
+
+#endif /* SIM_AVR_SLEEP_H_ */
@@ -0,0 +1,11 @@
+/*
+ * Host stand-in for <pololu/orangutan.h> (see plant.c and pd_law.c)
+ *
+ * The control path only relies on it for <avr/io.h>.
+ */
+#ifndef SIM_POLOLU_ORANGUTAN_H_
+#define SIM_POLOLU_ORANGUTAN_H_
+
+#include <avr/io.h>
+
+#endif /* SIM_POLOLU_ORANGUTAN_H_ */
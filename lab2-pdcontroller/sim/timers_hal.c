@@ -0,0 +1,692 @@
+/*
+ * Timer HAL register test
+ *
+ * Runs timers.c on the host with plain variables for the timer
+ * registers, and checks what each call leaves in them against the
+ * datasheet: WGMn3:0 (tables 15-8 and 16-5, split over TCCRnA and
+ * TCCRnB), CSn2:0 (TC2 has its own prescaler steps), COMnx1:0, OCRnx and
+ * ICRn, the input capture bits and the interrupt masks.  The control
+ * registers are filled with ones first, so bits a call should leave
+ * alone are checked too.
+ *
+ *  - CTC: every period from 1us to past the longest each timer can do,
+ *    against a brute-force search of the prescaler/TOP pairs
+ *  - phase accumulated CTC, on a sample of periods, with the compare
+ *    matches run: the running total must stay within one count of the
+ *    target, and any prescaler's worth of periods after the first must
+ *    add up to it exactly
+ *  - PWM: every mode and TOP, on every timer, at a range of frequencies;
+ *    modes a timer does not have must be turned down, and the rest must
+ *    get as close to the frequency as any prescaler (and TOP) could
+ *  - outputs, duty cycles, normal mode, input capture and the overflow
+ *    interrupt
+ *
+ * Usage: timers_hal
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <avr/io.h>
+#include "log.h"
+#include "timers.h"
+
+volatile uint8_t TCCR0A;
+volatile uint8_t TCCR0B;
+volatile uint8_t TCNT0;
+volatile uint8_t OCR0A;
+volatile uint8_t OCR0B;
+volatile uint8_t TIMSK0;
+volatile uint8_t TIFR0;
+volatile uint8_t TCCR1A;
+volatile uint8_t TCCR1B;
+volatile uint16_t TCNT1;
+volatile uint16_t OCR1A;
+volatile uint16_t OCR1B;
+volatile uint16_t ICR1;
+volatile uint8_t TIMSK1;
+volatile uint8_t TIFR1;
+volatile uint8_t TCCR2A;
+volatile uint8_t TCCR2B;
+volatile uint8_t TCNT2;
+volatile uint8_t OCR2A;
+volatile uint8_t OCR2B;
+volatile uint8_t TIMSK2;
+volatile uint8_t TIFR2;
+volatile uint8_t TCCR3A;
+volatile uint8_t TCCR3B;
+volatile uint16_t TCNT3;
+volatile uint16_t OCR3A;
+volatile uint16_t OCR3B;
+volatile uint16_t ICR3;
+volatile uint8_t TIMSK3;
+volatile uint8_t TIFR3;
+
+/* a setup logs what it picked; thousands of them would drown the report */
+void log_message(log_level_e lvl, char * fmt, ...)
+{
+}
+
+/* register bits, as the datasheet has them */
+#define COMA_SHIFT   (6)
+#define COMB_SHIFT   (4)
+#define TCCRA_WGM    (0x03)
+#define TCCRB_WGM    (0x18)
+#define TCCRB_CS     (0x07)
+#define TCCRB_ICNC   (0x80)
+#define TCCRB_ICES   (0x40)
+#define TIMSK_ICIE   (0x20)
+#define TIMSK_TOIE   (0x01)
+#define TIFR_ICF     (0x20)
+
+/* mode, TOP and the WGMn3:0 that selects it */
+typedef struct {
+    timer_counter_mode_e mode;
+    timer_top_e top;
+    uint8_t wgm;
+} wgm_t;
+
+/* table 15-8 */
+static const wgm_t g_wgm_8_bit[] = {
+    {TIMER_MODE_NORMAL, TIMER_TOP_MAX, 0},
+    {TIMER_MODE_PHASE_CORRECT_PWM, TIMER_TOP_8_BIT, 1},
+    {TIMER_MODE_CTC, TIMER_TOP_OCRA, 2},
+    {TIMER_MODE_FAST_PWM, TIMER_TOP_8_BIT, 3},
+    {TIMER_MODE_PHASE_CORRECT_PWM, TIMER_TOP_OCRA, 5},
+    {TIMER_MODE_FAST_PWM, TIMER_TOP_OCRA, 7},
+};
+
+/* table 16-5, without the phase and frequency correct modes */
+static const wgm_t g_wgm_16_bit[] = {
+    {TIMER_MODE_NORMAL, TIMER_TOP_MAX, 0},
+    {TIMER_MODE_PHASE_CORRECT_PWM, TIMER_TOP_8_BIT, 1},
+    {TIMER_MODE_PHASE_CORRECT_PWM, TIMER_TOP_9_BIT, 2},
+    {TIMER_MODE_PHASE_CORRECT_PWM, TIMER_TOP_10_BIT, 3},
+    {TIMER_MODE_CTC, TIMER_TOP_OCRA, 4},
+    {TIMER_MODE_FAST_PWM, TIMER_TOP_8_BIT, 5},
+    {TIMER_MODE_FAST_PWM, TIMER_TOP_9_BIT, 6},
+    {TIMER_MODE_FAST_PWM, TIMER_TOP_10_BIT, 7},
+    {TIMER_MODE_PHASE_CORRECT_PWM, TIMER_TOP_ICR, 10},
+    {TIMER_MODE_PHASE_CORRECT_PWM, TIMER_TOP_OCRA, 11},
+    {TIMER_MODE_CTC, TIMER_TOP_ICR, 12},
+    {TIMER_MODE_FAST_PWM, TIMER_TOP_ICR, 14},
+    {TIMER_MODE_FAST_PWM, TIMER_TOP_OCRA, 15},
+};
+
+/* prescaler for each CSn2:0 (0: stopped or external clock) */
+static const uint16_t g_cs_0_1_3[8] = {0, 1, 8, 64, 256, 1024, 0, 0};
+static const uint16_t g_cs_2[8] = {0, 1, 8, 32, 64, 128, 256, 1024};
+
+typedef struct {
+    timer_counter_e id;
+    char const * name;
+    volatile uint8_t * tccra;
+    volatile uint8_t * tccrb;
+    volatile uint8_t * timsk;
+    volatile uint8_t * tifr;
+    /* the 8-bit timers' OCRnx, or the 16-bit ones' */
+    volatile uint8_t * ocra8;
+    volatile uint8_t * ocrb8;
+    volatile uint16_t * ocra16;
+    volatile uint16_t * ocrb16;
+    volatile uint16_t * icr;
+    uint16_t width;
+    const uint16_t * cs;
+    const wgm_t * wgm;
+    int number_wgm;
+} timer_regs_t;
+
+static const timer_regs_t g_timers[] = {
+    {TIMER_COUNTER0, "TC0", &TCCR0A, &TCCR0B, &TIMSK0, &TIFR0,
+        &OCR0A, &OCR0B, NULL, NULL, NULL, 0xFF, g_cs_0_1_3,
+        g_wgm_8_bit, sizeof(g_wgm_8_bit) / sizeof(g_wgm_8_bit[0])},
+    {TIMER_COUNTER1, "TC1", &TCCR1A, &TCCR1B, &TIMSK1, &TIFR1,
+        NULL, NULL, &OCR1A, &OCR1B, &ICR1, 0xFFFF, g_cs_0_1_3,
+        g_wgm_16_bit, sizeof(g_wgm_16_bit) / sizeof(g_wgm_16_bit[0])},
+    {TIMER_COUNTER2, "TC2", &TCCR2A, &TCCR2B, &TIMSK2, &TIFR2,
+        &OCR2A, &OCR2B, NULL, NULL, NULL, 0xFF, g_cs_2,
+        g_wgm_8_bit, sizeof(g_wgm_8_bit) / sizeof(g_wgm_8_bit[0])},
+    {TIMER_COUNTER3, "TC3", &TCCR3A, &TCCR3B, &TIMSK3, &TIFR3,
+        NULL, NULL, &OCR3A, &OCR3B, &ICR3, 0xFFFF, g_cs_0_1_3,
+        g_wgm_16_bit, sizeof(g_wgm_16_bit) / sizeof(g_wgm_16_bit[0])},
+};
+#define NUMBER_TIMERS (sizeof(g_timers) / sizeof(g_timers[0]))
+
+static int g_failures;
+
+/* count a failed check, and print the first few */
+#define CHECK(cond, args...) do { \
+    if (!(cond)) { \
+        if (g_failures++ < 20) { \
+            printf("  "); \
+            printf(args); \
+            printf("\n"); \
+        } \
+    } \
+} while (0)
+
+static uint16_t read_ocra(const timer_regs_t * t)
+{
+    return t->ocra16 != NULL ? *t->ocra16 : *t->ocra8;
+}
+
+static uint16_t read_ocrb(const timer_regs_t * t)
+{
+    return t->ocrb16 != NULL ? *t->ocrb16 : *t->ocrb8;
+}
+
+static void write_ocra(const timer_regs_t * t, uint16_t value)
+{
+    if (t->ocra16 != NULL) {
+        *t->ocra16 = value;
+    } else {
+        *t->ocra8 = (uint8_t)value;
+    }
+}
+
+static uint8_t read_wgm(const timer_regs_t * t)
+{
+    return (*t->tccra & TCCRA_WGM) | ((*t->tccrb & TCCRB_WGM) >> 1);
+}
+
+static uint16_t read_divisor(const timer_regs_t * t)
+{
+    return t->cs[*t->tccrb & TCCRB_CS];
+}
+
+/* WGMn3:0 for a mode and TOP (-1 if the timer does not have it) */
+static int expected_wgm(const timer_regs_t * t, timer_counter_mode_e mode, timer_top_e top)
+{
+    int i;
+    for (i = 0; i < t->number_wgm; i++) {
+        if (t->wgm[i].mode == mode && t->wgm[i].top == top) {
+            return t->wgm[i].wgm;
+        }
+    }
+    return -1;
+}
+
+/* fill the control registers with ones, so stray clears show up */
+static void dirty_registers(const timer_regs_t * t)
+{
+    *t->tccra = 0xFF;
+    *t->tccrb = 0xFF & ~(0x20);
+}
+
+/*
+ * Check that a setup left everything but WGMn3:0 and CSn2:0 alone
+ */
+static void check_kept(const timer_regs_t * t, char const * what)
+{
+    CHECK((*t->tccra & ~TCCRA_WGM) == (0xFF & ~TCCRA_WGM),
+            "%s %s: TCCRnA other bits 0x%02x", t->name, what, *t->tccra);
+    CHECK((*t->tccrb & (TCCRB_ICNC | TCCRB_ICES)) == (TCCRB_ICNC | TCCRB_ICES),
+            "%s %s: TCCRnB input capture bits 0x%02x", t->name, what, *t->tccrb);
+}
+
+/*
+ * CTC: every period, against the best any prescaler/TOP pair can do
+ */
+static void test_ctc(const timer_regs_t * t)
+{
+    uint32_t max_us = (uint32_t)(((uint64_t)t->width + 2) * 1024 / TIMERS_CYCLES_PER_US);
+    uint32_t us;
+    uint64_t target;
+    uint64_t counts;
+    uint64_t cycles;
+    int64_t best;
+    int64_t error;
+    int rc;
+    int cs;
+    int j;
+    int before = g_failures;
+    uint32_t set_up = 0;
+
+    for (us = 1; us <= max_us; us++) {
+        target = (uint64_t)us * TIMERS_CYCLES_PER_US;
+        best = -1;
+        for (cs = 1; cs < 8; cs++) {
+            if (t->cs[cs] == 0) {
+                continue;
+            }
+            for (j = 0; j < 2; j++) {
+                counts = target / t->cs[cs] + j;
+                if (counts < 1 || counts > (uint64_t)t->width + 1) {
+                    continue;
+                }
+                error = (int64_t)(counts * t->cs[cs]) - (int64_t)target;
+                error = error < 0 ? -error : error;
+                if (best < 0 || error < best) {
+                    best = error;
+                }
+            }
+        }
+
+        dirty_registers(t);
+        rc = timers_setup_timer(t->id, TIMER_MODE_CTC, us);
+        if (best < 0) {
+            CHECK(rc < 0, "%s CTC %luus: set up, but nothing fits", t->name,
+                    (unsigned long)us);
+            continue;
+        }
+        CHECK(rc == 0, "%s CTC %luus: turned down", t->name, (unsigned long)us);
+        if (rc != 0) {
+            continue;
+        }
+        set_up++;
+        CHECK(read_wgm(t) == expected_wgm(t, TIMER_MODE_CTC, TIMER_TOP_OCRA),
+                "%s CTC %luus: WGM %u", t->name, (unsigned long)us, read_wgm(t));
+        CHECK(read_divisor(t) != 0, "%s CTC %luus: CS %u", t->name,
+                (unsigned long)us, *t->tccrb & TCCRB_CS);
+        CHECK(read_ocra(t) == timers_get_top(t->id), "%s CTC %luus: OCRnA %u, TOP %u",
+                t->name, (unsigned long)us, read_ocra(t), timers_get_top(t->id));
+        check_kept(t, "CTC");
+        cycles = ((uint64_t)read_ocra(t) + 1) * read_divisor(t);
+        error = (int64_t)cycles - (int64_t)target;
+        error = error < 0 ? -error : error;
+        CHECK(error == best, "%s CTC %luus: /%u TOP %u is %lld cycles out, best %lld",
+                t->name, (unsigned long)us, read_divisor(t), read_ocra(t),
+                (long long)error, (long long)best);
+    }
+    printf("%s CTC: %lu periods set up (1us..%luus tried), %d failures\n",
+            t->name, (unsigned long)set_up, (unsigned long)max_us, g_failures - before);
+}
+
+/*
+ * Phase accumulated CTC, on every step_us-th period
+ */
+static void test_phase_accumulate(const timer_regs_t * t, uint32_t step_us)
+{
+    uint32_t max_us = (uint32_t)(((uint64_t)t->width + 2) * 1024 / TIMERS_CYCLES_PER_US);
+    uint32_t us;
+    uint32_t period;
+    uint64_t target;
+    uint64_t length;
+    uint64_t total;
+    uint64_t window;
+    int64_t drift;
+    int64_t worst_drift = 0;
+    uint16_t divisor;
+    int before = g_failures;
+    int checked = 0;
+
+    for (us = 1; us <= max_us; us += step_us) {
+        target = (uint64_t)us * TIMERS_CYCLES_PER_US;
+        if (timers_setup_timer(t->id, TIMER_MODE_CTC_PHASE_ACCUMULATE, us) != 0) {
+            continue;
+        }
+        checked++;
+        divisor = read_divisor(t);
+        total = 0;
+        window = 0;
+        /* each period is OCRnA + 1 counts as the match that ends it sees */
+        for (period = 1; period <= 2 * (uint32_t)divisor + 1; period++) {
+            length = ((uint64_t)read_ocra(t) + 1) * divisor;
+            total += length;
+            if (period >= 2 && period <= (uint32_t)divisor + 1) {
+                window += length;
+            }
+            timers_phase_accumulate(t->id);
+            drift = (int64_t)total - (int64_t)(period * target);
+            drift = drift < 0 ? -drift : drift;
+            if (drift > worst_drift) {
+                worst_drift = drift;
+            }
+            if (drift >= divisor) {
+                CHECK(false, "%s phase accumulate %luus: %lld cycles out after %lu periods",
+                        t->name, (unsigned long)us, (long long)drift,
+                        (unsigned long)period);
+                break;
+            }
+        }
+        CHECK(period <= 2 * (uint32_t)divisor + 1 || window == divisor * target,
+                "%s phase accumulate %luus: %u periods took %llu cycles, not %llu",
+                t->name, (unsigned long)us, divisor, (unsigned long long)window,
+                (unsigned long long)(divisor * target));
+    }
+    printf("%s phase accumulate: %d periods sampled, worst running error %lld cycles, "
+            "%d failures\n", t->name, checked, (long long)worst_drift,
+            g_failures - before);
+}
+
+/* period in CPU cycles for a PWM setting */
+static uint64_t pwm_cycles(timer_counter_mode_e mode, uint16_t divisor, uint16_t top)
+{
+    if (mode == TIMER_MODE_FAST_PWM) {
+        return (uint64_t)divisor * (top + 1UL);
+    }
+    return 2ULL * divisor * top;
+}
+
+/* TOP of a fixed TOP (0 for OCRnA and ICRn) */
+static uint16_t fixed_top(const timer_regs_t * t, timer_top_e top)
+{
+    switch (top) {
+    case TIMER_TOP_MAX:
+        return t->width;
+    case TIMER_TOP_8_BIT:
+        return 0xFF;
+    case TIMER_TOP_9_BIT:
+        return 0x1FF;
+    case TIMER_TOP_10_BIT:
+        return 0x3FF;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Closest any setting of a PWM mode can get to a period (in CPU cycles),
+ * or -1 if none fits
+ */
+static int64_t best_pwm_error(const timer_regs_t * t, timer_counter_mode_e mode,
+        timer_top_e top, uint64_t target)
+{
+    bool fast = (mode == TIMER_MODE_FAST_PWM);
+    int64_t best = -1;
+    int64_t error;
+    uint64_t steps;
+    uint64_t n;
+    uint64_t lowest;
+    uint64_t highest;
+    int cs;
+    int j;
+
+    for (cs = 1; cs < 8; cs++) {
+        if (t->cs[cs] == 0) {
+            continue;
+        }
+        if (fixed_top(t, top) != 0) {
+            error = (int64_t)pwm_cycles(mode, t->cs[cs], fixed_top(t, top)) - (int64_t)target;
+            error = error < 0 ? -error : error;
+            if (best < 0 || error < best) {
+                best = error;
+            }
+            continue;
+        }
+        /* the period is n steps: TOP + 1 for fast PWM, TOP for phase
+         * correct (where a step is two counts) */
+        steps = fast ? t->cs[cs] : 2ULL * t->cs[cs];
+        lowest = 1;
+        highest = fast ? (uint64_t)t->width + 1 : t->width;
+        for (j = 0; j < 2; j++) {
+            n = target / steps + j;
+            if (n < lowest || n > highest) {
+                continue;
+            }
+            error = (int64_t)(n * steps) - (int64_t)target;
+            error = error < 0 ? -error : error;
+            if (best < 0 || error < best) {
+                best = error;
+            }
+        }
+    }
+    return best;
+}
+
+/*
+ * PWM: every mode and TOP, at a range of frequencies
+ */
+static void test_pwm(const timer_regs_t * t)
+{
+    static const timer_counter_mode_e modes[] = {
+        TIMER_MODE_FAST_PWM, TIMER_MODE_PHASE_CORRECT_PWM
+    };
+    static const timer_top_e tops[] = {
+        TIMER_TOP_MAX, TIMER_TOP_8_BIT, TIMER_TOP_9_BIT, TIMER_TOP_10_BIT,
+        TIMER_TOP_OCRA, TIMER_TOP_ICR
+    };
+    static const uint32_t frequencies[] = {
+        1, 10, 50, 100, 490, 1000, 4000, 10000, 19531, 20000, 31250, 40000,
+        78125, 100000, 500000, 1000000, 5000000, 10000000, 10000001
+    };
+    int before = g_failures;
+    int set_up = 0;
+    int m;
+    int k;
+    int f;
+    int wgm;
+    int rc;
+    uint64_t target;
+    uint64_t cycles;
+    int64_t best;
+    int64_t error;
+    uint16_t top;
+
+    for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        for (k = 0; k < sizeof(tops) / sizeof(tops[0]); k++) {
+            wgm = expected_wgm(t, modes[m], tops[k]);
+            for (f = 0; f < sizeof(frequencies) / sizeof(frequencies[0]); f++) {
+                target = (F_CPU + frequencies[f] / 2) / frequencies[f];
+                dirty_registers(t);
+                write_ocra(t, 0x1234 & t->width);
+                if (t->icr != NULL) {
+                    *t->icr = 0x4321;
+                }
+                rc = timers_setup_pwm(t->id, modes[m], tops[k], frequencies[f]);
+                if (wgm < 0 || frequencies[f] > F_CPU / 2) {
+                    CHECK(rc < 0, "%s PWM mode %d TOP %d %luHz: set up, but no such mode",
+                            t->name, modes[m], tops[k], (unsigned long)frequencies[f]);
+                    continue;
+                }
+                best = best_pwm_error(t, modes[m], tops[k], target);
+                if (best < 0) {
+                    CHECK(rc < 0, "%s PWM mode %d TOP %d %luHz: set up, but nothing fits",
+                            t->name, modes[m], tops[k], (unsigned long)frequencies[f]);
+                    continue;
+                }
+                CHECK(rc == 0, "%s PWM mode %d TOP %d %luHz: turned down",
+                        t->name, modes[m], tops[k], (unsigned long)frequencies[f]);
+                if (rc != 0) {
+                    continue;
+                }
+                set_up++;
+                CHECK(read_wgm(t) == wgm, "%s PWM mode %d TOP %d: WGM %u, not %d",
+                        t->name, modes[m], tops[k], read_wgm(t), wgm);
+                check_kept(t, "PWM");
+
+                top = timers_get_top(t->id);
+                if (tops[k] == TIMER_TOP_OCRA) {
+                    CHECK(read_ocra(t) == top, "%s PWM TOP OCRnA: OCRnA %u, TOP %u",
+                            t->name, read_ocra(t), top);
+                } else {
+                    CHECK(read_ocra(t) == (0x1234 & t->width),
+                            "%s PWM TOP %d: OCRnA changed", t->name, tops[k]);
+                }
+                if (tops[k] == TIMER_TOP_ICR) {
+                    CHECK(*t->icr == top, "%s PWM TOP ICRn: ICRn %u, TOP %u",
+                            t->name, *t->icr, top);
+                } else if (t->icr != NULL) {
+                    CHECK(*t->icr == 0x4321, "%s PWM TOP %d: ICRn changed",
+                            t->name, tops[k]);
+                }
+                if (fixed_top(t, tops[k]) != 0) {
+                    CHECK(top == fixed_top(t, tops[k]), "%s PWM TOP %d: TOP %u",
+                            t->name, tops[k], top);
+                }
+
+                cycles = pwm_cycles(modes[m], read_divisor(t), top);
+                error = (int64_t)cycles - (int64_t)target;
+                error = error < 0 ? -error : error;
+                CHECK(read_divisor(t) != 0 && error == best,
+                        "%s PWM mode %d TOP %d %luHz: /%u TOP %u is %lld cycles out, best %lld",
+                        t->name, modes[m], tops[k], (unsigned long)frequencies[f],
+                        read_divisor(t), top, (long long)error, (long long)best);
+            }
+        }
+    }
+    /* not a PWM mode */
+    CHECK(timers_setup_pwm(t->id, TIMER_MODE_CTC, TIMER_TOP_OCRA, 1000) < 0,
+            "%s PWM: CTC set up as PWM", t->name);
+    printf("%s PWM: %d mode/TOP/frequency settings set up, %d failures\n",
+            t->name, set_up, g_failures - before);
+}
+
+/*
+ * COMnx1:0 for each output on each channel, and duty cycles
+ */
+static void test_outputs(const timer_regs_t * t)
+{
+    static const uint8_t com[] = {
+        [TIMER_OUTPUT_DISCONNECTED] = 0,
+        [TIMER_OUTPUT_TOGGLE] = 1,
+        [TIMER_OUTPUT_NON_INVERTING] = 2,
+        [TIMER_OUTPUT_INVERTING] = 3
+    };
+    int before = g_failures;
+    int channel;
+    int output;
+    uint8_t shift;
+    uint8_t other;
+    uint16_t top;
+
+    for (channel = TIMER_CHANNEL_A; channel <= TIMER_CHANNEL_B; channel++) {
+        shift = (channel == TIMER_CHANNEL_A) ? COMA_SHIFT : COMB_SHIFT;
+        for (output = TIMER_OUTPUT_DISCONNECTED; output <= TIMER_OUTPUT_INVERTING; output++) {
+            *t->tccra = 0x5A;
+            other = 0x5A & ~(0x03 << shift);
+            timers_set_output(t->id, channel, output);
+            CHECK(((*t->tccra >> shift) & 0x03) == com[output],
+                    "%s output %c %d: COM 0x%02x", t->name, 'A' + channel, output,
+                    *t->tccra);
+            CHECK((*t->tccra & ~(0x03 << shift)) == other,
+                    "%s output %c %d: other bits 0x%02x", t->name, 'A' + channel,
+                    output, *t->tccra);
+        }
+    }
+
+    /* duty is capped at TOP; channel A is left alone while it is TOP */
+    timers_setup_pwm(t->id, TIMER_MODE_FAST_PWM, TIMER_TOP_8_BIT, 10000);
+    timers_set_duty(t->id, TIMER_CHANNEL_B, 100);
+    CHECK(read_ocrb(t) == 100, "%s duty B 100: OCRnB %u", t->name, read_ocrb(t));
+    timers_set_duty(t->id, TIMER_CHANNEL_B, 300);
+    CHECK(read_ocrb(t) == 255, "%s duty B 300: OCRnB %u", t->name, read_ocrb(t));
+    timers_set_duty(t->id, TIMER_CHANNEL_A, 7);
+    CHECK(read_ocra(t) == 7, "%s duty A 7: OCRnA %u", t->name, read_ocra(t));
+    timers_setup_pwm(t->id, TIMER_MODE_FAST_PWM, TIMER_TOP_OCRA, 10000);
+    top = timers_get_top(t->id);
+    timers_set_duty(t->id, TIMER_CHANNEL_A, 7);
+    CHECK(read_ocra(t) == top, "%s duty A with OCRnA TOP: OCRnA %u, TOP %u",
+            t->name, read_ocra(t), top);
+    printf("%s outputs and duty: %d failures\n", t->name, g_failures - before);
+}
+
+/*
+ * Normal mode at each prescaler the timer has (and one it does not)
+ */
+static void test_normal(const timer_regs_t * t)
+{
+    int before = g_failures;
+    int cs;
+
+    for (cs = 1; cs < 8; cs++) {
+        if (t->cs[cs] == 0) {
+            continue;
+        }
+        dirty_registers(t);
+        CHECK(timers_setup_normal(t->id, t->cs[cs]) == 0, "%s normal /%u: turned down",
+                t->name, t->cs[cs]);
+        CHECK(read_wgm(t) == 0, "%s normal /%u: WGM %u", t->name, t->cs[cs], read_wgm(t));
+        CHECK((*t->tccrb & TCCRB_CS) == cs, "%s normal /%u: CS %u", t->name, t->cs[cs],
+                *t->tccrb & TCCRB_CS);
+        CHECK(timers_get_top(t->id) == t->width, "%s normal: TOP %u", t->name,
+                timers_get_top(t->id));
+        check_kept(t, "normal");
+    }
+    CHECK(timers_setup_normal(t->id, 2) < 0, "%s normal /2: set up", t->name);
+    if (t->cs == g_cs_0_1_3) {
+        CHECK(timers_setup_normal(t->id, 32) < 0, "%s normal /32: set up", t->name);
+    }
+    printf("%s normal: %d failures\n", t->name, g_failures - before);
+}
+
+/*
+ * Input capture and the overflow interrupt
+ */
+static void test_interrupts(const timer_regs_t * t)
+{
+    int before = g_failures;
+    int rc;
+    int edge;
+    int noise;
+    int interrupt;
+    uint8_t tccrb;
+
+    for (edge = TIMER_CAPTURE_FALLING; edge <= TIMER_CAPTURE_RISING; edge++) {
+        for (noise = 0; noise < 2; noise++) {
+            for (interrupt = 0; interrupt < 2; interrupt++) {
+                timers_setup_normal(t->id, 8);
+                tccrb = *t->tccrb = (*t->tccrb & ~(TCCRB_ICNC | TCCRB_ICES)) |
+                    (noise ? 0 : TCCRB_ICNC) | (edge ? 0 : TCCRB_ICES);
+                *t->timsk = interrupt ? 0xDF : 0xFF;
+                *t->tifr = 0;
+                rc = timers_setup_input_capture(t->id, edge, noise, interrupt);
+                if (t->icr == NULL) {
+                    CHECK(rc < 0, "%s input capture: set up, but there is no ICRn", t->name);
+                    continue;
+                }
+                CHECK(rc == 0, "%s input capture: turned down", t->name);
+                CHECK((*t->tccrb & ~(TCCRB_ICNC | TCCRB_ICES)) ==
+                        (tccrb & ~(TCCRB_ICNC | TCCRB_ICES)),
+                        "%s input capture: TCCRnB 0x%02x", t->name, *t->tccrb);
+                CHECK(!!(*t->tccrb & TCCRB_ICES) == edge,
+                        "%s input capture edge %d: ICES %d", t->name, edge,
+                        !!(*t->tccrb & TCCRB_ICES));
+                CHECK(!!(*t->tccrb & TCCRB_ICNC) == noise,
+                        "%s input capture noise canceler %d: ICNC %d", t->name, noise,
+                        !!(*t->tccrb & TCCRB_ICNC));
+                CHECK(*t->timsk == (interrupt ? 0xFF : 0xDF),
+                        "%s input capture interrupt %d: TIMSKn 0x%02x", t->name,
+                        interrupt, *t->timsk);
+                /* the flag is cleared by writing a one to it, and only it */
+                CHECK(*t->tifr == TIFR_ICF, "%s input capture: TIFRn written 0x%02x",
+                        t->name, *t->tifr);
+            }
+        }
+    }
+    if (t->icr != NULL) {
+        timers_setup_pwm(t->id, TIMER_MODE_FAST_PWM, TIMER_TOP_ICR, 1000);
+        CHECK(timers_setup_input_capture(t->id, TIMER_CAPTURE_RISING, false, false) < 0,
+                "%s input capture: set up while ICRn is TOP", t->name);
+        *t->icr = 0xBEEF;
+        CHECK(timers_get_capture(t->id) == 0xBEEF, "%s capture: read %u", t->name,
+                timers_get_capture(t->id));
+    }
+
+    *t->timsk = 0xFE;
+    timers_set_overflow_interrupt(t->id, true);
+    CHECK(*t->timsk == 0xFF, "%s overflow on: TIMSKn 0x%02x", t->name, *t->timsk);
+    timers_set_overflow_interrupt(t->id, false);
+    CHECK(*t->timsk == (0xFF & ~TIMSK_TOIE), "%s overflow off: TIMSKn 0x%02x",
+            t->name, *t->timsk);
+    printf("%s input capture and overflow: %d failures\n", t->name, g_failures - before);
+}
+
+int main(int argc, char * argv[])
+{
+    int i;
+    int before;
+
+    for (i = 0; i < NUMBER_TIMERS; i++) {
+        test_ctc(&g_timers[i]);
+        test_phase_accumulate(&g_timers[i], 997);
+        test_pwm(&g_timers[i]);
+        test_outputs(&g_timers[i]);
+        test_normal(&g_timers[i]);
+        test_interrupts(&g_timers[i]);
+    }
+
+    /* the profile clock is TC1 counting freely at PROFILE_CLOCK_DIVISOR */
+    before = g_failures;
+    dirty_registers(&g_timers[1]);
+    TCNT1 = 1234;
+    timers_init_profile_clock();
+    CHECK(read_wgm(&g_timers[1]) == 0, "profile clock: WGM %u", read_wgm(&g_timers[1]));
+    CHECK(read_divisor(&g_timers[1]) == PROFILE_CLOCK_DIVISOR, "profile clock: /%u",
+            read_divisor(&g_timers[1]));
+    CHECK(TCNT1 == 0, "profile clock: TCNT1 %u", TCNT1);
+    printf("profile clock: %d failures\n", g_failures - before);
+
+    printf("%s\n", g_failures == 0 ? "PASS" : "FAIL");
+    return g_failures == 0 ? 0 : 1;
+}
@@ -3,6 +3,7 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 #include "log.h"
 #include "timers.h"
 #include "scheduler.h"
@@ -12,71 +13,28 @@
 #define WIDTH_16_BITS (0xFFFF)
 #define MS_TO_uS(x)   (x * 1000UL)
 
-#define TC0_DIVIDER_MASK (1 << CS02 | 1 << CS01 | 1 << CS00)
-#define TC1_DIVIDER_MASK (1 << CS12 | 1 << CS11 | 1 << CS10)
-#define TC3_DIVIDER_MASK (1 << CS32 | 1 << CS31 | 1 << CS30)
-
-typedef void (*set_mode_t)(timer_counter_mode_e mode);
-typedef void (*set_divider_t)(uint8_t divider);
-typedef void (*set_top_t)(uint16_t top);
-
 /*
- * TC0 Setters
+ * Control register bits.  These sit in the same place on all four
+ * timers (the reserved bits on the 8-bit ones are written as 0), so
+ * TC1's names are used for all of them.
  */
-static void tc0_set_mode(timer_counter_mode_e mode) {
-    if (mode == TIMER_MODE_CTC) {
-        TCCR0A &= ~(1 << WGM01 | 1 << WGM02);
-        TCCR0B &= ~(1 << WGM02);
-        TCCR0A |= (1 << WGM01);
-    }
-}
-static void tc0_set_divider(uint8_t divider) {
-    TCCR0B &= ~(TC0_DIVIDER_MASK);
-    TCCR0B |= (divider & TC0_DIVIDER_MASK);
-}
-static void tc0_set_top(uint16_t top) {
-    OCR0A = (uint8_t)top;
-}
-
-/*
- * TC1 Setters
- */
-static void tc1_set_mode(timer_counter_mode_e mode) {
-    if (mode == TIMER_MODE_CTC) {
-        TCCR1A &= ~(1 << WGM10 | 1 << WGM11);
-        TCCR1B |= (1 << WGM12);
-    }
-}
-static void tc1_set_divider(uint8_t divider) {
-    TCCR1B &= ~(TC1_DIVIDER_MASK);
-    TCCR1B |= (divider & TC1_DIVIDER_MASK);
-}
-static void tc1_set_top(uint16_t top) {
-    OCR1A = top;
-}
-
-/*
- * TC3 Setters
- */
-static void tc3_set_mode(timer_counter_mode_e mode) {
-    if (mode == TIMER_MODE_CTC) {
-        TCCR3A &= ~(1 << WGM30 | 1 << WGM31);
-        TCCR3B |= (1 << WGM32);
-    }
-}
-static void tc3_set_divider(uint8_t divider) {
-    TCCR3B &= ~(TC3_DIVIDER_MASK);
-    TCCR3B |= (divider & TC3_DIVIDER_MASK);
-}
-static void tc3_set_top(uint16_t top) {
-    OCR3A = top;
-}
+#define TCCRA_WGM_MASK    (1 << WGM11 | 1 << WGM10)
+#define TCCRB_WGM_MASK    (1 << WGM13 | 1 << WGM12)
+#define TCCRB_WGM_SHIFT   (WGM12 - 2)
+#define TCCRB_CS_MASK     (1 << CS12 | 1 << CS11 | 1 << CS10)
+#define TCCRA_COMA_SHIFT  (COM1A0)
+#define TCCRA_COMB_SHIFT  (COM1B0)
+#define TCCRA_COM_MASK    (0x03)
 
 
 typedef struct {
     bool match_found;
     uint32_t top_value;
-    uint32_t delta_us;
+    /* how far the achieved period is from the target */
+    uint32_t error_ppm;
+    /* TIMER_MODE_CTC_PHASE_ACCUMULATE: cycles per period beyond TOP + 1
+     * counts, made up by running some periods one count long */
+    uint16_t phase_step;
 } timer_counter_search_result_t;
 
 typedef struct {
@@ -84,30 +42,85 @@ typedef struct {
     uint8_t clock_select_flags;
 } clock_divider_value_t;
 
+/*
+ * A waveform generation mode: the mode and TOP it gives, and the
+ * WGMn3:0 value that selects it
+ */
 typedef struct {
     timer_counter_mode_e mode;
+    timer_top_e top;
     uint8_t mode_flags;
 } clock_mode_t;
 
+/* Datasheet table 15-8 (8-bit TC0 and TC2) */
+static const clock_mode_t g_modes_8_bit[] = {
+    {TIMER_MODE_NORMAL, TIMER_TOP_MAX, 0},
+    {TIMER_MODE_PHASE_CORRECT_PWM, TIMER_TOP_8_BIT, 1},
+    {TIMER_MODE_CTC, TIMER_TOP_OCRA, 2},
+    {TIMER_MODE_FAST_PWM, TIMER_TOP_8_BIT, 3},
+    {TIMER_MODE_PHASE_CORRECT_PWM, TIMER_TOP_OCRA, 5},
+    {TIMER_MODE_FAST_PWM, TIMER_TOP_OCRA, 7},
+};
+
+/* Datasheet table 16-5 (16-bit TC1 and TC3; phase and frequency
+ * correct modes 8 and 9 are left out) */
+static const clock_mode_t g_modes_16_bit[] = {
+    {TIMER_MODE_NORMAL, TIMER_TOP_MAX, 0},
+    {TIMER_MODE_PHASE_CORRECT_PWM, TIMER_TOP_8_BIT, 1},
+    {TIMER_MODE_PHASE_CORRECT_PWM, TIMER_TOP_9_BIT, 2},
+    {TIMER_MODE_PHASE_CORRECT_PWM, TIMER_TOP_10_BIT, 3},
+    {TIMER_MODE_CTC, TIMER_TOP_OCRA, 4},
+    {TIMER_MODE_FAST_PWM, TIMER_TOP_8_BIT, 5},
+    {TIMER_MODE_FAST_PWM, TIMER_TOP_9_BIT, 6},
+    {TIMER_MODE_FAST_PWM, TIMER_TOP_10_BIT, 7},
+    {TIMER_MODE_PHASE_CORRECT_PWM, TIMER_TOP_ICR, 10},
+    {TIMER_MODE_PHASE_CORRECT_PWM, TIMER_TOP_OCRA, 11},
+    {TIMER_MODE_CTC, TIMER_TOP_ICR, 12},
+    {TIMER_MODE_FAST_PWM, TIMER_TOP_ICR, 14},
+    {TIMER_MODE_FAST_PWM, TIMER_TOP_OCRA, 15},
+};
+
+/*
+ * A timer's registers.  The 16-bit ones (and ICRn, which the 8-bit
+ * timers do not have) are cast to the address of their low byte;
+ * timers_write_register() knows which is which from the width.
+ */
 typedef struct {
-    set_top_t set_top;
-    uint16_t width;
-} top_info_t;
+    volatile uint8_t * tccra;
+    volatile uint8_t * tccrb;
+    volatile uint8_t * timsk;
+    volatile uint8_t * tifr;
+    volatile uint8_t * ocra;
+    volatile uint8_t * ocrb;
+    volatile uint8_t * icr;
+} timer_registers_t;
 
 typedef struct {
     timer_counter_e id;
     char * name;
-    set_divider_t set_divider;
-    clock_divider_value_t divisors[5];
-    set_mode_t set_mode;
-    top_info_t top_info;
+    timer_registers_t regs;
+    uint16_t width;
+    clock_divider_value_t divisors[7];
+    uint8_t number_divisors;
+    const clock_mode_t * modes;
+    uint8_t number_modes;
+    /* where TOP comes from, and its value, as last set up */
+    timer_top_e top_source;
+    uint16_t top;
+    /* phase accumulator state (TIMER_MODE_CTC_PHASE_ACCUMULATE) */
+    volatile bool phase_accumulate;
+    uint16_t phase_top;
+    uint16_t phase_divisor;
+    uint16_t phase_step;
+    uint16_t phase;
 } timer_counter_t;
 
 /* 8-bit Timer/Counter0 */
 static timer_counter_t tc0 = {
     .id = TIMER_COUNTER0,
     .name = "TIMER_COUNTER0",
-    .set_divider = tc0_set_divider,
+    .regs = {&TCCR0A, &TCCR0B, &TIMSK0, &TIFR0, &OCR0A, &OCR0B, NULL},
+    .width = WIDTH_8_BITS,
     .divisors = {
          {1, (1 << CS00)},
          {8, (1 << CS01)},
@@ -115,18 +128,19 @@ static timer_counter_t tc0 = {
          {256, (1 << CS02)},
          {1024, (1 << CS02 | 1 << CS00)},
     },
-    .set_mode = tc0_set_mode,
-    .top_info = {
-        .set_top = tc0_set_top,
-        .width = WIDTH_8_BITS
-    }
+    .number_divisors = 5,
+    .modes = g_modes_8_bit,
+    .number_modes = COUNT_OF(g_modes_8_bit)
 };
 
 /* 16-bit Timer/Counter1 */
 static timer_counter_t tc1 = {
     .id = TIMER_COUNTER1,
     .name = "TIMER_COUNTER1",
-    .set_divider = tc1_set_divider,
+    .regs = {&TCCR1A, &TCCR1B, &TIMSK1, &TIFR1,
+             (volatile uint8_t *)&OCR1A, (volatile uint8_t *)&OCR1B,
+             (volatile uint8_t *)&ICR1},
+    .width = WIDTH_16_BITS,
     .divisors = {
         {1, (1 << CS10)},
         {8, (1 << CS11)},
@@ -134,18 +148,39 @@ static timer_counter_t tc1 = {
         {256, (1 << CS12)},
         {1024, (1 << CS12 | 1 << CS10)},
     },
-    .set_mode = tc1_set_mode,
-    .top_info = {
-        .set_top = tc1_set_top,
-        .width = WIDTH_16_BITS
-    }
+    .number_divisors = 5,
+    .modes = g_modes_16_bit,
+    .number_modes = COUNT_OF(g_modes_16_bit)
+};
+
+/* 8-bit Timer/Counter2 (a prescaler of its own, with more steps) */
+static timer_counter_t tc2 = {
+    .id = TIMER_COUNTER2,
+    .name = "TIMER_COUNTER2",
+    .regs = {&TCCR2A, &TCCR2B, &TIMSK2, &TIFR2, &OCR2A, &OCR2B, NULL},
+    .width = WIDTH_8_BITS,
+    .divisors = {
+        {1, (1 << CS20)},
+        {8, (1 << CS21)},
+        {32, (1 << CS21 | 1 << CS20)},
+        {64, (1 << CS22)},
+        {128, (1 << CS22 | 1 << CS20)},
+        {256, (1 << CS22 | 1 << CS21)},
+        {1024, (1 << CS22 | 1 << CS21 | 1 << CS20)},
+    },
+    .number_divisors = 7,
+    .modes = g_modes_8_bit,
+    .number_modes = COUNT_OF(g_modes_8_bit)
 };
 
 /* 16-bit Timer/Counter3 */
 static timer_counter_t tc3 = {
     .id = TIMER_COUNTER3,
     .name = "TIMER_COUNTER3",
-    .set_divider = tc3_set_divider,
+    .regs = {&TCCR3A, &TCCR3B, &TIMSK3, &TIFR3,
+             (volatile uint8_t *)&OCR3A, (volatile uint8_t *)&OCR3B,
+             (volatile uint8_t *)&ICR3},
+    .width = WIDTH_16_BITS,
     .divisors = {
         {1, (1 << CS30)},
         {8, (1 << CS31)},
@@ -153,36 +188,163 @@ static timer_counter_t tc3 = {
         {256, (1 << CS32)},
         {1024, (1 << CS32 | 1 << CS30)},
     },
-    .set_mode = tc3_set_mode,
-    .top_info = {
-        .set_top = tc3_set_top,
-        .width = WIDTH_16_BITS
-    }
+    .number_divisors = 5,
+    .modes = g_modes_16_bit,
+    .number_modes = COUNT_OF(g_modes_16_bit)
 };
 
-static timer_counter_t * timer_counters[] = {&tc0, &tc1, &tc3};
+static timer_counter_t * timer_counters[] = {&tc0, &tc1, &tc2, &tc3};
+
+/* ms_ticks is advanced by the TC0 ISR (see timers_tick()) */
+static timers_state_t * g_timers_state = NULL;
+
+/*
+ * Look up a timer/counter.  Since we should have full coverage of
+ * timer/counters in timer_counter_e, we do not handle an error case.
+ */
+static timer_counter_t * timers_find_timer_counter(timer_counter_e timer_counter)
+{
+    int i;
+    for (i = 0; i < COUNT_OF(timer_counters) - 1; i++) {
+        if (timer_counters[i]->id == timer_counter) {
+            break;
+        }
+    }
+    return timer_counters[i];
+}
+
+/*
+ * Write an OCRnx/ICRn register.  16-bit registers are written through
+ * the shared TEMP register (high byte first), so the write is done with
+ * interrupts off to keep an ISR access from tearing it.
+ */
+static void timers_write_register(
+        timer_counter_t * tc,
+        volatile uint8_t * reg,
+        uint16_t value)
+{
+    if (tc->width == WIDTH_8_BITS) {
+        *reg = (uint8_t)value;
+    } else {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            *(volatile uint16_t *)reg = value;
+        }
+    }
+}
+
+/*
+ * The value of a fixed TOP (0 for TIMER_TOP_OCRA and TIMER_TOP_ICR)
+ */
+static uint16_t timers_fixed_top(timer_counter_t * tc, timer_top_e top)
+{
+    switch (top) {
+    case TIMER_TOP_MAX:
+        return tc->width;
+    case TIMER_TOP_8_BIT:
+        return 0x00FF;
+    case TIMER_TOP_9_BIT:
+        return 0x01FF;
+    case TIMER_TOP_10_BIT:
+        return 0x03FF;
+    default:
+        return 0;
+    }
+}
 
 /*
- * Give a target period, divisor and width try to find optimal value
+ * Look up the waveform generation mode for a mode and TOP (NULL if the
+ * timer does not have it)
+ */
+static const clock_mode_t * timers_find_mode(
+        timer_counter_t * tc,
+        timer_counter_mode_e mode,
+        timer_top_e top)
+{
+    int i;
+    if (mode == TIMER_MODE_CTC_PHASE_ACCUMULATE) {
+        mode = TIMER_MODE_CTC;
+    }
+    for (i = 0; i < tc->number_modes; i++) {
+        if (tc->modes[i].mode == mode && tc->modes[i].top == top) {
+            return &tc->modes[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Write WGMn3:0 (split over TCCRnA and TCCRnB)
+ */
+static void timers_set_mode(timer_counter_t * tc, const clock_mode_t * mode)
+{
+    *tc->regs.tccra = (*tc->regs.tccra & ~TCCRA_WGM_MASK) |
+            (mode->mode_flags & TCCRA_WGM_MASK);
+    *tc->regs.tccrb = (*tc->regs.tccrb & ~TCCRB_WGM_MASK) |
+            ((mode->mode_flags << TCCRB_WGM_SHIFT) & TCCRB_WGM_MASK);
+    tc->top_source = mode->top;
+}
+
+static void timers_set_divider(timer_counter_t * tc, uint8_t divider)
+{
+    *tc->regs.tccrb = (*tc->regs.tccrb & ~TCCRB_CS_MASK) | (divider & TCCRB_CS_MASK);
+}
+
+/*
+ * Set TOP (for TIMER_TOP_OCRA and TIMER_TOP_ICR)
+ */
+static void timers_set_top(timer_counter_t * tc, uint16_t top)
+{
+    if (tc->top_source == TIMER_TOP_ICR) {
+        timers_write_register(tc, tc->regs.icr, top);
+    } else {
+        timers_write_register(tc, tc->regs.ocra, top);
+    }
+    tc->top = top;
+}
+
+/*
+ * Given a target period (in CPU cycles), divisor and width find the TOP
+ * value that gets closest to it.
+ *
+ * In CTC mode a period is TOP + 1 counts of the divided clock, so the
+ * best TOP is one less than either the whole number of counts just
+ * below the target or the one just above.  Both are tried, since the
+ * one below may fit when the one above does not.  With phase_accumulate
+ * the lower one is always used, and the rest of the target is left to
+ * timers_phase_accumulate() (which needs room for TOP + 1 as well).
  */
 static timer_counter_search_result_t find_top_value(
-        uint32_t target_period_us,
+        uint32_t target_cycles,
         uint16_t clock_divisor,
-        uint16_t width)
+        uint16_t width,
+        bool phase_accumulate)
 {
-    timer_counter_search_result_t result;
-    uint32_t top;
-    top = (uint64_t)((20 * target_period_us) / clock_divisor);
-    if (top > width) {
-        result.match_found = false;
-        result.top_value = 0;
-        result.delta_us = 0;
+    timer_counter_search_result_t result = { .match_found = false };
+    uint32_t counts = target_cycles / clock_divisor;
+    uint32_t remainder = target_cycles % clock_divisor;
+    uint32_t error_cycles;
+
+    if (phase_accumulate) {
+        if (counts >= 1 && counts <= width) {
+            result.match_found = true;
+            result.top_value = counts - 1;
+            result.error_ppm = 0;
+            result.phase_step = remainder;
+        }
+        return result;
+    }
+
+    if (remainder * 2 >= clock_divisor && counts <= width) {
+        /* rounding up is closer, and fits */
+        counts++;
+        error_cycles = clock_divisor - remainder;
     } else {
-        uint32_t achieved_period_us;
-        achieved_period_us = (clock_divisor * top) / 20;
+        error_cycles = remainder;
+    }
+    if (counts >= 1 && counts - 1 <= width) {
         result.match_found = true;
-        result.top_value = (uint32_t)top;
-        result.delta_us = (uint32_t)abs(achieved_period_us - target_period_us);
+        result.top_value = counts - 1;
+        result.error_ppm = (uint32_t)((uint64_t)error_cycles * 1000000UL / target_cycles);
     }
     return result;
 }
@@ -195,20 +357,37 @@ static timer_counter_search_result_t find_top_value(
 static int timers_program_timer(
         timer_counter_t * timer_counter,
         clock_divider_value_t * divisor,
-        uint16_t top,
+        timer_counter_search_result_t * search_result,
         timer_counter_mode_e mode)
 {
-    LOG("Setting divider: %u, top: %u\r\n", divisor->denominator, top);
-    timer_counter->set_mode(mode);
-    timer_counter->set_divider(divisor->clock_select_flags);
-    timer_counter->top_info.set_top(top);
+    uint16_t top = (uint16_t)search_result->top_value;
+    LOG("Setting divider: %u, top: %u, error: %lu ppm\r\n",
+            divisor->denominator, top, search_result->error_ppm);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        timer_counter->phase_accumulate = (mode == TIMER_MODE_CTC_PHASE_ACCUMULATE);
+        timer_counter->phase_top = top;
+        timer_counter->phase_divisor = divisor->denominator;
+        timer_counter->phase_step = search_result->phase_step;
+        /* the first period runs at TOP + 1 counts, so it is already short */
+        timer_counter->phase = search_result->phase_step;
+        timers_set_mode(timer_counter,
+                timers_find_mode(timer_counter, TIMER_MODE_CTC, TIMER_TOP_OCRA));
+        timers_set_divider(timer_counter, divisor->clock_select_flags);
+        timers_set_top(timer_counter, top);
+    }
     return 0;
 }
 
 /*
  * Setup (or change the setup for) a timer.  An attempt will
  * be made to setup the timer to match the target period as
- * closely as possible.
+ * closely as possible, using the prescaler/TOP pair with the
+ * smallest error (the smallest prescaler on a tie).
+ *
+ * With TIMER_MODE_CTC_PHASE_ACCUMULATE the average period is exact
+ * (to the CPU clock), as long as the timer's compare ISR calls
+ * timers_phase_accumulate() each period; single periods are then
+ * off by up to one count.
  *
  * If a timer cannot be setup that is close (e.g. in the
  * feasible range) a negative value will be returned.
@@ -220,35 +399,35 @@ int timers_setup_timer(
 {
     int i;
     int result;
+    uint32_t target_cycles;
     timer_counter_t * tc;
     clock_divider_value_t * divisor;
     timer_counter_search_result_t search_result;
 
-    /* get a reference to our timer/counter.  Since we should have
-     * full coverage of timer/counters in timer_counter_e, we do not
-     * handle an error case.
-     */
-    for (i = 0; i < COUNT_OF(timer_counters); i++) {
-        tc = timer_counters[i];
-        if (tc->id == timer_counter) {
-            break;
-        }
-    }
+    tc = timers_find_timer_counter(timer_counter);
 
     LOG("Setting up timer %s (period_ms: %lu)\r\n",
             tc->name, target_period_microseconds / 1000);
 
+    if (target_period_microseconds == 0 ||
+            target_period_microseconds > UINT32_MAX / TIMERS_CYCLES_PER_US) {
+        LOG("Period out of range\r\n");
+        return -1;
+    }
+    target_cycles = target_period_microseconds * TIMERS_CYCLES_PER_US;
+
     /* find the most appropriate pre-scaler/top value */
     clock_divider_value_t * best_divisor = NULL;
-    timer_counter_search_result_t best_search_result = { .delta_us = UINT32_MAX };
-    for (i = 0; i < COUNT_OF(tc->divisors); i++) {
+    timer_counter_search_result_t best_search_result = { .error_ppm = UINT32_MAX };
+    for (i = 0; i < tc->number_divisors; i++) {
         divisor = &tc->divisors[i];
         search_result = find_top_value(
-                target_period_microseconds,
+                target_cycles,
                 divisor->denominator,
-                tc->top_info.width);
+                tc->width,
+                mode == TIMER_MODE_CTC_PHASE_ACCUMULATE);
         if (search_result.match_found) {
-            if (search_result.delta_us < best_search_result.delta_us) {
+            if (search_result.error_ppm < best_search_result.error_ppm) {
                 best_search_result = search_result;
                 best_divisor = divisor;
             }
@@ -259,9 +438,384 @@ int timers_setup_timer(
         LOG("Search found no workable divisor/top value pair\r\n");
         result = -1;
     } else {
-        result = timers_program_timer(
-            tc, best_divisor, (uint16_t)best_search_result.top_value, mode);
+        result = timers_program_timer(tc, best_divisor, &best_search_result, mode);
     }
 
     return result;
 }
+
+/*
+ * Called from a timer's compare match ISR when it was set up with
+ * TIMER_MODE_CTC_PHASE_ACCUMULATE (does nothing otherwise).
+ *
+ * Sets the length of the period that has just started: TOP + 1 counts,
+ * or one count more whenever the accumulated remainder adds up to a
+ * whole count.  The counter has only just been cleared, so the new
+ * compare value is still ahead of it.
+ */
+void timers_phase_accumulate(timer_counter_e timer_counter)
+{
+    timer_counter_t * tc = timers_find_timer_counter(timer_counter);
+    if (!tc->phase_accumulate) {
+        return;
+    }
+    tc->phase += tc->phase_step;
+    if (tc->phase >= tc->phase_divisor) {
+        tc->phase -= tc->phase_divisor;
+        timers_write_register(tc, tc->regs.ocra, tc->phase_top + 1);
+    } else {
+        timers_write_register(tc, tc->regs.ocra, tc->phase_top);
+    }
+}
+
+/*
+ * Start a timer counting freely (to MAX and wrap) at clk/divisor.
+ * Returns a negative value if the timer does not have the divisor.
+ */
+int timers_setup_normal(timer_counter_e timer_counter, uint16_t divisor)
+{
+    int i;
+    timer_counter_t * tc = timers_find_timer_counter(timer_counter);
+    for (i = 0; i < tc->number_divisors; i++) {
+        if (tc->divisors[i].denominator == divisor) {
+            break;
+        }
+    }
+    if (i == tc->number_divisors) {
+        LOG("%s has no divider %u\r\n", tc->name, divisor);
+        return -1;
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        tc->phase_accumulate = false;
+        timers_set_mode(tc, timers_find_mode(tc, TIMER_MODE_NORMAL, TIMER_TOP_MAX));
+        timers_set_divider(tc, tc->divisors[i].clock_select_flags);
+        tc->top = tc->width;
+    }
+    return 0;
+}
+
+/*
+ * Set a timer up for PWM at (as close as it can get to) a frequency.
+ *
+ * The resolution is picked with `top'.  A fixed 8, 9 or 10-bit TOP
+ * gives that many bits of duty cycle, and only the prescaler is
+ * searched, so the frequency is as close as the prescaler steps allow.
+ * With TIMER_TOP_OCRA or TIMER_TOP_ICR the TOP is searched as well, for
+ * a close frequency with as many duty cycle steps as that leaves (see
+ * timers_get_top()).  A Fast PWM period is TOP + 1 counts; a phase
+ * correct one counts up and back down, 2 * TOP counts.
+ *
+ * Outputs are left as they were (see timers_set_output()).  Returns a
+ * negative value if the timer does not have the mode, or if no setting
+ * fits.
+ */
+int timers_setup_pwm(
+        timer_counter_e timer_counter,
+        timer_counter_mode_e mode,
+        timer_top_e top,
+        uint32_t frequency_hz)
+{
+    int i;
+    bool fast = (mode == TIMER_MODE_FAST_PWM);
+    uint32_t target_cycles;
+    uint32_t cycles;
+    uint64_t error_ppm;
+    uint16_t steps;
+    uint16_t fixed_top;
+    timer_counter_t * tc;
+    const clock_mode_t * clock_mode = NULL;
+    clock_divider_value_t * divisor;
+    clock_divider_value_t * best_divisor = NULL;
+    timer_counter_search_result_t search_result;
+    timer_counter_search_result_t best_search_result = { .error_ppm = UINT32_MAX };
+
+    tc = timers_find_timer_counter(timer_counter);
+
+    LOG("Setting up PWM on %s (%lu Hz)\r\n", tc->name, frequency_hz);
+
+    if (fast || mode == TIMER_MODE_PHASE_CORRECT_PWM) {
+        clock_mode = timers_find_mode(tc, mode, top);
+    }
+    if (clock_mode == NULL) {
+        LOG("No such PWM mode on this timer\r\n");
+        return -1;
+    }
+    if (frequency_hz == 0 || frequency_hz > F_CPU / 2) {
+        LOG("Frequency out of range\r\n");
+        return -1;
+    }
+    target_cycles = (F_CPU + frequency_hz / 2) / frequency_hz;
+    fixed_top = timers_fixed_top(tc, top);
+
+    for (i = 0; i < tc->number_divisors; i++) {
+        divisor = &tc->divisors[i];
+        /* CPU cycles per count of the period: phase correct counts
+         * every step twice */
+        steps = divisor->denominator * (fast ? 1 : 2);
+        if (fixed_top != 0) {
+            cycles = (uint32_t)steps * (fast ? fixed_top + 1UL : fixed_top);
+            search_result.match_found = true;
+            search_result.top_value = fixed_top;
+            error_ppm = (uint64_t)
+                    (cycles > target_cycles ? cycles - target_cycles : target_cycles - cycles) *
+                    1000000UL / target_cycles;
+            /* a fixed TOP far too long for the frequency is off by more
+             * than 32 bits of ppm; held just under the limit, the
+             * smallest (closest) prescaler still wins */
+            search_result.error_ppm = (error_ppm < UINT32_MAX) ?
+                    (uint32_t)error_ppm : UINT32_MAX - 1;
+        } else if (fast) {
+            search_result = find_top_value(target_cycles, steps, tc->width, false);
+        } else {
+            /* a period of TOP counts, rather than TOP + 1 */
+            search_result = find_top_value(target_cycles, steps, tc->width - 1, false);
+            search_result.top_value++;
+        }
+        if (search_result.match_found &&
+                search_result.error_ppm < best_search_result.error_ppm) {
+            best_search_result = search_result;
+            best_divisor = divisor;
+        }
+    }
+
+    if (best_divisor == NULL) {
+        LOG("Search found no workable divisor/top value pair\r\n");
+        return -1;
+    }
+
+    LOG("Setting divider: %u, top: %lu, error: %lu ppm\r\n",
+            best_divisor->denominator, best_search_result.top_value,
+            best_search_result.error_ppm);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        tc->phase_accumulate = false;
+        timers_set_mode(tc, clock_mode);
+        if (fixed_top != 0) {
+            tc->top = fixed_top;
+        } else {
+            timers_set_top(tc, (uint16_t)best_search_result.top_value);
+        }
+        timers_set_divider(tc, best_divisor->clock_select_flags);
+    }
+    return 0;
+}
+
+/*
+ * Get a timer's TOP as last set up.  For PWM this is the duty cycle
+ * that gives 100% (so TOP + 1 steps of resolution).
+ */
+uint16_t timers_get_top(timer_counter_e timer_counter)
+{
+    return timers_find_timer_counter(timer_counter)->top;
+}
+
+/*
+ * Connect (or disconnect) the OCnA/OCnB pin.  The pin also has to be
+ * made an output in its DDR.
+ */
+void timers_set_output(
+        timer_counter_e timer_counter,
+        timer_channel_e channel,
+        timer_output_e output)
+{
+    timer_counter_t * tc = timers_find_timer_counter(timer_counter);
+    uint8_t shift = (channel == TIMER_CHANNEL_A) ? TCCRA_COMA_SHIFT : TCCRA_COMB_SHIFT;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        *tc->regs.tccra = (*tc->regs.tccra & ~(TCCRA_COM_MASK << shift)) |
+                ((output & TCCRA_COM_MASK) << shift);
+    }
+}
+
+/*
+ * Set the PWM duty cycle of a channel, in counts of TOP (capped at
+ * TOP).  In the PWM modes the new value is double buffered by the
+ * hardware and takes effect at the end of the period.  Channel A cannot
+ * be used when OCRnA is TOP.
+ */
+void timers_set_duty(
+        timer_counter_e timer_counter,
+        timer_channel_e channel,
+        uint16_t duty)
+{
+    timer_counter_t * tc = timers_find_timer_counter(timer_counter);
+    if (duty > tc->top) {
+        duty = tc->top;
+    }
+    if (channel == TIMER_CHANNEL_B) {
+        timers_write_register(tc, tc->regs.ocrb, duty);
+    } else if (tc->top_source != TIMER_TOP_OCRA) {
+        timers_write_register(tc, tc->regs.ocra, duty);
+    }
+}
+
+/*
+ * Capture the timer count into ICRn on an edge of the ICPn pin (TC1
+ * and TC3 only, and not while ICRn is TOP).
+ *
+ * The noise canceler only takes an edge once the pin has held its new
+ * level for four samples, which delays the capture by four CPU cycles.
+ * With `interrupt' the TIMERn_CAPT ISR runs on each capture; otherwise
+ * poll ICFn and read timers_get_capture().
+ */
+int timers_setup_input_capture(
+        timer_counter_e timer_counter,
+        timer_capture_edge_e edge,
+        bool noise_canceler,
+        bool interrupt)
+{
+    timer_counter_t * tc = timers_find_timer_counter(timer_counter);
+    if (tc->regs.icr == NULL || tc->top_source == TIMER_TOP_ICR) {
+        LOG("No input capture on %s\r\n", tc->name);
+        return -1;
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        *tc->regs.tccrb = (*tc->regs.tccrb & ~(1 << ICNC1 | 1 << ICES1)) |
+                (noise_canceler ? (1 << ICNC1) : 0) |
+                (edge == TIMER_CAPTURE_RISING ? (1 << ICES1) : 0);
+        /* changing the edge may set the flag (datasheet 16.6.3) */
+        *tc->regs.tifr = (1 << ICF1);
+        if (interrupt) {
+            *tc->regs.timsk |= (1 << ICIE1);
+        } else {
+            *tc->regs.timsk &= ~(1 << ICIE1);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Read the count at the last input capture
+ */
+uint16_t timers_get_capture(timer_counter_e timer_counter)
+{
+    uint16_t capture;
+    timer_counter_t * tc = timers_find_timer_counter(timer_counter);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        capture = *(volatile uint16_t *)tc->regs.icr;
+    }
+    return capture;
+}
+
+/*
+ * Unmask (or mask) the TIMERn_OVF interrupt
+ */
+void timers_set_overflow_interrupt(timer_counter_e timer_counter, bool enable)
+{
+    timer_counter_t * tc = timers_find_timer_counter(timer_counter);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (enable) {
+            *tc->regs.timsk |= (1 << TOIE1);
+        } else {
+            *tc->regs.timsk &= ~(1 << TOIE1);
+        }
+    }
+}
+
+/*
+ * Start TC1 counting freely as the profile clock
+ *
+ * TC1 is otherwise unused in this lab, so it is left in normal mode
+ * (count to 0xFFFF and wrap) with no interrupts.
+ */
+void timers_init_profile_clock(void)
+{
+    timers_setup_normal(TIMER_COUNTER1, PROFILE_CLOCK_DIVISOR);
+    TCNT1 = 0;
+}
+
+/*
+ * Read the profile clock
+ *
+ * The 16-bit read goes through the shared TEMP register, so it is done
+ * with interrupts off to keep an ISR read from tearing it.  Differences
+ * between two readings are valid as long as they are less than one
+ * wrap apart.
+ */
+uint16_t timers_get_profile_ticks(void)
+{
+    uint16_t ticks;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ticks = TCNT1;
+    }
+    return ticks;
+}
+
+/*
+ * Set up the system time base.  TC0 must already be running as the
+ * TIMERS_TICK_US tick, with its ISR calling timers_tick().
+ */
+void timers_init_uptime(timers_state_t * timers_state)
+{
+    g_timers_state = timers_state;
+}
+
+/*
+ * Take a consistent snapshot of the system time: the tick count and the
+ * number of TC0 counts into the current tick.
+ *
+ * If the compare match has happened but its ISR has not run yet (we have
+ * interrupts off, or are in another ISR), TCNT0 has already gone back to
+ * 0 while ms_ticks still holds the last tick.  The pending tick is
+ * counted here so the time never steps backwards.  TCNT0 is read again
+ * once the flag is seen, since the match may have come between the two.
+ */
+static void timers_read_uptime(uint64_t * ticks, uint8_t * count, uint8_t * top)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        *ticks = (uint64_t)g_timers_state->ms_ticks_wraps << 32 |
+                g_timers_state->ms_ticks;
+        *count = TCNT0;
+        *top = OCR0A;
+        if (TIFR0 & (1 << OCF0A)) {
+            *count = TCNT0;
+            (*ticks)++;
+        }
+    }
+}
+
+/*
+ * Get the number of milliseconds the system has been alive
+ *
+ * In actuality, there is a small amount time between when
+ * we get power and when we start counting.  This doesn't really
+ * matter in practice.  Safe to call from anywhere, including with
+ * interrupts off.
+ */
+uint32_t timers_get_uptime_ms(void)
+{
+    uint32_t ms;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ms = g_timers_state->ms_ticks;
+        if (TIFR0 & (1 << OCF0A)) {
+            ms++;
+        }
+    }
+    return ms;
+}
+
+/*
+ * Get the uptime in microseconds (wraps every ~71 minutes)
+ *
+ * Resolution is one TC0 count (12.8us with the 1ms tick at 20MHz).  Use
+ * for time differences; timers_get_uptime_us64() does not wrap.
+ */
+uint32_t timers_get_uptime_us(void)
+{
+    uint64_t ticks;
+    uint8_t count, top;
+    timers_read_uptime(&ticks, &count, &top);
+    /* 32-bit math is much cheaper on the AVR, and gives the same low bits */
+    return (uint32_t)ticks * TIMERS_TICK_US +
+            (uint32_t)count * TIMERS_TICK_US / ((uint16_t)top + 1);
+}
+
+/*
+ * Get the uptime in microseconds as a 64-bit monotonic count
+ */
+uint64_t timers_get_uptime_us64(void)
+{
+    uint64_t ticks;
+    uint8_t count, top;
+    timers_read_uptime(&ticks, &count, &top);
+    return ticks * TIMERS_TICK_US +
+            (uint32_t)count * TIMERS_TICK_US / ((uint16_t)top + 1);
+}
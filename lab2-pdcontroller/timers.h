@@ -17,18 +17,215 @@ typedef enum {
 } timer_counter_e;
 
 typedef enum {
-    TIMER_MODE_CTC
+    /* count up to the timer's MAX and wrap (see timers_setup_normal) */
+    TIMER_MODE_NORMAL,
+    TIMER_MODE_CTC,
+    /* CTC, with the period corrected on average (see timers_setup_timer) */
+    TIMER_MODE_CTC_PHASE_ACCUMULATE,
+    /* PWM modes (see timers_setup_pwm) */
+    TIMER_MODE_FAST_PWM,
+    TIMER_MODE_PHASE_CORRECT_PWM
 } timer_counter_mode_e;
 
+/*
+ * Where a timer's TOP comes from.  The 9 and 10-bit TOPs and ICRn are
+ * only on the 16-bit timers (TC1 and TC3).  Using OCRnA as TOP gives
+ * up output A; using ICRn gives up input capture.
+ */
+typedef enum {
+    TIMER_TOP_MAX,
+    TIMER_TOP_8_BIT,
+    TIMER_TOP_9_BIT,
+    TIMER_TOP_10_BIT,
+    TIMER_TOP_OCRA,
+    TIMER_TOP_ICR
+} timer_top_e;
+
+typedef enum {
+    TIMER_CHANNEL_A,
+    TIMER_CHANNEL_B
+} timer_channel_e;
+
+/* what the OCnx pin does (COMnx1:0) */
+typedef enum {
+    TIMER_OUTPUT_DISCONNECTED,
+    /* toggle on compare match (non-PWM modes only) */
+    TIMER_OUTPUT_TOGGLE,
+    /* PWM: high for duty counts of each period */
+    TIMER_OUTPUT_NON_INVERTING,
+    /* PWM: low for duty counts of each period */
+    TIMER_OUTPUT_INVERTING
+} timer_output_e;
+
+typedef enum {
+    TIMER_CAPTURE_FALLING,
+    TIMER_CAPTURE_RISING
+} timer_capture_edge_e;
+
+#ifndef F_CPU
+#error "F_CPU must be set to the CPU clock (see Makefile)"
+#endif
+#if F_CPU % 1000000UL != 0
+#error "timers expect a whole number of CPU cycles per us"
+#endif
+#define TIMERS_CYCLES_PER_US (F_CPU / 1000000UL)
+
+/*
+ * Profile clock: TC1 free running at clk/64 (3.2us/tick at 20MHz,
+ * wraps every ~209ms).  Used to time tasks with sub-ms resolution.
+ *
+ * Ticks per ms are kept as a fraction in lowest terms (312.5 = 625/2 at
+ * 20MHz), so the ms conversions stay exact and well inside 32 bits.  A
+ * different F_CPU needs a new fraction, which the assert below asks for.
+ */
+#define PROFILE_CLOCK_DIVISOR  (64)
+#define PROFILE_TICKS_PER_S    (F_CPU / PROFILE_CLOCK_DIVISOR)
+#define PROFILE_TICKS_PER_MS_NUM (625)
+#define PROFILE_TICKS_PER_MS_DEN (2)
+#define PROFILE_TICKS_TO_US(t) (((uint32_t)(t) * PROFILE_CLOCK_DIVISOR) / TIMERS_CYCLES_PER_US)
+#define PROFILE_TICKS_TO_MS(t) (((uint32_t)(t) / PROFILE_TICKS_PER_MS_NUM) * PROFILE_TICKS_PER_MS_DEN)
+#define PROFILE_MS_TO_TICKS(ms) (((uint32_t)(ms) * PROFILE_TICKS_PER_MS_NUM) / PROFILE_TICKS_PER_MS_DEN)
+_Static_assert(PROFILE_TICKS_PER_MS_NUM * 1000UL * PROFILE_CLOCK_DIVISOR ==
+        PROFILE_TICKS_PER_MS_DEN * F_CPU,
+        "PROFILE_TICKS_PER_MS_NUM / PROFILE_TICKS_PER_MS_DEN must be F_CPU / PROFILE_CLOCK_DIVISOR / 1000");
+
+/* Period of the TC0 system tick that drives ms_ticks */
+#define TIMERS_TICK_US (1000UL)
+
 typedef struct {
   /* ticks */
   volatile uint32_t ms_ticks;
+  /* times ms_ticks has wrapped (every ~49.7 days) */
+  volatile uint16_t ms_ticks_wraps;
 } timers_state_t;
 
+/*
+ * Advance the system time by one tick.  Called from the TC0 compare
+ * match ISR.
+ */
+static inline void timers_tick(timers_state_t * timers_state)
+{
+    if (++timers_state->ms_ticks == 0) {
+        timers_state->ms_ticks_wraps++;
+    }
+}
+
+/*
+ * Compile-time timer setup
+ *
+ * For a period known at build time, TIMERS_SETUP_CTC_TCn(period_us)
+ * picks the prescaler and TOP as constant expressions and compiles down
+ * to the register writes, with none of the search (or logging) that
+ * timers_setup_timer() does at run time.  The smallest prescaler whose
+ * TOP fits is used, as it gives the finest step.  The build fails if the
+ * period does not fit the timer at all, or if the closest setting is
+ * further than TIMERS_MAX_ERROR_PPM from the period asked for.
+ *
+ * In CTC mode the period is (TOP + 1) * prescaler / clock.
+ */
+#define TIMERS_CLOCK_HZ ((unsigned long long)F_CPU)
+
+/* 0.2%: 1ms on the 8-bit TC0 can only be met to 0.16% at 20MHz */
+#ifndef TIMERS_MAX_ERROR_PPM
+#define TIMERS_MAX_ERROR_PPM (2000)
+#endif
+
+#define TIMERS_WIDTH_TC0 (0xFFULL)
+#define TIMERS_WIDTH_TC1 (0xFFFFULL)
+#define TIMERS_WIDTH_TC3 (0xFFFFULL)
+
+/* timer counts in period_us at a prescaler, rounded to nearest (a 0
+ * prescaler only shows up in branches that are not taken) */
+#define TIMERS_CT_COUNTS(period_us, div) \
+    (((unsigned long long)(period_us) * TIMERS_CLOCK_HZ + 500000ULL * (div)) / \
+     (1000000ULL * ((div) ? (div) : 1)))
+#define TIMERS_CT_FITS(period_us, div, width) \
+    (TIMERS_CT_COUNTS(period_us, div) >= 1 && \
+     TIMERS_CT_COUNTS(period_us, div) - 1 <= (width))
+/* prescaler to use (0 if the period is out of range) */
+#define TIMERS_CT_DIVISOR(period_us, width) \
+    (TIMERS_CT_FITS(period_us, 1, width) ? 1 : \
+     TIMERS_CT_FITS(period_us, 8, width) ? 8 : \
+     TIMERS_CT_FITS(period_us, 64, width) ? 64 : \
+     TIMERS_CT_FITS(period_us, 256, width) ? 256 : \
+     TIMERS_CT_FITS(period_us, 1024, width) ? 1024 : 0)
+#define TIMERS_CT_TOP(period_us, width) \
+    (TIMERS_CT_COUNTS(period_us, TIMERS_CT_DIVISOR(period_us, width)) - 1)
+/* achieved period, in clock cycles (vs period_us * clock / 1e6 wanted) */
+#define TIMERS_CT_CYCLES(period_us, width) \
+    ((TIMERS_CT_TOP(period_us, width) + 1) * TIMERS_CT_DIVISOR(period_us, width))
+#define TIMERS_CT_ERROR_PPM(period_us, width) \
+    (((TIMERS_CT_CYCLES(period_us, width) * 1000000ULL > (period_us) * TIMERS_CLOCK_HZ) ? \
+      (TIMERS_CT_CYCLES(period_us, width) * 1000000ULL - (period_us) * TIMERS_CLOCK_HZ) : \
+      ((period_us) * TIMERS_CLOCK_HZ - TIMERS_CT_CYCLES(period_us, width) * 1000000ULL)) / \
+     ((period_us) * TIMERS_CLOCK_HZ / 1000000ULL))
+/* CSn2:0 for a prescaler (the same on TC0, TC1 and TC3) */
+#define TIMERS_CT_CLOCK_SELECT(div) \
+    ((div) == 1 ? 1 : (div) == 8 ? 2 : (div) == 64 ? 3 : (div) == 256 ? 4 : 5)
+
+#define TIMERS_CT_CHECK(period_us, width, name) \
+    _Static_assert(TIMERS_CT_DIVISOR(period_us, width) != 0, \
+                   "period out of range for " name); \
+    _Static_assert(TIMERS_CT_DIVISOR(period_us, width) == 0 || \
+                   TIMERS_CT_ERROR_PPM(period_us, width) <= TIMERS_MAX_ERROR_PPM, \
+                   "no exact enough prescaler/TOP for this period on " name)
+
+#define TIMERS_SETUP_CTC_TC0(period_us) do { \
+    TIMERS_CT_CHECK(period_us, TIMERS_WIDTH_TC0, "TC0"); \
+    TCCR0A = (TCCR0A & ~(1 << WGM00)) | (1 << WGM01); \
+    TCCR0B = (TCCR0B & ~(1 << WGM02 | 1 << CS02 | 1 << CS01 | 1 << CS00)) | \
+        TIMERS_CT_CLOCK_SELECT(TIMERS_CT_DIVISOR(period_us, TIMERS_WIDTH_TC0)); \
+    OCR0A = TIMERS_CT_TOP(period_us, TIMERS_WIDTH_TC0); \
+} while (0)
+
+#define TIMERS_SETUP_CTC_TC1(period_us) do { \
+    TIMERS_CT_CHECK(period_us, TIMERS_WIDTH_TC1, "TC1"); \
+    TCCR1A &= ~(1 << WGM11 | 1 << WGM10); \
+    TCCR1B = (TCCR1B & ~(1 << WGM13 | 1 << CS12 | 1 << CS11 | 1 << CS10)) | (1 << WGM12) | \
+        TIMERS_CT_CLOCK_SELECT(TIMERS_CT_DIVISOR(period_us, TIMERS_WIDTH_TC1)); \
+    OCR1A = TIMERS_CT_TOP(period_us, TIMERS_WIDTH_TC1); \
+} while (0)
+
+#define TIMERS_SETUP_CTC_TC3(period_us) do { \
+    TIMERS_CT_CHECK(period_us, TIMERS_WIDTH_TC3, "TC3"); \
+    TCCR3A &= ~(1 << WGM31 | 1 << WGM30); \
+    TCCR3B = (TCCR3B & ~(1 << WGM33 | 1 << CS32 | 1 << CS31 | 1 << CS30)) | (1 << WGM32) | \
+        TIMERS_CT_CLOCK_SELECT(TIMERS_CT_DIVISOR(period_us, TIMERS_WIDTH_TC3)); \
+    OCR3A = TIMERS_CT_TOP(period_us, TIMERS_WIDTH_TC3); \
+} while (0)
+
 int timers_setup_timer(
         timer_counter_e timer_counter,
         timer_counter_mode_e mode,
         uint32_t target_period_microseconds);
-uint32_t timers_get_uptime_ms();
+void timers_phase_accumulate(timer_counter_e timer_counter);
+void timers_init_uptime(timers_state_t * timers_state);
+uint32_t timers_get_uptime_ms(void);
+uint32_t timers_get_uptime_us(void);
+uint64_t timers_get_uptime_us64(void);
+int timers_setup_normal(timer_counter_e timer_counter, uint16_t divisor);
+int timers_setup_pwm(
+        timer_counter_e timer_counter,
+        timer_counter_mode_e mode,
+        timer_top_e top,
+        uint32_t frequency_hz);
+uint16_t timers_get_top(timer_counter_e timer_counter);
+void timers_set_output(
+        timer_counter_e timer_counter,
+        timer_channel_e channel,
+        timer_output_e output);
+void timers_set_duty(
+        timer_counter_e timer_counter,
+        timer_channel_e channel,
+        uint16_t duty);
+int timers_setup_input_capture(
+        timer_counter_e timer_counter,
+        timer_capture_edge_e edge,
+        bool noise_canceler,
+        bool interrupt);
+uint16_t timers_get_capture(timer_counter_e timer_counter);
+void timers_set_overflow_interrupt(timer_counter_e timer_counter, bool enable);
+void timers_init_profile_clock(void);
+uint16_t timers_get_profile_ticks(void);
 
 #endif //__TIMER_H